@@ -1,71 +1,99 @@
 #include "AuthHandle.h"
-#include <random>
-#include <sstream>
-#include <iomanip>
+#include "session_table.h"
+#include "config.h"
+#include "logger.h"
+#include <semaphore>
+#include <memory>
+#include <chrono>
+#include <sodium.h>
 
 namespace AuthHandle
 {
-    //static members?
-    std::unordered_map<std::string, int> sessions;
-    std::mutex sessions_mutex;
+    static std::unique_ptr<std::counting_semaphore<>> hashing_slots;
 
-    std::string genSessionID()
+    //the cookie value back to the 16 bytes it was made from. Anything that isn't exactly 32 hex characters is no session.
+    static std::optional<sessionTable::ID> parseSessionID(const std::string& sessionID)
     {
-        //see if you can find a better library to create uuid's
-        std::random_device rd;
-        std::mt19937 gen(rd());
-        std::uniform_int_distribution<> dis(0, 255);
-
-        std::stringstream ss;
-        //limit is 16 bytes for 128 bit session id.
-        for (int i = 0; i < 16; ++i)
+        sessionTable::ID id;
+        size_t length = 0;
+        if (sessionID.size() != id.size() * 2 ||
+            sodium_hex2bin(id.data(), id.size(), sessionID.c_str(), sessionID.size(), nullptr, &length, nullptr) != 0 ||
+            length != id.size())
         {
-            //this line right here creates the 128 session id through iteration
-            //hex makes the output format into hexadecimal
-            //setw adds padding and setfill adds a char 0 inbetween the gaps actively changing the id.
-            ss << std::hex << std::setw(2) << std::setfill('0') << dis(gen);
+            return std::nullopt;
         }
-        return ss.str(); //assuming that this returns the id
+        return id;
     }
 
-    void storeSession(const std::string& sessionID, const int userID)
+    std::string genSessionID()
     {
-        //mutex creates a lock for a thread so that this happens only once at a time.
-        //prevents multiple threads trying to access this at the same time.
-        //this line in particular calls the session_mutex and checks if it is locked. If not it locks it until done
-        //if it is locked when called this thread will be paused until this is unlocked
-        std::lock_guard<std::mutex> lock(sessions_mutex);
-        sessions[sessionID] = userID; //our sessionID becomes our key and our userID is the associated value
-        CROW_LOG_INFO << "Session " << sessionID << " stored for user: " << userID;
+        //128 bits from the os random source through libsodium, then hex so it can go in a cookie
+        sessionTable::ID id;
+        randombytes_buf(id.data(), id.size());
+        char hex[sizeof(id) * 2 + 1];
+        sodium_bin2hex(hex, sizeof(hex), id.data(), id.size());
+        return hex;
     }
 
-    std::optional<int> loadSession(const std::string& sessionID) //apperantly this gets us the user id?
+    bool storeSession(const std::string& sessionID, const int userID)
     {
-        //lock the thread again
-        //remember that lock guard does the locking and unlocking for us
-        std::lock_guard<std::mutex> lock(sessions_mutex);
-        //create an iterator to find the sessionID that we were given
-        auto it = sessions.find(sessionID);
-        if (it != sessions.end()) // as long as the iterator does not reach the end of the map
+        std::optional<sessionTable::ID> id = parseSessionID(sessionID);
+        auto expires = std::chrono::steady_clock::now() + std::chrono::seconds(config::get()->session_ttl_seconds);
+        //no lock: the table is lock-free, and expired sessions are reused by inserts instead of being swept
+        if (!id.has_value() || !sessionTable::insert(*id, userID, expires))
         {
-            return it->second; //we return the userID associated with the sessionID
+            logging::error(logging::Subsystem::Auth, "Session table is full, could not store session", {{"user_id", userID}});
+            return false;
         }
-
-        return std::nullopt; // if we did not find it, we return an optional null.
+        logging::info(logging::Subsystem::Auth, "Session stored", {{"user_id", userID}, {"sessionID", sessionID}});
+        return true;
     }
 
-    void deleteSession(const std::string& sessionID)
+    std::optional<int> loadSession(const std::string& sessionID) //apperantly this gets us the user id?
     {
-        std::lock_guard<std::mutex> lock(sessions_mutex);
-        //this erase function returns the number of instances that were deleted
-        //if none were found, we return a zero
-        if (sessions.erase(sessionID) > 0)
+        std::optional<sessionTable::ID> id = parseSessionID(sessionID);
+        if (!id.has_value())
         {
-            CROW_LOG_INFO << "Session " << sessionID << " deleted";
+            return std::nullopt; // not one of ours
         }
-        else
+        return sessionTable::find(*id); // expired sessions come back empty, same as logging out
+    }
+
+    void deleteSession(const std::string& sessionID)
+    {
+        std::optional<sessionTable::ID> id = parseSessionID(sessionID);
+        bool erased = id.has_value() && sessionTable::erase(*id);
+        logging::info(logging::Subsystem::Auth, erased ? "Session deleted" : "Session not found", {{"sessionID", sessionID}});
+    }
+
+    void initHashing(unsigned slots)
+    {
+        hashing_slots = std::make_unique<std::counting_semaphore<>>(slots);
+    }
+
+    std::optional<std::string> hashPassword(const std::string& plain_password)
+    {
+        char password_hash_buf[crypto_pwhash_STRBYTES];
+        hashing_slots->acquire();
+        int result = crypto_pwhash_str(password_hash_buf,
+                        plain_password.c_str(),
+                        plain_password.length(),
+                        crypto_pwhash_OPSLIMIT_MODERATE,
+                        crypto_pwhash_MEMLIMIT_MODERATE);
+        hashing_slots->release();
+
+        if (result != 0)
         {
-            CROW_LOG_INFO << "Session " << sessionID << " not found";
+            return std::nullopt;
         }
+        return std::string(password_hash_buf);
+    }
+
+    bool verifyPassword(const std::string& password_hash, const std::string& plain_password)
+    {
+        hashing_slots->acquire();
+        int result = crypto_pwhash_str_verify(password_hash.c_str(), plain_password.c_str(), plain_password.length());
+        hashing_slots->release();
+        return result == 0;
     }
 }
\ No newline at end of file
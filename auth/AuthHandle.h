@@ -1,22 +1,25 @@
 #pragma once
 #include <string>
 #include <optional>
-#include <unordered_map>
-#include <mutex>
 #include "crow.h"
 
 
 namespace AuthHandle
 {
-    //extern extends the visibility of variables and functions across multiple files
-    extern std::unordered_map<std::string, int> sessions;
-    extern std::mutex sessions_mutex;
-
+    //sessions are kept in sessionTable (see session_table.h), shared by every worker process.
+    //the sessionID strings here are the 32 hex characters from the cookie, the table only sees the 16 raw bytes.
     std::string genSessionID();
-    void storeSession(const std::string& sessionID, const int userID);
+    //false if the session table has no room left for it
+    bool storeSession(const std::string& sessionID, const int userID);
     //this loads obtains the user ID using the sessionID
     std::optional<int> loadSession(const std::string& sessionID);
     void deleteSession(const std::string& sessionID);
+
+    //crypto_pwhash is slow and memory hungry on purpose, so only hashing_pool_size hashes run at once.
+    //everyone else waits here instead of all of them allocating 256 MiB together.
+    void initHashing(unsigned slots);
+    std::optional<std::string> hashPassword(const std::string& plain_password);
+    bool verifyPassword(const std::string& password_hash, const std::string& plain_password);
     //this function obtains the session ID from crow request
     //because in crow we are going to be adding headers
 
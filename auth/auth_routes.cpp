@@ -2,7 +2,12 @@
 #include "AuthHandle.h"
 #include "db_functions.h"
 #include "user.h"
-#include <sodium.h>
+#include "config.h"
+#include "logger.h"
+#include "admission.h"
+#include "username_filter.h"
+#include "metrics.h"
+#include "request_body.h"
 
 void authRoutes(crow::App<crow::CookieParser>& app)
 {
@@ -10,40 +15,77 @@ void authRoutes(crow::App<crow::CookieParser>& app)
             .methods("POST"_method) // POST method sends data to a server. If successive requests, can create the same order multiple times
     ([](const crow::request& req)
     {
-        auto json = crow::json::load(req.body);
-        //if json is empty or we do not have an instance in the username or password field.
-        //we use .count() which return a 0 or a 1 if a json object has a key.
-        if (!json || !json.count("username") || !json.count("password"))
+        admission::Ticket ticket(admission::RouteClass::Auth);
+        if (!ticket)
         {
-            return crow::response(crow::status::BAD_REQUEST, "Missing username or password");
+            return admission::overloaded();
         }
 
-        //.s() and related functions return the value a json node as a string.
-        std::string username = json["username"].s();
-        std::string plain_password = json["password"].s();
-        //.has_value() is used due to optional data type. Checks if object has a value.
-        if (database::getUsername(username).has_value())
+        //one pass that also checks the lengths, so a bad body never gets near the database or the hasher
+        std::string_view error;
+        std::optional<requestBody::Credentials> credentials = requestBody::parseCredentials(req.body, error);
+        if (!credentials)
         {
-            //in this case it's used to check if the table does not already have this user
-            return crow::response(crow::status::CONFLICT, "Username already exists");
+            return crow::response(crow::status::BAD_REQUEST, std::string(error));
+        }
+        std::string username(credentials->username);
+        std::string plain_password(credentials->password);
+        //the INSERT below settles whether the name is free. This lookup only exists to skip the password hash
+        //for names we already know are taken, so it runs only when the filter says the name might exist.
+        static auto& skipped = metrics::counter("todo_register_lookups_skipped_total");
+        if (!usernameFilter::mightContain(username))
+        {
+            skipped.fetch_add(1, std::memory_order_relaxed);
+        }
+        else
+        {
+            try
+            {
+                //.has_value() is used due to optional data type. Checks if object has a value.
+                if (database::getUsername(username).has_value())
+                {
+                    //in this case it's used to check if the table does not already have this user
+                    return crow::response(crow::status::CONFLICT, "Username already exists");
+                }
+            }
+            catch (const database::unavailable& e)
+            {
+                logging::warning(logging::Subsystem::Auth, "Database unavailable", {{"error", e.what()}});
+                return admission::serviceUnavailable("Database is unavailable, try again shortly");
+            }
+            catch (const std::exception& e)
+            {
+                logging::error(logging::Subsystem::Auth, "Could not look up username", {{"error", e.what()}});
+                return crow::response(crow::status::INTERNAL_SERVER_ERROR, "User registration failed.");
+            }
         }
 
         //this will help us create the hash
-        char password_hash_buf[crypto_pwhash_STRBYTES];
-        if (crypto_pwhash_str(password_hash_buf,
-                        plain_password.c_str(),
-                        plain_password.length(),
-                        crypto_pwhash_OPSLIMIT_MODERATE,
-                        crypto_pwhash_MEMLIMIT_MODERATE) != 0)
-        {
-            CROW_LOG_ERROR << "Failed to generate password";
+        std::optional<std::string> password_hash = AuthHandle::hashPassword(plain_password);
+        if (!password_hash.has_value())
+        {
+            logging::error(logging::Subsystem::Auth, "Failed to hash password");
             return crow::response(crow::status::INTERNAL_SERVER_ERROR, "Failed to hash password.");
         }
 
-        std::string password_hash_str(password_hash_buf);
-        std::optional<int> userID = database::createUser(username, password_hash_str);
+        std::optional<int> userID;
+        try
+        {
+            userID = database::createUser(username, password_hash.value());
+        }
+        catch (const database::unavailable& e)
+        {
+            logging::warning(logging::Subsystem::Auth, "Database unavailable", {{"error", e.what()}});
+            return admission::serviceUnavailable("Database is unavailable, try again shortly");
+        }
+        catch (const std::exception& e)
+        {
+            logging::error(logging::Subsystem::Auth, "Could not create user", {{"error", e.what()}});
+            return crow::response(crow::status::INTERNAL_SERVER_ERROR, "User registration failed.");
+        }
         if (userID.has_value()) //If user creation was a success, then we should have a value.
         {
+            usernameFilter::add(username);
             crow::json::wvalue mJson;
             mJson["message"] = "User registered successfully.";
             mJson["userID"] = userID.value(); //This will return the actual value that the object has. We only do this once has_value confirms to prevent errors.
@@ -54,7 +96,9 @@ void authRoutes(crow::App<crow::CookieParser>& app)
         }
         else
         {
-            return crow::response(crow::status::INTERNAL_SERVER_ERROR, "User registration failed.");
+            //someone else got the name first (or it was registered through another process)
+            usernameFilter::add(username);
+            return crow::response(crow::status::CONFLICT, "Username already exists");
         }
     });
 
@@ -62,8 +106,16 @@ void authRoutes(crow::App<crow::CookieParser>& app)
             .methods("POST"_method)
     ([&app](const crow::request& req, crow::response &res) // we capture a reference to the app to use cookies
     {
-        CROW_LOG_INFO << "Received a login request";
-        CROW_LOG_INFO << "Request body: " << req.body;
+        admission::Ticket ticket(admission::RouteClass::Auth);
+        if (!ticket)
+        {
+            res = admission::overloaded();
+            res.end();
+            return;
+        }
+
+        //never log the body here, it has the plaintext password in it
+        logging::debug(logging::Subsystem::Auth, "Received a login request", {{"body_bytes", static_cast<long long>(req.body.size())}});
 
         auto& cookie_ctx = app.get_context<crow::CookieParser>(req); //Create an object where cookies can be accessed
         std::string existingSession = cookie_ctx.get_cookie("sessionID"); //This retrieves the cookie value from our request under the sessionID key.
@@ -73,38 +125,46 @@ void authRoutes(crow::App<crow::CookieParser>& app)
             AuthHandle::deleteSession(existingSession); // will delete the cookie from the map that was created.
             //this line will clear our broswer cookie
             cookie_ctx.set_cookie("sessionID", "").path("/").max_age(0).httponly(); //this set the cookie's value to an empty string. Also made its age as zero.
-            CROW_LOG_INFO << "Cleared existing session for login request: " << existingSession;
+            logging::info(logging::Subsystem::Auth, "Cleared existing session for login request", {{"sessionID", existingSession}});
 
         }
 
         try
             {
-                auto json = crow::json::load(req.body);
-                if (!json || !json.count("username") || !json.count("password"))
+                std::string_view error;
+                std::optional<requestBody::Credentials> credentials = requestBody::parseCredentials(req.body, error);
+                if (!credentials)
                 {
-                    CROW_LOG_ERROR << "Invalid JSON in login request body.";
+                    logging::error(logging::Subsystem::Auth, "Invalid login request body", {{"error", error}});
                     //creating a response requires a code, a body and an end.
                     res.code = crow::status::BAD_REQUEST;
                     crow::json::wvalue error_json;
-                    error_json["message"] = "Missing username or password.";
+                    error_json["message"] = std::string(error);
                     res.write(error_json.dump());
                     res.set_header("Content-Type", "application/json");
                     res.end();
                     return;
                 }
 
-                std::string username = json["username"].s();
-                std::string plain_password = json["password"].s();
-                CROW_LOG_INFO << "Login attempt for username: " << username;
+                std::string username(credentials->username);
+                std::string plain_password(credentials->password);
+                logging::info(logging::Subsystem::Auth, "Login attempt", {{"username", username}});
 
                 std::optional<User> user;
                 try
                 {
                     user = database::getUsername(username); // Get user by username
                 }
+                catch (const database::unavailable& e)
+                {
+                    logging::warning(logging::Subsystem::Auth, "Database unavailable during login", {{"error", e.what()}});
+                    res = admission::serviceUnavailable("Database is unavailable, try again shortly");
+                    res.end();
+                    return;
+                }
                 catch (const std::exception& e)
                 {
-                    CROW_LOG_ERROR << "Database error getting user by username during login: " << e.what();
+                    logging::error(logging::Subsystem::Auth, "Database error getting user by username during login", {{"error", e.what()}});
                     res.code = crow::status::INTERNAL_SERVER_ERROR;
                     crow::json::wvalue error_json;
                     error_json["message"] = "Database error during login";
@@ -124,13 +184,12 @@ void authRoutes(crow::App<crow::CookieParser>& app)
                     res.end();
                     return;
                 }
-                CROW_LOG_INFO << "User '" << username << "' found. Verifying password...";
+                logging::debug(logging::Subsystem::Auth, "User found. Verifying password...", {{"username", username}});
 
                 // Verify password using Libsodium
-                if (crypto_pwhash_str_verify(user->password_hash.c_str(), // we use arrow notation for optional data types instead of dot notation.
-                plain_password.c_str(), plain_password.length()) != 0)
+                if (!AuthHandle::verifyPassword(user->password_hash, plain_password)) // we use arrow notation for optional data types instead of dot notation.
                 {
-                    CROW_LOG_INFO << "Password verification failed for user: " << username;
+                    logging::info(logging::Subsystem::Auth, "Password verification failed", {{"username", username}});
                     res.code = crow::status::UNAUTHORIZED;
                     crow::json::wvalue error_json;
                     error_json["message"] = "Invalid username or password.";
@@ -142,16 +201,20 @@ void authRoutes(crow::App<crow::CookieParser>& app)
 
                 //once authentication was successful, we can create and set a new session
                 std::string newSession = AuthHandle::genSessionID();
-                AuthHandle::storeSession(newSession, user->id);
-                CROW_LOG_INFO << "New session created for user " << user->id << ": " << newSession;
+                if (!AuthHandle::storeSession(newSession, user->id))
+                {
+                    res = admission::serviceUnavailable("Too many active sessions, try again shortly");
+                    res.end();
+                    return;
+                }
 
                 //this creates the session cookie using middleware
                 cookie_ctx.set_cookie("sessionID", newSession)
                         .path("/")
-                        .max_age(3600)
+                        .max_age(config::get()->session_ttl_seconds)
                         .httponly();
 
-                CROW_LOG_INFO << "Session cookie 'session_id' set for user " << user->id;
+                logging::info(logging::Subsystem::Auth, "Login successful, session cookie set", {{"user_id", user->id}});
 
                 res.code = crow::status::OK;
                 crow::json::wvalue success_response;
@@ -163,7 +226,7 @@ void authRoutes(crow::App<crow::CookieParser>& app)
             }
         catch (const std::exception& e)
         {
-            CROW_LOG_CRITICAL << "Unhandled exception in /login route: " << e.what();
+            logging::log(logging::Subsystem::Auth, logging::Level::Critical, "Unhandled exception in /login route", {{"error", e.what()}});
             res.code = crow::status::INTERNAL_SERVER_ERROR;
             crow::json::wvalue error_json;
             error_json["message"] = "An unexpected error occurred";
@@ -201,6 +264,12 @@ void authRoutes(crow::App<crow::CookieParser>& app)
             .methods("GET"_method) //A GET method requests data.
     ([&app](const crow::request& req)
     {
+        admission::Ticket ticket(admission::RouteClass::Read);
+        if (!ticket)
+        {
+            return admission::overloaded();
+        }
+
         auto& cookie_ctx = app.get_context<crow::CookieParser>(req);
         std::string sessionID = cookie_ctx.get_cookie("sessionID");
         if (sessionID.empty())
@@ -216,7 +285,21 @@ void authRoutes(crow::App<crow::CookieParser>& app)
             return crow::response(crow::status::UNAUTHORIZED, "Session expired or invalid. Log in again.");
         }
 
-        std::optional<User> user = database::getUserID(userID.value());
+        std::optional<Profile> user;
+        try
+        {
+            user = database::getProfile(userID.value()); // normally straight from memory
+        }
+        catch (const database::unavailable& e)
+        {
+            logging::warning(logging::Subsystem::Auth, "Database unavailable", {{"error", e.what()}});
+            return admission::serviceUnavailable("Database is unavailable, try again shortly");
+        }
+        catch (const std::exception& e)
+        {
+            logging::error(logging::Subsystem::Auth, "Could not load user for session", {{"error", e.what()}});
+            return crow::response(crow::status::INTERNAL_SERVER_ERROR, "Could not load user.");
+        }
         if (!user.has_value())
         {
             //if this session points to a nonexistant user, we delete the session
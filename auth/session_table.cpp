@@ -0,0 +1,258 @@
+#include "session_table.h"
+#include "crow.h"
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <string>
+#include <stdexcept>
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace sessionTable
+{
+    //the tag of a slot: version (40 bits) | pid of the claiming worker (22 bits) | state (2 bits).
+    //every change bumps the version, so a reader or a CAS can tell the slot was rewritten even if it
+    //ended up in the same state.
+    enum : uint64_t
+    {
+        Empty = 0,   // never used. A lookup can stop here.
+        Claimed = 1, // a worker is writing it
+        Full = 2,
+        Deleted = 3  // free again, but lookups have to keep probing past it
+    };
+    static constexpr uint64_t state_mask = 3;
+    static constexpr int pid_shift = 2;
+    static constexpr uint64_t pid_mask = ((uint64_t{1} << 22) - 1) << pid_shift; // linux pid_max is at most 2^22
+    static constexpr uint64_t version_one = uint64_t{1} << 24;
+
+    //an ID is 16 random bytes, so its first 8 are as good a hash as any. An ID can be this far from home,
+    //which bounds every lookup to one or two pages of the table.
+    static constexpr size_t max_probes = 64;
+
+    struct Slot
+    {
+        std::atomic<uint64_t> tag{0};
+        std::atomic<uint64_t> id_low{0};
+        std::atomic<uint64_t> id_high{0};
+        std::atomic<int64_t> expires_ms{0}; // steady clock, which is the same clock in every process
+        std::atomic<int32_t> user_id{0};
+    };
+    //other processes touch these too, an atomic that falls back to a lock would only lock within one process
+    static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<int32_t>::is_always_lock_free,
+                  "the session table needs lock-free 64 bit atomics");
+
+    static Slot* slots = nullptr;
+    static size_t slot_mask = 0;
+
+    static uint64_t nextTag(uint64_t tag, uint64_t state, uint64_t pid = 0)
+    {
+        return ((tag & ~(state_mask | pid_mask)) + version_one) | ((pid << pid_shift) & pid_mask) | state;
+    }
+
+    static int64_t toMs(std::chrono::steady_clock::time_point t)
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(t.time_since_epoch()).count();
+    }
+
+    static uint64_t thisPid()
+    {
+#ifdef _WIN32
+        return static_cast<uint64_t>(_getpid());
+#else
+        return static_cast<uint64_t>(getpid());
+#endif
+    }
+
+    struct Key
+    {
+        uint64_t low;
+        uint64_t high;
+    };
+
+    static Key split(const ID& id)
+    {
+        Key key;
+        std::memcpy(&key.low, id.data(), 8);
+        std::memcpy(&key.high, id.data() + 8, 8);
+        return key;
+    }
+
+    void create(size_t count)
+    {
+        size_t capacity = 1024;
+        while (capacity < count)
+        {
+            capacity <<= 1;
+        }
+        size_t bytes = capacity * sizeof(Slot);
+
+#ifdef _WIN32
+        //no fork on windows, so there is only ever one process and ordinary memory does the job
+        void* memory = ::operator new(bytes);
+#else
+        //the name is removed straight away. The mapping stays for us and every process we fork,
+        //and nothing is left behind in /dev/shm if we get killed.
+        std::string name = "/todo-sessions-" + std::to_string(getpid());
+        int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fd < 0)
+        {
+            throw std::runtime_error("shm_open failed for the session table: " + std::string(std::strerror(errno)));
+        }
+        shm_unlink(name.c_str());
+        if (ftruncate(fd, static_cast<off_t>(bytes)) != 0)
+        {
+            int error = errno;
+            close(fd);
+            throw std::runtime_error("Could not size the session table: " + std::string(std::strerror(error)));
+        }
+        void* memory = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (memory == MAP_FAILED)
+        {
+            throw std::runtime_error("mmap failed for the session table: " + std::string(std::strerror(errno)));
+        }
+#endif
+        slots = static_cast<Slot*>(memory);
+        for (size_t i = 0; i < capacity; i++)
+        {
+            new (&slots[i]) Slot();
+        }
+        slot_mask = capacity - 1;
+        CROW_LOG_INFO << "Session table ready: " << capacity << " slots (" << bytes / (1024 * 1024) << " MiB)";
+    }
+
+    //reads a full slot consistently. False if it changed while we were reading it (the caller looks again).
+    static bool read(Slot& slot, uint64_t tag, Key& key, int32_t& userID, int64_t& expires)
+    {
+        key.low = slot.id_low.load(std::memory_order_relaxed);
+        key.high = slot.id_high.load(std::memory_order_relaxed);
+        userID = slot.user_id.load(std::memory_order_relaxed);
+        expires = slot.expires_ms.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return slot.tag.load(std::memory_order_relaxed) == tag;
+    }
+
+    bool insert(const ID& id, int userID, std::chrono::steady_clock::time_point expires)
+    {
+        Key key = split(id);
+        int64_t now = toMs(std::chrono::steady_clock::now());
+        for (size_t i = 0; i < max_probes; i++)
+        {
+            Slot& slot = slots[(key.low + i) & slot_mask];
+            uint64_t tag = slot.tag.load(std::memory_order_acquire);
+            uint64_t state = tag & state_mask;
+            //expired sessions are taken over here, so nothing has to sweep the table
+            bool free = state == Empty || state == Deleted ||
+                        (state == Full && slot.expires_ms.load(std::memory_order_relaxed) <= now);
+            if (!free)
+            {
+                continue;
+            }
+
+            uint64_t claimed = nextTag(tag, Claimed, thisPid());
+            if (!slot.tag.compare_exchange_strong(tag, claimed, std::memory_order_acq_rel))
+            {
+                continue; // another worker got there first
+            }
+            slot.id_low.store(key.low, std::memory_order_relaxed);
+            slot.id_high.store(key.high, std::memory_order_relaxed);
+            slot.user_id.store(userID, std::memory_order_relaxed);
+            slot.expires_ms.store(toMs(expires), std::memory_order_relaxed);
+            slot.tag.store(nextTag(claimed, Full), std::memory_order_release);
+            return true;
+        }
+        return false;
+    }
+
+    //finds the slot holding id and hands it to visit with the tag it was read under.
+    //visit returns false to have the slot read again (its CAS lost a race).
+    template <typename Visit>
+    static void locate(const ID& id, Visit visit)
+    {
+        Key key = split(id);
+        for (size_t i = 0; i < max_probes; i++)
+        {
+            Slot& slot = slots[(key.low + i) & slot_mask];
+            while (true)
+            {
+                uint64_t tag = slot.tag.load(std::memory_order_acquire);
+                uint64_t state = tag & state_mask;
+                if (state == Empty)
+                {
+                    return; // nothing was ever stored past here
+                }
+                if (state != Full)
+                {
+                    break;
+                }
+                Key found;
+                int32_t userID;
+                int64_t expires;
+                if (!read(slot, tag, found, userID, expires))
+                {
+                    continue;
+                }
+                if (found.low != key.low || found.high != key.high)
+                {
+                    break;
+                }
+                if (visit(slot, tag, userID, expires))
+                {
+                    return;
+                }
+            }
+        }
+    }
+
+    std::optional<int> find(const ID& id)
+    {
+        std::optional<int> result;
+        int64_t now = toMs(std::chrono::steady_clock::now());
+        locate(id, [&](Slot& slot, uint64_t tag, int32_t userID, int64_t expires)
+        {
+            if (expires > now)
+            {
+                result = userID;
+                return true;
+            }
+            //expired: if the CAS loses, someone else removed or reused the slot already
+            slot.tag.compare_exchange_strong(tag, nextTag(tag, Deleted), std::memory_order_acq_rel);
+            return true;
+        });
+        return result;
+    }
+
+    bool erase(const ID& id)
+    {
+        bool erased = false;
+        locate(id, [&](Slot& slot, uint64_t tag, int32_t, int64_t)
+        {
+            erased = slot.tag.compare_exchange_strong(tag, nextTag(tag, Deleted), std::memory_order_acq_rel);
+            return erased;
+        });
+        return erased;
+    }
+
+    size_t releaseClaims(int pid)
+    {
+        uint64_t owner = (static_cast<uint64_t>(pid) << pid_shift) & pid_mask;
+        size_t released = 0;
+        for (size_t i = 0; i <= slot_mask; i++)
+        {
+            uint64_t tag = slots[i].tag.load(std::memory_order_acquire);
+            if ((tag & state_mask) == Claimed && (tag & pid_mask) == owner &&
+                slots[i].tag.compare_exchange_strong(tag, nextTag(tag, Deleted), std::memory_order_acq_rel))
+            {
+                released++;
+            }
+        }
+        return released;
+    }
+}
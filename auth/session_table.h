@@ -0,0 +1,29 @@
+#pragma once
+#include <array>
+#include <optional>
+#include <chrono>
+#include <cstddef>
+
+
+//every session lives in one fixed-size open addressing table. It is mapped from POSIX shared memory before
+//any worker is forked (see prefork.h), so all workers see the same sessions and a worker that crashes or
+//restarts loses nothing, the supervisor keeps the mapping alive. There are no locks: a slot is claimed and
+//released with a CAS on its tag, and readers check the tag before and after reading the slot (a seqlock)
+//so they never act on one that is halfway through being rewritten.
+namespace sessionTable
+{
+    //the raw 128 bits. The hex form only exists in the cookie.
+    using ID = std::array<unsigned char, 16>;
+
+    //slots is rounded up to a power of two. Throws std::runtime_error if the memory can't be mapped.
+    void create(size_t slots);
+
+    //false when every slot the ID may go in holds a live session
+    bool insert(const ID& id, int userID, std::chrono::steady_clock::time_point expires);
+    //expired sessions are removed here, same as logging out
+    std::optional<int> find(const ID& id);
+    bool erase(const ID& id);
+
+    //called by the supervisor after a worker died: frees the slots it had claimed but not finished writing
+    size_t releaseClaims(int pid);
+}
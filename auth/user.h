@@ -6,4 +6,11 @@ struct User
     int id;
     std::string username;
     std::string password_hash;
+};
+
+//what /me shows about a user. Kept apart from User so the password hash never ends up cached.
+struct Profile
+{
+    int id;
+    std::string username;
 };
\ No newline at end of file
@@ -0,0 +1,117 @@
+#include "username_filter.h"
+#include "db_functions.h"
+#include "crow.h"
+#include <atomic>
+#include <memory>
+#include <functional>
+#include <algorithm>
+#include <cstdint>
+
+namespace usernameFilter
+{
+    //about 1% false positives while the table stays under capacity. It's sized at twice the current
+    //user count, so that holds until the table doubles and then degrades slowly (more SELECTs, never wrong answers).
+    static constexpr size_t bits_per_name = 10;
+    static constexpr int hash_count = 7;
+    static constexpr size_t min_capacity = 100000;
+
+    //set up in load() before the server starts, only the words change after that
+    static std::unique_ptr<std::atomic<uint64_t>[]> words;
+    static size_t bit_count = 0;
+    static size_t capacity = 0;
+    static std::atomic<size_t> added{0};
+    static std::atomic<bool> ready{false};
+
+    //two independent hashes, the k positions are h1 + i*h2 (Kirsch and Mitzenmacher)
+    static uint64_t fnv1a(std::string_view s)
+    {
+        uint64_t h = 14695981039346656037ull;
+        for (unsigned char c : s)
+        {
+            h ^= c;
+            h *= 1099511628211ull;
+        }
+        return h;
+    }
+
+    template <typename Visit>
+    static void positions(std::string_view username, Visit visit)
+    {
+        uint64_t h1 = fnv1a(username);
+        uint64_t h2 = std::hash<std::string_view>{}(username) | 1; // odd, so the positions don't repeat
+        for (int i = 0; i < hash_count; i++)
+        {
+            visit((h1 + i * h2) % bit_count);
+        }
+    }
+
+    static void set(std::string_view username)
+    {
+        positions(username, [](size_t bit)
+        {
+            words[bit / 64].fetch_or(uint64_t{1} << (bit % 64), std::memory_order_relaxed);
+        });
+    }
+
+    void load()
+    {
+        try
+        {
+            long long users = database::countUsers();
+            capacity = std::max(static_cast<size_t>(users) * 2, min_capacity);
+            bit_count = capacity * bits_per_name;
+            size_t word_count = (bit_count + 63) / 64;
+            words = std::make_unique<std::atomic<uint64_t>[]>(word_count);
+            for (size_t i = 0; i < word_count; i++)
+            {
+                words[i].store(0, std::memory_order_relaxed);
+            }
+
+            size_t loaded = 0;
+            database::forEachUsername([&loaded](std::string_view username)
+            {
+                set(username);
+                loaded++;
+            });
+            added.store(loaded, std::memory_order_relaxed);
+            ready.store(true, std::memory_order_release);
+            CROW_LOG_INFO << "Username filter loaded " << loaded << " names (" << word_count * 8 / 1024 << " KiB)";
+        }
+        catch (const std::exception& e)
+        {
+            //registration still works, it just looks every name up first
+            CROW_LOG_WARNING << "Could not load the username filter, every registration will check the database: " << e.what();
+        }
+    }
+
+    bool mightContain(std::string_view username)
+    {
+        if (!ready.load(std::memory_order_acquire))
+        {
+            return true;
+        }
+        bool all_set = true;
+        positions(username, [&all_set](size_t bit)
+        {
+            if ((words[bit / 64].load(std::memory_order_relaxed) & (uint64_t{1} << (bit % 64))) == 0)
+            {
+                all_set = false;
+            }
+        });
+        return all_set;
+    }
+
+    void add(std::string_view username)
+    {
+        if (!ready.load(std::memory_order_acquire))
+        {
+            return;
+        }
+        set(username);
+        if (added.fetch_add(1, std::memory_order_relaxed) + 1 == capacity)
+        {
+            CROW_LOG_WARNING << "Username filter is past its capacity of " << capacity
+                             << " names, false positives will climb until the next restart";
+        }
+    }
+}
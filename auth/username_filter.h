@@ -0,0 +1,21 @@
+#pragma once
+#include <string_view>
+#include <cstddef>
+
+
+//a bloom filter of every username in the users table. /register asks it before hashing the password:
+//"no" is always right, so a new name goes straight to the INSERT without a lookup. "maybe" costs one
+//SELECT, and a taken name is turned away before crypto_pwhash_str spends a quarter of a second on it.
+//names registered through another process are missing here, the UNIQUE constraint still catches those.
+namespace usernameFilter
+{
+    //sizes the filter for the users table and adds every name. Call once at startup, after the pool is up.
+    //if it fails the filter stays off and mightContain answers "maybe" for everything.
+    void load();
+
+    //false only when the name is definitely not taken
+    bool mightContain(std::string_view username);
+
+    //after a successful INSERT
+    void add(std::string_view username);
+}
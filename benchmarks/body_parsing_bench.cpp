@@ -0,0 +1,100 @@
+//compares the request body parsing of the write and auth routes: crow::json::load plus copying the fields out
+//(what the routes used to do) against requestBody (what they do now). Not built by default:
+//    cmake -S . -B build -DTODO_BUILD_BENCHMARKS=ON && cmake --build build --target body_parsing_bench
+#include "crow/json.h"
+#include "request_body.h"
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+//keeps the compiler from dropping work whose result is never used
+static volatile size_t sink = 0;
+
+template <typename Parse>
+static double nanosPerCall(const std::string& body, Parse parse)
+{
+    //long enough to get past the clock's resolution, short enough to run in a few seconds
+    constexpr int iterations = 200000;
+    for (int i = 0; i < iterations / 10; i++)
+    {
+        sink = sink + parse(body); // warm up
+    }
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++)
+    {
+        sink = sink + parse(body);
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / iterations;
+}
+
+//the old route code: load the tree, check the members are there and copy them into strings
+static size_t crowTask(const std::string& body)
+{
+    auto json = crow::json::load(body);
+    if (!json || json.t() != crow::json::type::Object || !json.count("description"))
+    {
+        return 0;
+    }
+    std::string description = json["description"].s();
+    std::string Tstatus = json.count("status") ? std::string(json["status"].s()) : "todo";
+    return description.size() + Tstatus.size();
+}
+
+static size_t fastTask(const std::string& body)
+{
+    std::string_view error;
+    std::optional<requestBody::TaskFields> fields = requestBody::parseTask(body, error);
+    if (!fields || !fields->description)
+    {
+        return 0;
+    }
+    return fields->description->size() + 1;
+}
+
+static size_t crowCredentials(const std::string& body)
+{
+    auto json = crow::json::load(body);
+    if (!json || !json.count("username") || !json.count("password"))
+    {
+        return 0;
+    }
+    std::string username = json["username"].s();
+    std::string password = json["password"].s();
+    return username.size() + password.size();
+}
+
+static size_t fastCredentials(const std::string& body)
+{
+    std::string_view error;
+    std::optional<requestBody::Credentials> credentials = requestBody::parseCredentials(body, error);
+    return credentials ? credentials->username.size() + credentials->password.size() : 0;
+}
+
+int main()
+{
+    struct Case
+    {
+        const char* name;
+        std::string body;
+        bool credentials;
+    };
+    std::vector<Case> cases = {
+        {"create task", R"({"description":"Buy milk and bread on the way home","status":"todo"})", false},
+        {"create task, 256 chars", R"({"description":")" + std::string(256, 'x') + R"(","status":"inprogress","due_at":"2025-03-01T09:00:00Z"})", false},
+        {"update with escapes", R"({"description":"Call \"Sam\" about the café\nbooking","status":"completed"})", false},
+        {"malformed", R"({"description":"Buy milk","status":"todo",)", false},
+        {"not an object", R"(["description","Buy milk"])", false},
+        {"register / login", R"({"username":"someone","password":"correct horse battery staple"})", true},
+    };
+
+    std::printf("%-26s %14s %14s %9s\n", "body", "crow ns/call", "new ns/call", "speedup");
+    for (const Case& c : cases)
+    {
+        double crow_ns = c.credentials ? nanosPerCall(c.body, crowCredentials) : nanosPerCall(c.body, crowTask);
+        double fast_ns = c.credentials ? nanosPerCall(c.body, fastCredentials) : nanosPerCall(c.body, fastTask);
+        std::printf("%-26s %14.1f %14.1f %8.1fx\n", c.name, crow_ns, fast_ns, crow_ns / fast_ns);
+    }
+    return 0;
+}
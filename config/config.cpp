@@ -0,0 +1,420 @@
+#include "config.h"
+#include "crow.h"
+#include <fstream>
+#include <sstream>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <cstdlib>
+#include <stdexcept>
+#include <limits>
+#include <algorithm>
+#ifndef _WIN32
+#include <csignal>
+#include <pthread.h>
+#endif
+
+namespace config
+{
+    static std::shared_ptr<const Config> current = std::make_shared<const Config>();
+    static std::mutex current_mutex;
+    static std::string config_path;
+    static std::vector<std::function<void(const Config&)>> reload_callbacks;
+
+    static std::string trim(const std::string& s)
+    {
+        size_t begin = s.find_first_not_of(" \t\r");
+        if (begin == std::string::npos)
+        {
+            return "";
+        }
+        size_t end = s.find_last_not_of(" \t\r");
+        return s.substr(begin, end - begin + 1);
+    }
+
+    //values in a libpq connection string have to be quoted if they contain spaces or quotes
+    static std::string connValue(const std::string& value)
+    {
+        std::string quoted = "'";
+        for (char c : value)
+        {
+            if (c == '\'' || c == '\\')
+            {
+                quoted += '\\';
+            }
+            quoted += c;
+        }
+        return quoted + "'";
+    }
+
+    //one setting: its name in the config file and the environment variable(s) that override it
+    struct Setting
+    {
+        const char* key;
+        const char* env;
+        const char* legacy_env; // the old variable names (DBNAME, USER...) still work
+    };
+
+    static const Setting settings[] = {
+        {"port", "TODO_PORT", nullptr},
+        {"worker_threads", "TODO_WORKER_THREADS", nullptr},
+        {"db_name", "TODO_DB_NAME", "DBNAME"},
+        {"db_user", "TODO_DB_USER", "USER"},
+        {"db_password", "TODO_DB_PASSWORD", "PASSWORD"},
+        {"db_host", "TODO_DB_HOST", "HOST"},
+        {"db_port", "TODO_DB_PORT", "PORT"},
+        {"db_pool_size", "TODO_DB_POOL_SIZE", nullptr},
+        {"db_replica_host", "TODO_DB_REPLICA_HOST", nullptr},
+        {"db_replica_port", "TODO_DB_REPLICA_PORT", nullptr},
+        {"db_replica_pool_size", "TODO_DB_REPLICA_POOL_SIZE", nullptr},
+        {"hashing_pool_size", "TODO_HASHING_POOL_SIZE", nullptr},
+        {"workers", "TODO_WORKERS", nullptr},
+        {"session_table_slots", "TODO_SESSION_TABLE_SLOTS", nullptr},
+        {"statement_timeout_ms", "TODO_STATEMENT_TIMEOUT_MS", nullptr},
+        {"db_acquire_timeout_ms", "TODO_DB_ACQUIRE_TIMEOUT_MS", nullptr},
+        {"session_ttl_seconds", "TODO_SESSION_TTL_SECONDS", nullptr},
+        {"stats_cache_entries", "TODO_STATS_CACHE_ENTRIES", nullptr},
+        {"profile_cache_entries", "TODO_PROFILE_CACHE_ENTRIES", nullptr},
+        {"profile_negative_ttl_ms", "TODO_PROFILE_NEGATIVE_TTL_MS", nullptr},
+        {"compression_min_size", "TODO_COMPRESSION_MIN_SIZE", nullptr},
+        {"log_levels", "TODO_LOG_LEVELS", nullptr},
+        {"max_inflight_read", "TODO_MAX_INFLIGHT_READ", nullptr},
+        {"max_inflight_write", "TODO_MAX_INFLIGHT_WRITE", nullptr},
+        {"max_inflight_auth", "TODO_MAX_INFLIGHT_AUTH", nullptr},
+        {"max_inflight_bulk", "TODO_MAX_INFLIGHT_BULK", nullptr},
+        {"request_deadline_ms", "TODO_REQUEST_DEADLINE_MS", nullptr},
+        {"bulk_deadline_ms", "TODO_BULK_DEADLINE_MS", nullptr},
+        {"retry_after_seconds", "TODO_RETRY_AFTER_SECONDS", nullptr},
+        {"read_your_writes_ms", "TODO_READ_YOUR_WRITES_MS", nullptr},
+        {"reminder_catchup_seconds", "TODO_REMINDER_CATCHUP_SECONDS", nullptr},
+        {"breaker_failure_threshold", "TODO_BREAKER_FAILURE_THRESHOLD", nullptr},
+        {"breaker_open_ms", "TODO_BREAKER_OPEN_MS", nullptr},
+        {"breaker_max_open_ms", "TODO_BREAKER_MAX_OPEN_MS", nullptr},
+        {"db_max_retries", "TODO_DB_MAX_RETRIES", nullptr},
+        {"db_retry_base_ms", "TODO_DB_RETRY_BASE_MS", nullptr},
+        {"position_rebalance_length", "TODO_POSITION_REBALANCE_LENGTH", nullptr},
+        {"archive_after_days", "TODO_ARCHIVE_AFTER_DAYS", nullptr},
+        {"archive_batch_size", "TODO_ARCHIVE_BATCH_SIZE", nullptr},
+        {"archive_interval_seconds", "TODO_ARCHIVE_INTERVAL_SECONDS", nullptr},
+        {"task_partitions", "TODO_TASK_PARTITIONS", nullptr},
+        {"reminder_max_pending", "TODO_REMINDER_MAX_PENDING", nullptr},
+        {"idempotency_ttl_seconds", "TODO_IDEMPOTENCY_TTL_SECONDS", nullptr},
+        {"idempotency_max_entries", "TODO_IDEMPOTENCY_MAX_ENTRIES", nullptr},
+        {"debug_token", "TODO_DEBUG_TOKEN", nullptr},
+    };
+
+    //parses an unsigned number and checks it is inside [min, max]. Problems are added to errors instead of thrown
+    //so the user sees every bad value at once.
+    template <typename T>
+    static void parseNumber(const std::string& key, const std::string& text, T& out, long long min, long long max, std::vector<std::string>& errors)
+    {
+        try
+        {
+            size_t used = 0;
+            long long value = std::stoll(text, &used);
+            if (used != text.size())
+            {
+                throw std::invalid_argument(text);
+            }
+            if (value < min || value > max)
+            {
+                errors.push_back(key + " must be between " + std::to_string(min) + " and " + std::to_string(max) + ", got " + text);
+                return;
+            }
+            out = static_cast<T>(value);
+        }
+        catch (const std::exception&)
+        {
+            errors.push_back(key + " must be a number, got '" + text + "'");
+        }
+    }
+
+    static void apply(Config& c, const std::string& key, const std::string& value, std::vector<std::string>& errors)
+    {
+        if (key == "port") parseNumber(key, value, c.port, 1, 65535, errors);
+        else if (key == "worker_threads") parseNumber(key, value, c.worker_threads, 0, 1024, errors);
+        else if (key == "db_name") c.db_name = value;
+        else if (key == "db_user") c.db_user = value;
+        else if (key == "db_password") c.db_password = value;
+        else if (key == "db_host") c.db_host = value;
+        else if (key == "db_port") c.db_port = value;
+        else if (key == "db_pool_size") parseNumber(key, value, c.db_pool_size, 1, 1000, errors);
+        else if (key == "db_replica_host") c.db_replica_host = value;
+        else if (key == "db_replica_port") c.db_replica_port = value;
+        else if (key == "db_replica_pool_size") parseNumber(key, value, c.db_replica_pool_size, 1, 1000, errors);
+        else if (key == "hashing_pool_size") parseNumber(key, value, c.hashing_pool_size, 1, 256, errors);
+        else if (key == "workers") parseNumber(key, value, c.workers, 1, 256, errors);
+        else if (key == "session_table_slots") parseNumber(key, value, c.session_table_slots, 1024, 1 << 28, errors);
+        else if (key == "statement_timeout_ms") parseNumber(key, value, c.statement_timeout_ms, 0, 3600000, errors);
+        else if (key == "db_acquire_timeout_ms") parseNumber(key, value, c.db_acquire_timeout_ms, 1, 600000, errors);
+        else if (key == "session_ttl_seconds") parseNumber(key, value, c.session_ttl_seconds, 60, 60 * 60 * 24 * 30, errors);
+        else if (key == "stats_cache_entries") parseNumber(key, value, c.stats_cache_entries, 0, std::numeric_limits<int>::max(), errors);
+        else if (key == "profile_cache_entries") parseNumber(key, value, c.profile_cache_entries, 0, std::numeric_limits<int>::max(), errors);
+        else if (key == "profile_negative_ttl_ms") parseNumber(key, value, c.profile_negative_ttl_ms, 0, 3600000, errors);
+        else if (key == "compression_min_size") parseNumber(key, value, c.compression_min_size, 0, std::numeric_limits<int>::max(), errors);
+        else if (key == "log_levels") c.log_levels = value;
+        else if (key == "max_inflight_read") parseNumber(key, value, c.max_inflight_read, 0, 100000, errors);
+        else if (key == "max_inflight_write") parseNumber(key, value, c.max_inflight_write, 0, 100000, errors);
+        else if (key == "max_inflight_auth") parseNumber(key, value, c.max_inflight_auth, 0, 100000, errors);
+        else if (key == "max_inflight_bulk") parseNumber(key, value, c.max_inflight_bulk, 0, 100000, errors);
+        else if (key == "request_deadline_ms") parseNumber(key, value, c.request_deadline_ms, 1, 600000, errors);
+        else if (key == "bulk_deadline_ms") parseNumber(key, value, c.bulk_deadline_ms, 1, 24 * 3600000, errors);
+        else if (key == "retry_after_seconds") parseNumber(key, value, c.retry_after_seconds, 0, 3600, errors);
+        else if (key == "read_your_writes_ms") parseNumber(key, value, c.read_your_writes_ms, 0, 3600000, errors);
+        else if (key == "reminder_catchup_seconds") parseNumber(key, value, c.reminder_catchup_seconds, 0, 604800, errors);
+        else if (key == "breaker_failure_threshold") parseNumber(key, value, c.breaker_failure_threshold, 1, 1000, errors);
+        else if (key == "breaker_open_ms") parseNumber(key, value, c.breaker_open_ms, 1, 3600000, errors);
+        else if (key == "breaker_max_open_ms") parseNumber(key, value, c.breaker_max_open_ms, 1, 3600000, errors);
+        else if (key == "db_max_retries") parseNumber(key, value, c.db_max_retries, 0, 10, errors);
+        else if (key == "db_retry_base_ms") parseNumber(key, value, c.db_retry_base_ms, 0, 10000, errors);
+        else if (key == "position_rebalance_length") parseNumber(key, value, c.position_rebalance_length, 4, 1024, errors);
+        else if (key == "archive_after_days") parseNumber(key, value, c.archive_after_days, 0, 36500, errors);
+        else if (key == "archive_batch_size") parseNumber(key, value, c.archive_batch_size, 1, 100000, errors);
+        else if (key == "archive_interval_seconds") parseNumber(key, value, c.archive_interval_seconds, 1, 86400, errors);
+        else if (key == "task_partitions") parseNumber(key, value, c.task_partitions, 1, 1024, errors);
+        else if (key == "reminder_max_pending") parseNumber(key, value, c.reminder_max_pending, 16, 100000000, errors);
+        else if (key == "idempotency_ttl_seconds") parseNumber(key, value, c.idempotency_ttl_seconds, 1, 604800, errors);
+        else if (key == "idempotency_max_entries") parseNumber(key, value, c.idempotency_max_entries, 1, 1 << 20, errors);
+        else if (key == "debug_token") c.debug_token = value;
+        else errors.push_back("unknown setting '" + key + "'");
+    }
+
+    //builds a complete config from the file and the environment. Throws if anything is wrong.
+    //the threads crow runs requests on, what app.multithreaded() picks when worker_threads is 0
+    static unsigned requestThreads(const Config& c)
+    {
+        if (c.worker_threads > 0)
+        {
+            return c.worker_threads;
+        }
+        unsigned threads = std::thread::hardware_concurrency();
+        return threads > 0 ? threads : 2;
+    }
+
+    //fills in the max_inflight_* limits left at 0. Together they get one thread less than crow has, so a
+    //database that stalls every admitted request still leaves a thread for /health and the 503s.
+    //Reads get most of it, they are most of the traffic.
+    static void deriveInflightLimits(Config& c)
+    {
+        int budget = static_cast<int>(requestThreads(c)) - 1;
+        int bulk = c.max_inflight_bulk > 0 ? c.max_inflight_bulk : std::max(1, budget / 16);
+        int auth = c.max_inflight_auth > 0 ? c.max_inflight_auth : std::max(1, budget / 8);
+        int write = c.max_inflight_write > 0 ? c.max_inflight_write : std::max(1, budget / 4);
+        int read = c.max_inflight_read > 0 ? c.max_inflight_read : std::max(1, budget - bulk - auth - write);
+        c.max_inflight_bulk = bulk;
+        c.max_inflight_auth = auth;
+        c.max_inflight_write = write;
+        c.max_inflight_read = read;
+    }
+
+    static Config read(const std::string& path)
+    {
+        Config c;
+        std::vector<std::string> errors;
+
+        //the old variable names come first, so the file overrides them. USER is set in every login shell and
+        //PORT by many platforms for the http port, neither should win over db_user or db_port in the file.
+        for (const Setting& setting : settings)
+        {
+            const char* value = setting.legacy_env != nullptr ? std::getenv(setting.legacy_env) : nullptr;
+            if (value != nullptr)
+            {
+                apply(c, setting.key, value, errors);
+            }
+        }
+
+        //the file is optional, the environment alone is enough to run
+        std::ifstream file(path);
+        if (file)
+        {
+            std::string line;
+            int line_number = 0;
+            while (std::getline(file, line))
+            {
+                line_number++;
+                line = trim(line.substr(0, line.find('#'))); // everything after # is a comment
+                if (line.empty())
+                {
+                    continue;
+                }
+                size_t equals = line.find('=');
+                if (equals == std::string::npos)
+                {
+                    errors.push_back(path + ":" + std::to_string(line_number) + ": expected key = value");
+                    continue;
+                }
+                apply(c, trim(line.substr(0, equals)), trim(line.substr(equals + 1)), errors);
+            }
+        }
+
+        for (const Setting& setting : settings)
+        {
+            const char* value = std::getenv(setting.env);
+            if (value != nullptr)
+            {
+                apply(c, setting.key, value, errors);
+            }
+        }
+
+        if (c.db_name.empty()) errors.push_back("db_name (or DBNAME) is not set");
+        if (c.db_user.empty()) errors.push_back("db_user (or USER) is not set");
+        if (c.db_password.empty()) errors.push_back("db_password (or PASSWORD) is not set");
+        //it lets whoever has it stall a worker thread for a minute, so no guessable ones
+        if (!c.debug_token.empty() && c.debug_token.size() < 16) errors.push_back("debug_token must be at least 16 characters");
+
+        if (!errors.empty())
+        {
+            std::string message = "Invalid configuration:";
+            for (const auto& error : errors)
+            {
+                message += "\n  " + error;
+            }
+            throw std::runtime_error(message);
+        }
+
+        deriveInflightLimits(c);
+
+        c.connection_string = "dbname=" + connValue(c.db_name) +
+                              " user=" + connValue(c.db_user) +
+                              " password=" + connValue(c.db_password) +
+                              " host=" + connValue(c.db_host) +
+                              " port=" + connValue(c.db_port);
+        if (!c.db_replica_host.empty())
+        {
+            c.replica_connection_string = "dbname=" + connValue(c.db_name) +
+                                          " user=" + connValue(c.db_user) +
+                                          " password=" + connValue(c.db_password) +
+                                          " host=" + connValue(c.db_replica_host) +
+                                          " port=" + connValue(c.db_replica_port);
+        }
+        return c;
+    }
+
+    void load(const std::string& path)
+    {
+        Config c = read(path);
+        CROW_LOG_INFO << "Config loaded: port=" << c.port << " worker_threads=" << c.worker_threads
+                      << " db=" << c.db_user << "@" << c.db_host << ":" << c.db_port << "/" << c.db_name
+                      << " db_pool_size=" << c.db_pool_size << " hashing_pool_size=" << c.hashing_pool_size
+                      << " workers=" << c.workers
+                      << " max_inflight=" << c.max_inflight_read << "/" << c.max_inflight_write << "/" << c.max_inflight_auth << "/" << c.max_inflight_bulk
+                      << " replica=" << (c.db_replica_host.empty() ? "none" : c.db_replica_host + ":" + c.db_replica_port);
+
+        unsigned threads = requestThreads(c);
+        if (static_cast<long long>(c.max_inflight_read) + c.max_inflight_write + c.max_inflight_auth + c.max_inflight_bulk >= threads)
+        {
+            CROW_LOG_WARNING << "The max_inflight_* limits together are not below the worker thread count ("
+                             << threads << "), an overloaded database can still tie up every thread";
+        }
+
+        std::lock_guard<std::mutex> lock(current_mutex);
+        config_path = path;
+        current = std::make_shared<const Config>(std::move(c));
+    }
+
+    std::shared_ptr<const Config> get()
+    {
+        std::lock_guard<std::mutex> lock(current_mutex);
+        return current;
+    }
+
+    bool reload()
+    {
+        std::shared_ptr<const Config> old = get();
+        Config fresh;
+        try
+        {
+            fresh = read(config_path);
+        }
+        catch (const std::exception& e)
+        {
+            CROW_LOG_ERROR << "Config reload failed, keeping the current config. " << e.what();
+            return false;
+        }
+
+        //start from the old config and only copy over what is safe to change while running
+        Config next = *old;
+        next.statement_timeout_ms = fresh.statement_timeout_ms;
+        next.db_acquire_timeout_ms = fresh.db_acquire_timeout_ms;
+        next.session_ttl_seconds = fresh.session_ttl_seconds;
+        next.stats_cache_entries = fresh.stats_cache_entries;
+        next.profile_cache_entries = fresh.profile_cache_entries;
+        next.profile_negative_ttl_ms = fresh.profile_negative_ttl_ms;
+        next.compression_min_size = fresh.compression_min_size;
+        next.log_levels = fresh.log_levels;
+        next.max_inflight_read = fresh.max_inflight_read;
+        next.max_inflight_write = fresh.max_inflight_write;
+        next.max_inflight_auth = fresh.max_inflight_auth;
+        next.max_inflight_bulk = fresh.max_inflight_bulk;
+        next.request_deadline_ms = fresh.request_deadline_ms;
+        next.bulk_deadline_ms = fresh.bulk_deadline_ms;
+        next.retry_after_seconds = fresh.retry_after_seconds;
+        next.read_your_writes_ms = fresh.read_your_writes_ms;
+        next.reminder_catchup_seconds = fresh.reminder_catchup_seconds;
+        next.breaker_failure_threshold = fresh.breaker_failure_threshold;
+        next.breaker_open_ms = fresh.breaker_open_ms;
+        next.breaker_max_open_ms = fresh.breaker_max_open_ms;
+        next.db_max_retries = fresh.db_max_retries;
+        next.db_retry_base_ms = fresh.db_retry_base_ms;
+        next.position_rebalance_length = fresh.position_rebalance_length;
+        next.archive_after_days = fresh.archive_after_days;
+        next.archive_batch_size = fresh.archive_batch_size;
+        next.idempotency_ttl_seconds = fresh.idempotency_ttl_seconds;
+        next.debug_token = fresh.debug_token;
+
+        if (fresh.port != old->port || fresh.worker_threads != old->worker_threads ||
+            fresh.db_pool_size != old->db_pool_size || fresh.hashing_pool_size != old->hashing_pool_size ||
+            fresh.workers != old->workers || fresh.session_table_slots != old->session_table_slots ||
+            fresh.connection_string != old->connection_string || fresh.replica_connection_string != old->replica_connection_string ||
+            fresh.db_replica_pool_size != old->db_replica_pool_size || fresh.archive_interval_seconds != old->archive_interval_seconds ||
+            fresh.task_partitions != old->task_partitions || fresh.reminder_max_pending != old->reminder_max_pending ||
+            fresh.idempotency_max_entries != old->idempotency_max_entries)
+        {
+            CROW_LOG_WARNING << "Config reload: port, threads, pool sizes, database settings, archive_interval_seconds, "
+                                "task_partitions, reminder_max_pending and idempotency_max_entries need a restart and were not changed";
+        }
+
+        std::shared_ptr<const Config> installed = std::make_shared<const Config>(std::move(next));
+        {
+            std::lock_guard<std::mutex> lock(current_mutex);
+            current = installed;
+        }
+        for (const auto& callback : reload_callbacks)
+        {
+            callback(*installed);
+        }
+        CROW_LOG_INFO << "Config reloaded";
+        return true;
+    }
+
+    void onReload(std::function<void(const Config&)> callback)
+    {
+        //only registered during startup, before the reload thread can call them
+        reload_callbacks.push_back(std::move(callback));
+    }
+
+    void watchReload()
+    {
+#ifndef _WIN32
+        //block SIGHUP here so every thread started after this inherits the mask,
+        //then one thread picks the signal up synchronously with sigwait. No async signal handler needed.
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, SIGHUP);
+        pthread_sigmask(SIG_BLOCK, &set, nullptr);
+
+        std::thread([set]()
+        {
+            while (true)
+            {
+                int signal = 0;
+                if (sigwait(&set, &signal) == 0 && signal == SIGHUP)
+                {
+                    CROW_LOG_INFO << "SIGHUP received, reloading config";
+                    reload();
+                }
+            }
+        }).detach();
+#endif
+    }
+}
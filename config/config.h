@@ -0,0 +1,106 @@
+#pragma once
+#include <string>
+#include <memory>
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+
+
+namespace config
+{
+    //everything the server can be tuned with. Values come from the config file first and the environment second,
+    //so a TODO_ environment variable always wins over the file. The old names (DBNAME, USER...) are read before the file.
+    struct Config
+    {
+        //these are read once at startup, changing them needs a restart
+        uint16_t port = 18080;
+        unsigned worker_threads = 0; // 0 lets crow pick one per hardware thread
+        std::string db_name;
+        std::string db_user;
+        std::string db_password;
+        std::string db_host = "localhost";
+        std::string db_port = "5432";
+        size_t db_pool_size = 8;
+        //optional read replica. Same database, user and password as the primary, just another host.
+        std::string db_replica_host;
+        std::string db_replica_port = "5432";
+        size_t db_replica_pool_size = 8;
+        unsigned hashing_pool_size = 2; // crypto_pwhash MODERATE uses 256 MiB each, so keep this small
+        //more than 1 forks that many server processes sharing the port, see prefork.h.
+        //the pool and hashing sizes above are per worker.
+        unsigned workers = 1;
+        size_t session_table_slots = 262144; // the most sessions that can be logged in at once, 40 bytes each
+        int archive_interval_seconds = 300; // how often the archive job runs, see archive_after_days below
+        //how many hash partitions tasks is split into. Only used when the table is first partitioned.
+        int task_partitions = 8;
+        //how many upcoming reminders each worker keeps in memory, later ones are loaded from the table when their turn comes
+        unsigned reminder_max_pending = 1000000;
+        //Idempotency-Key responses kept in the shared table, about 2.5 KiB each (only touched pages use memory)
+        unsigned idempotency_max_entries = 16384;
+
+        //these can be changed with a SIGHUP
+        int statement_timeout_ms = 5000;
+        int db_acquire_timeout_ms = 2000;
+        int session_ttl_seconds = 3600;
+        size_t stats_cache_entries = 100000;
+        size_t profile_cache_entries = 100000;
+        int profile_negative_ttl_ms = 30000; // how long "no such user" is remembered, 0 turns that off
+        size_t compression_min_size = 1024;
+        std::string log_levels = "info"; // e.g. "*=info,db=debug", see logging::setLevels
+        //admission control, see admission.h. Keep the sum below worker_threads so /health always has a thread.
+        //0 derives the limit from the thread count when the config is read, so get() never returns a 0 here.
+        int max_inflight_read = 0;
+        int max_inflight_write = 0;
+        int max_inflight_auth = 0;
+        int max_inflight_bulk = 0;
+        int request_deadline_ms = 3000;
+        int bulk_deadline_ms = 600000; // exports and imports of millions of rows take a while
+        int retry_after_seconds = 1;
+        //after a user writes, their reads stay on the primary this long so they see their own changes
+        int read_your_writes_ms = 5000;
+        //how far back a starting worker looks for reminders that fell due while no worker was running
+        int reminder_catchup_seconds = 300;
+        //circuit breaker, see circuit_breaker.h. After this many failures in a row we stop calling the database
+        //for breaker_open_ms (doubling every time a probe fails, up to breaker_max_open_ms).
+        int breaker_failure_threshold = 5;
+        int breaker_open_ms = 5000;
+        int breaker_max_open_ms = 60000;
+        //serialization failures and deadlocks are retried this many times, waiting up to db_retry_base_ms * 2^attempt
+        int db_max_retries = 2;
+        int db_retry_base_ms = 20;
+        //a move that produces a position key longer than this rewrites the user's keys in the background
+        int position_rebalance_length = 32;
+        //completed tasks older than archive_after_days move to tasks_archive (0 turns that off). The job runs
+        //every archive_interval_seconds and moves archive_batch_size rows per transaction.
+        int archive_after_days = 30;
+        int archive_batch_size = 1000;
+        //how long responses are kept for Idempotency-Key retries
+        unsigned idempotency_ttl_seconds = 86400;
+        //the X-Debug-Token header /debug/profile and /debug/heap want. Empty (the default) turns them off.
+        std::string debug_token;
+
+        //built from the db_ fields when the config is loaded, so we don't rebuild it for every connection
+        std::string connection_string;
+        std::string replica_connection_string; // empty when there is no replica
+    };
+
+    //reads the file (if it exists) and the environment, validates everything and makes it the current config.
+    //throws std::runtime_error listing every problem it found.
+    void load(const std::string& path);
+
+    //the current config. Hold on to the pointer for as long as you need consistent values,
+    //a reload swaps in a new object and never modifies the old one.
+    std::shared_ptr<const Config> get();
+
+    //re-reads the file and environment, but only takes the reloadable values. Returns false (and keeps the
+    //old config) if the new one doesn't validate.
+    bool reload();
+
+    //runs after every successful reload with the new config. For settings that are pushed somewhere
+    //(like log levels) rather than read through get() every time.
+    void onReload(std::function<void(const Config&)> callback);
+
+    //starts a thread that calls reload() whenever the process gets SIGHUP. Does nothing on windows.
+    //must be called before any other thread is started so they all inherit the blocked signal.
+    void watchReload();
+}
@@ -0,0 +1,182 @@
+#include "circuit_breaker.h"
+#include "config.h"
+#include "logger.h"
+#include "deadline.h"
+#include "metrics.h"
+#include "crow.h"
+#include <pqxx/pqxx>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <algorithm>
+
+namespace database::breaker
+{
+    static std::atomic<State> current{State::Closed};
+    static std::atomic<bool> probe_in_flight{false};
+
+    //only touched with breaker_mutex held
+    static std::mutex breaker_mutex;
+    static std::atomic<int> consecutive_failures{0}; // atomic so onSuccess can check it without the lock
+    static std::chrono::steady_clock::time_point open_until;
+    static int open_ms = 0; // how long the current open period lasts, doubles every failed probe
+
+    ErrorKind classify(const std::exception& e)
+    {
+        //the commit may or may not have happened, retrying could apply a write twice
+        if (dynamic_cast<const pqxx::in_doubt_error*>(&e) != nullptr)
+        {
+            return ErrorKind::Unavailable;
+        }
+        if (dynamic_cast<const pqxx::broken_connection*>(&e) != nullptr)
+        {
+            return ErrorKind::Unavailable;
+        }
+        if (const auto* sql = dynamic_cast<const pqxx::sql_error*>(&e))
+        {
+            const std::string& code = sql->sqlstate();
+            if (code == "40001" || code == "40P01") // serialization_failure, deadlock_detected
+            {
+                return ErrorKind::Transient;
+            }
+            //57014 is statement_timeout (or a cancel), which is how a request's deadline ends a query
+            if (code == "57014")
+            {
+                return ErrorKind::TimedOut;
+            }
+            //08 connection problems, 53 out of resources (too many connections, disk full),
+            //57P01-57P03 server shutting down or starting up
+            if (code.rfind("08", 0) == 0 || code.rfind("53", 0) == 0 || code.rfind("57P", 0) == 0)
+            {
+                return ErrorKind::Unavailable;
+            }
+        }
+        return ErrorKind::Permanent;
+    }
+
+    State state()
+    {
+        return current.load(std::memory_order_acquire);
+    }
+
+    std::string toString(State s)
+    {
+        switch (s)
+        {
+            case State::Open:
+                return "open";
+            case State::HalfOpen:
+                return "half_open";
+            default:
+                return "closed";
+        }
+    }
+
+    void admit()
+    {
+        static auto& rejected = metrics::counter("todo_db_breaker_rejected_total");
+
+        State s = current.load(std::memory_order_acquire);
+        if (s == State::Closed)
+        {
+            return; // the normal case: one atomic load and we're through
+        }
+
+        if (s == State::Open)
+        {
+            std::lock_guard<std::mutex> lock(breaker_mutex);
+            if (std::chrono::steady_clock::now() < open_until)
+            {
+                rejected.fetch_add(1, std::memory_order_relaxed);
+                throw unavailable("Database circuit breaker is open");
+            }
+            current.store(State::HalfOpen, std::memory_order_release);
+        }
+
+        //half open: exactly one caller gets to probe, everyone else fails fast until we know more
+        bool expected = false;
+        if (!probe_in_flight.compare_exchange_strong(expected, true))
+        {
+            rejected.fetch_add(1, std::memory_order_relaxed);
+            throw unavailable("Database circuit breaker is probing");
+        }
+    }
+
+    void onSuccess()
+    {
+        if (current.load(std::memory_order_acquire) == State::Closed)
+        {
+            //skip the lock when there is nothing to reset, this runs after every query
+            if (consecutive_failures.load(std::memory_order_relaxed) == 0)
+            {
+                return;
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(breaker_mutex);
+        if (current.load() != State::Closed)
+        {
+            logging::info(logging::Subsystem::Database, "Database is reachable again, closing the circuit breaker");
+        }
+        consecutive_failures.store(0);
+        open_ms = 0;
+        current.store(State::Closed, std::memory_order_release);
+        probe_in_flight.store(false);
+    }
+
+    void onFailure()
+    {
+        static auto& opened = metrics::counter("todo_db_breaker_opened_total");
+        std::shared_ptr<const config::Config> cfg = config::get();
+
+        std::lock_guard<std::mutex> lock(breaker_mutex);
+        consecutive_failures.fetch_add(1);
+        State s = current.load();
+        if (s == State::HalfOpen || (s == State::Closed && consecutive_failures.load() >= cfg->breaker_failure_threshold))
+        {
+            //a failed probe doubles the wait, so a database that stays down isn't hammered every few seconds
+            open_ms = s == State::HalfOpen ? std::min(open_ms * 2, cfg->breaker_max_open_ms) : cfg->breaker_open_ms;
+            open_until = std::chrono::steady_clock::now() + std::chrono::milliseconds(open_ms);
+            current.store(State::Open, std::memory_order_release);
+            probe_in_flight.store(false);
+            opened.fetch_add(1, std::memory_order_relaxed);
+            logging::error(logging::Subsystem::Database, "Database circuit breaker opened", {{"open_ms", static_cast<long long>(open_ms)}, {"failures", static_cast<long long>(consecutive_failures.load())}});
+        }
+    }
+
+    void onAbandoned()
+    {
+        if (current.load(std::memory_order_acquire) == State::HalfOpen)
+        {
+            probe_in_flight.store(false); // let the next caller probe instead
+        }
+    }
+
+    bool backoff(int attempt)
+    {
+        static auto& retries = metrics::counter("todo_db_retries_total");
+        std::shared_ptr<const config::Config> cfg = config::get();
+        if (attempt > cfg->db_max_retries || current.load(std::memory_order_acquire) != State::Closed)
+        {
+            return false;
+        }
+
+        //exponential backoff with full jitter: a random wait between 0 and base * 2^(attempt-1).
+        //the randomness keeps all the retrying threads from hitting the database at the same moment.
+        thread_local std::mt19937 gen(std::random_device{}());
+        int ceiling = cfg->db_retry_base_ms << std::min(attempt - 1, 10);
+        int wait_ms = std::uniform_int_distribution<int>(0, std::max(ceiling, 1))(gen);
+
+        std::optional<long long> remaining = deadline::remainingMs();
+        if (remaining.has_value() && *remaining <= wait_ms)
+        {
+            return false;
+        }
+
+        retries.fetch_add(1, std::memory_order_relaxed);
+        std::this_thread::sleep_for(std::chrono::milliseconds(wait_ms));
+        return true;
+    }
+}
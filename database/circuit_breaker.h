@@ -0,0 +1,105 @@
+#pragma once
+#include <stdexcept>
+#include <string>
+#include <exception>
+
+
+namespace database
+{
+    //thrown when the database can't be used right now: the breaker is open, the connection failed,
+    //a query ran out of time or we couldn't get a connection. Routes answer it with a 503.
+    class unavailable : public std::runtime_error
+    {
+    public:
+        using std::runtime_error::runtime_error;
+    };
+}
+
+//a circuit breaker around every database call. After breaker_failure_threshold failures in a row it opens,
+//and for breaker_open_ms every call fails immediately with database::unavailable instead of waiting for a
+//connect timeout. Then one call is let through as a probe (half open): if it works we close again,
+//if not we stay open twice as long (up to breaker_max_open_ms).
+namespace database::breaker
+{
+    enum class State
+    {
+        Closed,
+        Open,
+        HalfOpen
+    };
+
+    enum class ErrorKind
+    {
+        Transient,   // serialization failure or deadlock: safe to retry right away
+        Unavailable, // connection or server trouble: counts against the breaker
+        TimedOut,    // the query hit statement_timeout, which is the request's deadline: that request fails, nobody else
+        Permanent    // our fault (constraint, bad query). The database is fine, so it doesn't count.
+    };
+
+    ErrorKind classify(const std::exception& e);
+    State state();
+    std::string toString(State s);
+
+    //throws database::unavailable if the breaker won't let a call through right now
+    void admit();
+    void onSuccess();
+    void onFailure();
+    //the call gave up for reasons that say nothing about the database (the request ran out of time).
+    //doesn't count either way, but frees the probe slot if this call was the probe.
+    void onAbandoned();
+    //sleeps before retry number attempt (1, 2...), with jitter. Returns false if we are out of retries
+    //or the sleep would run past the request deadline.
+    bool backoff(int attempt);
+
+    //runs op with the breaker and retries transient errors. Permanent errors are rethrown as they are,
+    //unavailable ones come out as database::unavailable. Pass retryable = false when op has side effects
+    //outside the transaction (like writing an export) that a second attempt would repeat.
+    template <typename Op>
+    auto call(Op&& op, bool retryable = true) -> decltype(op())
+    {
+        for (int attempt = 1; ; ++attempt)
+        {
+            admit();
+            try
+            {
+                auto result = op();
+                onSuccess();
+                return result;
+            }
+            catch (const unavailable&)
+            {
+                //from the pool: every connection busy, or the request was out of time before it got one. A burst of
+                //traffic against a healthy database looks exactly like this, so it doesn't count. A database that
+                //is really gone fails the connects (broken_connection, below) or the queries of the busy connections.
+                onAbandoned();
+                throw;
+            }
+            catch (const std::exception& e)
+            {
+                ErrorKind kind = classify(e);
+                if (kind == ErrorKind::Unavailable)
+                {
+                    onFailure();
+                }
+                else if (kind == ErrorKind::TimedOut)
+                {
+                    //one slow export or heavy read is not the database being down
+                    onAbandoned();
+                }
+                else
+                {
+                    onSuccess(); // the database answered, it just didn't like what we sent
+                }
+                //a dropped connection is not retried: for a write we can't tell if the commit made it
+                if (kind != ErrorKind::Transient || !retryable || !backoff(attempt))
+                {
+                    if (kind == ErrorKind::Unavailable || kind == ErrorKind::TimedOut)
+                    {
+                        throw unavailable(e.what());
+                    }
+                    throw;
+                }
+            }
+        }
+    }
+}
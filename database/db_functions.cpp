@@ -1,33 +1,230 @@
 #include "db_functions.h"
 #include "task.hpp"
+#include "stats_cache.h"
+#include "profile_cache.h"
+#include "db_pool.h"
+#include "config.h"
+#include "logger.h"
+#include "position_key.h"
+#include "background.h"
+#include "single_flight.h"
+#include <vector>
 
 
 namespace database
 {
-    std::string getConnection()
+    //due_at as ISO 8601 in UTC, the same form the api takes
+    static const std::string due_at_column = "to_char(due_at AT TIME ZONE 'UTC', 'YYYY-MM-DD\"T\"HH24:MI:SS\"Z\"') AS due_at";
+
+    //tells the reminder scheduler of every worker (see reminders.h) when the task is due now. NOTIFY is only
+    //delivered on commit, so a rolled back change is never announced. Works for deleted tasks too (they announce "none").
+    static void notifyDue(pqxx::work& W, int tID, int userID)
+    {
+        W.exec(pqxx::prepped{"notify_due"}, pqxx::params{tID, userID});
+    }
+
+    //identical reads that arrive together (two tabs open, fetchTasks() firing twice) share one query.
+    //every write forgets the user's flight, so a read that starts after a write never gets data from before it.
+    static SingleFlight<int, std::vector<Task>>& taskReads()
+    {
+        static SingleFlight<int, std::vector<Task>> flights("todo_task_reads_coalesced_total");
+        return flights;
+    }
+
+    static SingleFlight<int, std::optional<Profile>>& profileReads()
+    {
+        static SingleFlight<int, std::optional<Profile>> flights("todo_profile_reads_coalesced_total");
+        return flights;
+    }
+
+    //adds delta to the counter column matching Tstatus. Runs inside the caller's transaction
+    //so the counters commit (or roll back) together with the task change.
+    static void adjustTaskCount(pqxx::work& W, int userID, const std::string& Tstatus, int delta)
+    {
+        std::string column;
+        try
+        {
+            column = toString(toStatus(Tstatus)); // the column names match the status strings
+        }
+        catch (const std::runtime_error&)
+        {
+            return; // unknown statuses are not counted
+        }
+
+        W.exec("INSERT INTO task_counts (user_id, " + column + ") VALUES (" + W.quote(userID) + ", GREATEST(" + W.quote(delta) + ", 0)) "
+               "ON CONFLICT (user_id) DO UPDATE SET " + column + " = task_counts." + column + " + " + W.quote(delta) + ";");
+    }
+
+    //every transaction that reads neighbouring positions and then writes one takes this per-user lock first,
+    //so two moves (or a move and a rebalance) can't both pick the same gap. 1 is our advisory lock namespace for positions.
+    static void lockPositions(pqxx::work& W, int userID)
+    {
+        W.exec("SELECT pg_advisory_xact_lock(1, " + W.quote(userID) + ");");
+    }
+
+    static std::optional<std::string> firstText(const pqxx::result& R)
+    {
+        if (R.empty() || R[0][0].is_null())
+        {
+            return std::nullopt;
+        }
+        return R[0][0].as<std::string>();
+    }
+
+    //gives every task of the user a fresh short key, keeping the current order (tasks without a position go last,
+    //in id order). One UPDATE for the whole user. The caller holds the position lock.
+    static size_t assignPositions(pqxx::work& W, int userID)
+    {
+        std::vector<int> ids;
+        for (const auto& row : W.exec("SELECT id FROM tasks WHERE user_id = " + W.quote(userID) + " ORDER BY position NULLS LAST, id;"))
+        {
+            ids.push_back(row[0].as<int>());
+        }
+        std::vector<std::string> keys = positionKey::sequence(ids.size());
+        W.exec("UPDATE tasks SET position = v.position "
+               "FROM unnest($1::int[], $2::text[]) AS v(id, position) "
+               "WHERE tasks.id = v.id AND tasks.user_id = $3;", pqxx::params{ids, keys, userID});
+        return ids.size();
+    }
+
+    //background job, see moveTask
+    static void rebalancePositions(int userID)
+    {
+        breaker::call([&]()
+        {
+            pool::Lease C = pool::acquire();
+            pqxx::work W(*C);
+            lockPositions(W, userID);
+            size_t count = assignPositions(W, userID);
+            W.commit();
+            taskReads().forget(userID);
+            pool::noteWrite(userID);
+            logging::info(logging::Subsystem::Database, "Rebalanced task positions", {{"user_id", userID}, {"count", static_cast<long long>(count)}});
+            return count;
+        });
+    }
+
+    //keys only grow when tasks keep getting dropped into the same gap. Past position_rebalance_length
+    //the user's keys are rewritten in the background, the move that noticed doesn't wait for it.
+    static void checkKeyLength(int userID, const std::string& key)
     {
-        //Probably a way better solution to having to do this.
-        std::string name_ev = std::getenv("DBNAME");
-        std::string user_ev = std::getenv("USER");
-        std::string password_ev = std::getenv("PASSWORD");
-        std::string host_ev = std::getenv("HOST");
-        std::string port_ev = std::getenv("PORT");
+        if (key.size() > static_cast<size_t>(config::get()->position_rebalance_length))
+        {
+            background::post("rebalance:" + std::to_string(userID), [userID]() { rebalancePositions(userID); });
+        }
+    }
 
-        // password shouldn't be empty. But just in case
-        if (password_ev.empty())
+    //turns the plain tasks table into one hash partitioned by user_id. Runs once, inside ensure_db's transaction,
+    //so a failure leaves the old table as it was. Afterwards every query for one user's tasks only touches
+    //that user's partition and its indexes, however many users there are.
+    static void partitionTasks(pqxx::work& W, int partitions)
+    {
+        if (W.query_value<bool>("SELECT relkind = 'p' FROM pg_class WHERE oid = 'tasks'::regclass;"))
         {
-            CROW_LOG_ERROR << "DB password env variable was not set. Can't connect to db.";
-            return "";
+            return; // done already
         }
+        logging::info(logging::Subsystem::Database, "Partitioning 'tasks', this copies every task once", {{"partitions", partitions}});
 
-        std::string connectString = "dbname=" + name_ev +
-                                    " user=" + user_ev +
-                                    " password=" + password_ev +
-                                    " host=" + host_ev +
-                                    " port=" + port_ev;
+        W.exec("ALTER TABLE tasks RENAME TO tasks_unpartitioned;");
+        //ids keep coming from the same sequence, so nothing that remembered a task id breaks
+        std::string sequence = W.query_value<std::string>("SELECT pg_get_serial_sequence('tasks_unpartitioned', 'id');");
+        W.exec("CREATE TABLE tasks ("
+            "id INTEGER NOT NULL DEFAULT nextval(" + W.quote(sequence) + "::regclass),"
+            "description VARCHAR(256) NOT NULL,"
+            "status VARCHAR(15) NOT NULL DEFAULT 'todo',"
+            "user_id INTEGER NOT NULL REFERENCES users(id) ON DELETE CASCADE,"
+            "position TEXT COLLATE \"C\" NOT NULL,"
+            "completed_at TIMESTAMP WITH TIME ZONE,"
+            "PRIMARY KEY (user_id, id)" // postgres wants the partition key in every unique index
+            ") PARTITION BY HASH (user_id);");
+        for (int i = 0; i < partitions; i++)
+        {
+            W.exec("CREATE TABLE tasks_p" + std::to_string(i) + " PARTITION OF tasks "
+                   "FOR VALUES WITH (MODULUS " + std::to_string(partitions) + ", REMAINDER " + std::to_string(i) + ");");
+        }
 
-        CROW_LOG_INFO << "Using connectString: " << connectString.substr(0, connectString.find("password=")) + "password=*****";
-        return connectString;
+        W.exec("INSERT INTO tasks (id, description, status, user_id, position, completed_at) "
+               "SELECT id, description, status, user_id, position, completed_at FROM tasks_unpartitioned WHERE user_id IS NOT NULL;");
+        //tasks from before they had owners can't go in a table keyed by user. Nobody could reach them anyway,
+        //so they are kept in the archive instead of being thrown away.
+        W.exec("INSERT INTO tasks_archive (id, description, status, user_id, completed_at) "
+               "SELECT id, description, status, NULL, completed_at FROM tasks_unpartitioned WHERE user_id IS NULL;");
+        //the sequence is owned by the old id column and would be dropped along with it
+        W.exec("ALTER SEQUENCE " + sequence + " OWNED BY tasks.id;");
+        W.exec("DROP TABLE tasks_unpartitioned;");
+    }
+
+    std::string getConnection()
+    {
+        //built and validated once when the config is loaded, see config.cpp
+        return config::get()->connection_string;
+    }
+
+    void prepareStatements(pqxx::connection& C)
+    {
+        //pooled connections live for a long time, so every statement is prepared once here
+        //instead of on every call (preparing the same name twice on one connection is an error).
+        C.prepare("create_task", "INSERT INTO tasks (description, status, user_id, position, completed_at, due_at) "
+                                 "VALUES ($1, $2, $3, $4, CASE WHEN $2 = 'completed' THEN CURRENT_TIMESTAMP END, to_timestamp($5::bigint / 1000.0)) RETURNING id;"); // what does returning id mean here?
+        //neighbours for a new position, all served by the (user_id, position) index. $2 is the task being moved,
+        //which must not count as its own neighbour.
+        C.prepare("position_of", "SELECT position FROM tasks WHERE id = $1 AND user_id = $2;");
+        C.prepare("first_position", "SELECT position FROM tasks WHERE user_id = $1 AND id <> $2 ORDER BY position LIMIT 1;");
+        C.prepare("last_position", "SELECT position FROM tasks WHERE user_id = $1 AND id <> $2 ORDER BY position DESC LIMIT 1;");
+        C.prepare("position_after", "SELECT position FROM tasks WHERE user_id = $1 AND id <> $2 AND position > $3 ORDER BY position LIMIT 1;");
+        C.prepare("position_before", "SELECT position FROM tasks WHERE user_id = $1 AND id <> $2 AND position < $3 ORDER BY position DESC LIMIT 1;");
+        C.prepare("move_task", "UPDATE tasks SET position = $1 WHERE id = $2 AND user_id = $3;");
+        //one batch of the archiving job. SKIP LOCKED leaves rows that a request is busy with for the next run.
+        //archived tasks leave the completed counter in the same statement, and it returns how many went per user.
+        C.prepare("archive_tasks",
+            "WITH moved AS ("
+            "DELETE FROM tasks t USING ("
+            "SELECT user_id, id FROM tasks WHERE status = 'completed' AND completed_at < now() - make_interval(days => $1) "
+            "LIMIT $2 FOR UPDATE SKIP LOCKED"
+            ") old WHERE t.user_id = old.user_id AND t.id = old.id "
+            "RETURNING t.id, t.description, t.status, t.user_id, t.completed_at"
+            "), "
+            "archived AS ("
+            "INSERT INTO tasks_archive (id, description, status, user_id, completed_at) "
+            "SELECT id, description, status, user_id, completed_at FROM moved"
+            "), "
+            "per_user AS (SELECT user_id, count(*) AS moved FROM moved GROUP BY user_id), "
+            "counted AS ("
+            "UPDATE task_counts c SET completed = GREATEST(c.completed - p.moved, 0) FROM per_user p WHERE c.user_id = p.user_id"
+            ") "
+            "SELECT user_id, moved FROM per_user;");
+        //newest first. The cursor is the last id of the previous page, its (completed_at, id) is where the next page starts.
+        C.prepare("archive_page",
+            "SELECT id, description, status, to_char(completed_at AT TIME ZONE 'UTC', 'YYYY-MM-DD\"T\"HH24:MI:SS\"Z\"') AS completed_at "
+            "FROM tasks_archive WHERE user_id = $1 "
+            "ORDER BY completed_at DESC, id DESC LIMIT $2;");
+        C.prepare("archive_page_after",
+            "SELECT id, description, status, to_char(completed_at AT TIME ZONE 'UTC', 'YYYY-MM-DD\"T\"HH24:MI:SS\"Z\"') AS completed_at "
+            "FROM tasks_archive WHERE user_id = $1 "
+            "AND (completed_at, id) < (SELECT completed_at, id FROM tasks_archive WHERE id = $3 AND user_id = $1) "
+            "ORDER BY completed_at DESC, id DESC LIMIT $2;");
+        C.prepare("delete_task", "DELETE FROM tasks WHERE id = $1 AND user_id = $2 RETURNING status, due_at IS NOT NULL AS had_due;");
+        //payload is "<task id> <user id> <due in ms since 1970>", or "-" instead of the time when there is nothing to remind of
+        C.prepare("notify_due",
+            "SELECT pg_notify('task_due', $1::int::text || ' ' || $2::int::text || ' ' || COALESCE(("
+            "SELECT (extract(epoch FROM due_at) * 1000)::bigint::text FROM tasks "
+            "WHERE id = $1 AND user_id = $2 AND status <> 'completed' AND due_at IS NOT NULL), '-'));");
+        //what the scheduler keeps in memory: the next $2 reminders due at or after $1 (ms since 1970)
+        C.prepare("upcoming_reminders",
+            "SELECT id, user_id, (extract(epoch FROM due_at) * 1000)::bigint AS due_ms FROM tasks "
+            //paged by (due ms, id), so tasks sharing a due time are never split between pages and lost.
+            //the due_at range is only there for the index, the row comparison is the exact cut.
+            "WHERE due_at >= to_timestamp(($1::bigint - 1) / 1000.0) AND status <> 'completed' "
+            "AND ((extract(epoch FROM due_at) * 1000)::bigint, id) >= ($1::bigint, $2::int) "
+            "ORDER BY due_at, id LIMIT $3;");
+        C.prepare("due_tasks",
+            "SELECT id, user_id, description, status, " + due_at_column + " FROM tasks "
+            "WHERE id = ANY($1::int[]) AND status <> 'completed' AND due_at IS NOT NULL;");
+        C.prepare("get_task_stats", "SELECT todo, inprogress, completed FROM task_counts WHERE user_id = $1;");
+        //a taken username returns no row instead of raising unique_violation (which would abort the transaction)
+        C.prepare("create_user", "INSERT INTO users (username, password_hash) VALUES ($1, $2) ON CONFLICT (username) DO NOTHING RETURNING id;");
+        C.prepare("get_profile", "SELECT id, username FROM users WHERE id = $1;");
+        C.prepare("get_username", "SELECT id, username, password_hash FROM users WHERE username = $1;");
     }
 
     void ensure_db()
@@ -45,7 +242,18 @@ namespace database
                     "password_hash VARCHAR(255) NOT NULL,"
                     "created_at TIMESTAMP WITH TIME ZONE DEFAULT CURRENT_TIMESTAMP"
                     ");");
-            CROW_LOG_INFO << "Ensured 'users' table exists";
+            logging::info(logging::Subsystem::Database, "Ensured 'users' table exists");
+
+            //users can be deleted (or renamed) straight in SQL, past every profileCache::invalidate() call we make.
+            //Every worker listens for this (see reminders.cpp) and drops the user from its profile cache.
+            W.exec("CREATE OR REPLACE FUNCTION notify_user_changed() RETURNS trigger AS $$ BEGIN "
+                "PERFORM pg_notify('user_changed', OLD.id::text); "
+                "RETURN NULL; "
+                "END $$ LANGUAGE plpgsql;");
+            W.exec("DROP TRIGGER IF EXISTS users_changed ON users;");
+            W.exec("CREATE TRIGGER users_changed AFTER DELETE OR UPDATE OF username ON users "
+                "FOR EACH ROW EXECUTE FUNCTION notify_user_changed();");
+            logging::info(logging::Subsystem::Database, "Ensured 'users' change notifications");
 
             //sql terminology
             // IF NOT EXISTS ensures it doesn't throw an error if the table already exists.
@@ -59,7 +267,7 @@ namespace database
                 "ALTER TABLE tasks ADD CONSTRAINT fk_user FOREIGN KEY (user_id) REFERENCES users(id) ON DELETE CASCADE;"
                 "END IF;"
                 "END $$;");
-            CROW_LOG_INFO << "Ensured 'tasks' table has 'user_id' column and foreign key constraint.";
+            logging::info(logging::Subsystem::Database, "Ensured 'tasks' table has 'user_id' column and foreign key constraint");
 
             //sql terminology
             //SELECT 1 FROM pg_attribute: This queries the PostgreSQL system catalog (pg_attribute table),
@@ -75,235 +283,706 @@ namespace database
                 "status VARCHAR(15) NOT NULL DEFAULT 'todo'"
                 ");");
 
+            //seeding scans every task, so it only happens the one time the table is created
+            bool seed_counts = W.query_value<bool>("SELECT to_regclass('task_counts') IS NULL;");
+            W.exec("CREATE TABLE IF NOT EXISTS task_counts ("
+                "user_id INTEGER PRIMARY KEY REFERENCES users(id) ON DELETE CASCADE,"
+                "todo INTEGER NOT NULL DEFAULT 0,"
+                "inprogress INTEGER NOT NULL DEFAULT 0,"
+                "completed INTEGER NOT NULL DEFAULT 0"
+                ");");
+
+            //seed the counters from the existing tasks (first run after upgrading).
+            //from then on the task write functions keep them up to date.
+            if (seed_counts)
+            {
+                W.exec("INSERT INTO task_counts (user_id, todo, inprogress, completed) "
+                    "SELECT user_id, "
+                    "COUNT(*) FILTER (WHERE status = 'todo'), "
+                    "COUNT(*) FILTER (WHERE status = 'inprogress'), "
+                    "COUNT(*) FILTER (WHERE status = 'completed') "
+                    "FROM tasks WHERE user_id IS NOT NULL GROUP BY user_id "
+                    "ON CONFLICT (user_id) DO NOTHING;");
+            }
+            logging::info(logging::Subsystem::Database, "Ensured 'task_counts' table exists");
+
+            //manual ordering. COLLATE "C" makes postgres compare the keys byte by byte, the way positionKey builds them.
+            W.exec("ALTER TABLE tasks ADD COLUMN IF NOT EXISTS position TEXT COLLATE \"C\";");
+            //tasks from before this column existed keep their id order
+            size_t backfilled = 0;
+            for (const auto& row : W.exec("SELECT DISTINCT user_id FROM tasks WHERE position IS NULL AND user_id IS NOT NULL;"))
+            {
+                backfilled += assignPositions(W, row[0].as<int>());
+            }
+            //rows from before tasks had owners can't be listed or moved by anyone, they only need a value
+            W.exec("UPDATE tasks SET position = 'a0' WHERE user_id IS NULL AND position IS NULL;");
+            W.exec("ALTER TABLE tasks ALTER COLUMN position SET NOT NULL;");
+            logging::info(logging::Subsystem::Database, "Ensured task positions", {{"backfilled", static_cast<long long>(backfilled)}});
+
+            //completed tasks older than archive_after_days move to tasks_archive, see archiveCompletedTasks.
+            //we can't know when existing tasks were completed, so their clock starts now.
+            W.exec("ALTER TABLE tasks ADD COLUMN IF NOT EXISTS completed_at TIMESTAMP WITH TIME ZONE;");
+            W.exec("UPDATE tasks SET completed_at = CURRENT_TIMESTAMP WHERE status = 'completed' AND completed_at IS NULL;");
+            W.exec("CREATE TABLE IF NOT EXISTS tasks_archive ("
+                "id INTEGER PRIMARY KEY,"
+                "description VARCHAR(256) NOT NULL,"
+                "status VARCHAR(15) NOT NULL,"
+                "user_id INTEGER REFERENCES users(id) ON DELETE CASCADE,"
+                "completed_at TIMESTAMP WITH TIME ZONE,"
+                "archived_at TIMESTAMP WITH TIME ZONE NOT NULL DEFAULT CURRENT_TIMESTAMP"
+                ");");
+            W.exec("CREATE INDEX IF NOT EXISTS tasks_archive_user_completed ON tasks_archive (user_id, completed_at DESC, id DESC);");
+            logging::info(logging::Subsystem::Database, "Ensured 'tasks_archive' table exists");
+
+            partitionTasks(W, config::get()->task_partitions);
+            //created on the partitioned table, so every partition gets its own copy
+            W.exec("CREATE INDEX IF NOT EXISTS tasks_user_position ON tasks (user_id, position);");
+            W.exec("CREATE INDEX IF NOT EXISTS tasks_completed_at ON tasks (completed_at) WHERE status = 'completed';");
+            logging::info(logging::Subsystem::Database, "Ensured 'tasks' is partitioned by user");
+
+            //reminders: only open tasks with a due time are in the index the scheduler loads from
+            W.exec("ALTER TABLE tasks ADD COLUMN IF NOT EXISTS due_at TIMESTAMP WITH TIME ZONE;");
+            W.exec("CREATE INDEX IF NOT EXISTS tasks_due_at ON tasks (due_at) WHERE due_at IS NOT NULL AND status <> 'completed';");
+            logging::info(logging::Subsystem::Database, "Ensured task due dates");
+
             W.commit(); // this makes the effects of a transaction definite. Meaning that the changes have been made to the database
-            CROW_LOG_INFO << "Database Schema was ensured...";
+            logging::info(logging::Subsystem::Database, "Database schema was ensured");
         }
         catch(const pqxx::sql_error& e)
         {
-            CROW_LOG_ERROR << "Database error: " << e.what();
-            CROW_LOG_ERROR << "Query was: " << e.query();
-            CROW_LOG_ERROR << "SQL state: " << e.sqlstate();
+            logging::error(logging::Subsystem::Database, "Database error while ensuring the schema", {{"error", e.what()}, {"query", e.query()}, {"sqlstate", e.sqlstate()}});
             exit(1);
         }
         catch (const std::exception& e)
         {
-            CROW_LOG_ERROR << "Error in connecting to data base schema:  " << e.what();
+            logging::error(logging::Subsystem::Database, "Error in connecting to the database schema", {{"error", e.what()}});
             exit(1);
         }
     }
 
-    std::vector<Task> getTasks(std::optional<int> userID)
+    static std::vector<Task> loadTasks(std::optional<int> userID)
     {
-        std::vector<Task> tasks;
-
-        try
+        //every function below runs its queries through the circuit breaker (see circuit_breaker.h),
+        //which retries transient errors and fails fast while the database is down
+        return breaker::call([&]()
         {
-            // connection object called C
-            pqxx::connection C(getConnection());
-            pqxx::work W(C);
-            std::string query = ("SELECT id, description, status FROM tasks"); // now a dynamic sql string due to user implementation
+            std::vector<Task> tasks;
+
+            try
+            {
+                // connection object called C
+                pool::Lease C = pool::acquireRead(userID); // reads can go to the replica
+                pqxx::work W(*C);
+                std::string query = ("SELECT id, description, status, " + due_at_column + " FROM tasks"); // now a dynamic sql string due to user implementation
+
+                //the reason for not creating placeholders here is because of the optional aspect where if i were to make a public api,
+                //then a user id would not be required
+                if (userID.has_value()) //again, checks if an optional data type has a value.
+                {
+                    query += " WHERE user_id = " + W.quote(userID.value()); //Mismatching variables, bad practice.
+                    query += " ORDER BY position, id;"; // the user's own order, see moveTask
+                }
+                else
+                {
+                    query += " ORDER BY id ASC;"; // orders id's by ascending order. Positions only mean something within one user
+                }
 
-            //the reason for not creating placeholders here is because of the optional aspect where if i were to make a public api,
-            //then a user id would not be required
-            if (userID.has_value()) //again, checks if an optional data type has a value.
+                for (const auto& row : W.exec(query))
+                {
+                    //this is called uniform initialization. Cleaner than having create an explicit temp Task object
+                    tasks.push_back(Task
+                        {
+                            //.as<T>() functions converts json objects to their desired types
+                            row["id"].as<int>(),
+                            row["description"].as<std::string>(),
+                            row["status"].as<std::string>(),
+                            row["due_at"].as<std::optional<std::string>>()
+                        });
+                }
+                W.commit();
+            }
+            catch (const std::exception& e)
             {
-                query += " WHERE user_id = " + W.quote(userID.value()); //Mismatching variables, bad practice.
+                //used to return an empty list here, which made an outage look like "this user has no tasks"
+                logging::error(logging::Subsystem::Database, "Error listing tasks", {{"error", e.what()}});
+                throw;
             }
-            query += " ORDER BY id ASC;"; // orders id's by ascending order
 
-            for (const auto& row : W.exec(query))
+            return tasks;
+        });
+    }
+
+    std::vector<Task> getTasks(std::optional<int> userID)
+    {
+        if (userID.has_value())
+        {
+            return taskReads().run(userID.value(), [&]() { return loadTasks(userID); });
+        }
+        return loadTasks(userID);
+    }
+
+    std::optional<Task> getTask(int tID, std::optional<int> userID) // I believe this isn't quite useful anymore.
+    {
+        return breaker::call([&]() -> std::optional<Task>
+        {
+            try
             {
-                //this is called uniform initialization. Cleaner than having create an explicit temp Task object
-                tasks.push_back(Task
+                pool::Lease C = pool::acquireRead(userID);
+                pqxx::work W(*C);
+                std::string query = "SELECT id, description, status, " + due_at_column + " FROM tasks WHERE id = " + W.quote(tID); //quote function is for safety against sql injections
+                if (userID.has_value())
+                {
+                    query += " AND user_id = " + W.quote(userID.value());
+                }
+                query += ";";
+
+                pqxx::result R = W.exec(query);
+                W.commit();
+
+                if (!R.empty())
+                {
+                    auto const& row = R[0];
+                    return Task
                     {
-                        //.as<T>() functions converts json objects to their desired types
                         row["id"].as<int>(),
                         row["description"].as<std::string>(),
-                        row["status"].as<std::string>()
-                    });
+                        row["status"].as<std::string>(),
+                        row["due_at"].as<std::optional<std::string>>()
+                    };
+                }
             }
-            W.commit();
-        }
-        catch (const std::exception& e)
+            catch (const std::exception& e)
+            {
+                logging::error(logging::Subsystem::Database, "Error listing task", {{"error", e.what()}});
+                throw; // what does this do?
+            }
+            return std::nullopt; //im assuming this is a null optional.
+        });
+    }
+
+    int createTask(std::string_view description, const std::string& Tstatus, int userID, std::optional<long long> due_ms)
+    {
+        return breaker::call([&]()
         {
-            CROW_LOG_ERROR << "Error listing tasks: " << e.what();
-        }
+            try
+            {
+                pool::Lease C = pool::acquire();
+                pqxx::work W(*C);
+                //new tasks go at the bottom. 0 because there is no task to leave out (ids start at 1).
+                lockPositions(W, userID);
+                std::optional<std::string> last = firstText(W.exec(pqxx::prepped{"last_position"}, pqxx::params{userID, 0}));
+                std::string position = positionKey::between(last, std::nullopt);
+                pqxx::result R = W.exec(pqxx::prepped{"create_task"}, pqxx::params{description, Tstatus, userID, position, due_ms}); // instead of setting the parameters individually we do it together
+                adjustTaskCount(W, userID, Tstatus, 1);
+                if (due_ms && !R.empty())
+                {
+                    notifyDue(W, R[0]["id"].as<int>(), userID);
+                }
+                W.commit(); // commit when we  change something ? Like writing. No commit needed when we read.
+                statsCache::invalidate(userID);
+                taskReads().forget(userID);
+                pool::noteWrite(userID); // keeps this user's reads on the primary until the replica has the new task
+
+                if (!R.empty())
+                {
+                    return R[0]["id"].as<int>();
+                }
 
-        return tasks;
+            }
+            catch (const std::exception& e)
+            {
+                logging::error(logging::Subsystem::Database, "Could not create task", {{"error", e.what()}});
+                throw;
+            }
+            return -1; //we return a failure
+        });
     }
 
-    std::optional<Task> getTask(int tID, std::optional<int> userID) // I believe this isn't quite useful anymore.
+    bool updateTask(int tID, std::optional<std::string_view> description, std::optional<status> Estatus, int userID, std::optional<std::optional<long long>> due_ms)
     {
-        try
+        return breaker::call([&]()
         {
-            pqxx::connection C(getConnection());
-            pqxx::work W(C);
-            std::string query = "SELECT id, description, status FROM tasks WHERE id = " + W.quote(tID); //quote function is for safety against sql injections
-            if (userID.has_value())
+            try
             {
-                query += " AND user_id = " + W.quote(userID.value());
-            }
-            query += ";";
+                pool::Lease C = pool::acquire();
+                pqxx::work W(*C);
 
-            pqxx::result R = W.exec(query);
-            W.commit();
+                //if the status changes we need the old one to move the count over.
+                //FOR UPDATE locks the row so nobody changes it between this read and our update.
+                std::optional<std::string> old_status;
+                if (Estatus)
+                {
+                    pqxx::result old = W.exec("SELECT status FROM tasks WHERE id = " + W.quote(tID) + " AND user_id = " + W.quote(userID) + " FOR UPDATE;");
+                    if (old.empty())
+                    {
+                        return false; // nothing to update
+                    }
+                    old_status = old[0]["status"].as<std::string>();
+                }
 
-            if (!R.empty())
-            {
-                auto const& row = R[0];
-                return Task
+                std::string query = "UPDATE tasks SET";
+                bool first_field = true; //just used to determine which fields have changed.
+
+                if (description)
                 {
-                    row["id"].as<int>(),
-                    row["description"].as<std::string>(),
-                    row["status"].as<std::string>()
-                };
+                    query += " description = " + W.quote(*description);
+                    first_field = false;
+                }
+                if (Estatus)
+                {
+                    if (!first_field) query += ", ";
+                    query += " status = " + W.quote(toString(Estatus.value()));
+                    //the archive clock starts when a task is completed and stops if it is reopened
+                    query += Estatus.value() == status::Completed ? ", completed_at = COALESCE(completed_at, CURRENT_TIMESTAMP)" : ", completed_at = NULL";
+                    first_field = false;
+                }
+                if (due_ms)
+                {
+                    if (!first_field) query += ", ";
+                    query += due_ms.value() ? " due_at = to_timestamp(" + W.quote(*due_ms.value()) + " / 1000.0)" : " due_at = NULL";
+                    first_field = false;
+                }
+
+                query += " WHERE id = " + W.quote(tID) + " AND user_id = " + W.quote(userID) + " RETURNING id, due_at IS NOT NULL AS has_due;";
+                pqxx::result R = W.exec(query);
+                if (old_status && R.affected_rows() > 0 && *old_status != toString(Estatus.value()))
+                {
+                    adjustTaskCount(W, userID, *old_status, -1);
+                    adjustTaskCount(W, userID, toString(Estatus.value()), 1);
+                }
+                //completing a task cancels its reminder and reopening it brings the reminder back
+                if (!R.empty() && (due_ms || (Estatus && R[0]["has_due"].as<bool>())))
+                {
+                    notifyDue(W, tID, userID);
+                }
+                W.commit();
+                if (old_status)
+                {
+                    statsCache::invalidate(userID);
+                }
+                taskReads().forget(userID);
+                pool::noteWrite(userID);
+                return R.affected_rows() > 0;
             }
-        }
-        catch (const std::exception& e)
+            catch (const std::exception& e)
+            {
+                logging::error(logging::Subsystem::Database, "Could not update task", {{"error", e.what()}});
+                throw; // false means "not found" to the route, an error must not look like that
+            }
+        });
+    }
+
+    bool deleteTask(int tID, int userID)
+    {
+        return breaker::call([&]()
         {
-            CROW_LOG_ERROR << "Error listing task: " << e.what();
-            throw; // what does this do?
-        }
-        return std::nullopt; //im assuming this is a null optional.
+            try
+            {
+                pool::Lease C = pool::acquire();
+                pqxx::work W(*C);
+
+                pqxx::result R = W.exec(pqxx::prepped{"delete_task"}, pqxx::params{tID, userID});
+                if (!R.empty())
+                {
+                    adjustTaskCount(W, userID, R[0]["status"].as<std::string>(), -1);
+                    if (R[0]["had_due"].as<bool>())
+                    {
+                        notifyDue(W, tID, userID); // the row is gone, so this cancels the reminder
+                    }
+                }
+                W.commit();
+                if (!R.empty())
+                {
+                    statsCache::invalidate(userID);
+                    taskReads().forget(userID);
+                    pool::noteWrite(userID);
+                }
+                return R.affected_rows() > 0;
+            }
+            catch (const std::exception& e)
+            {
+                logging::error(logging::Subsystem::Database, "Could not delete task", {{"error", e.what()}});
+                throw; //same idea applies here
+            }
+        });
     }
 
-    int createTask(const std::string& description, const std::string& Tstatus, int userID)
+    bool moveTask(int tID, int userID, const TaskMove& move)
     {
-        try
+        return breaker::call([&]()
         {
-            pqxx::connection C(getConnection());
-            pqxx::work W(C);
-            C.prepare("create_task", "INSERT INTO tasks (description, status, user_id) VALUES ($1, $2, $3) RETURNING id;"); // what does returning id mean here?
-            pqxx::result R = W.exec(pqxx::prepped{"create_task"}, pqxx::params{description, Tstatus, userID}); // instead of setting the parameters individually we do it together
-            W.commit(); // commit when we  change something ? Like writing. No commit needed when we read.
+            pool::Lease C = pool::acquire();
+            pqxx::work W(*C);
+            if (move.anchorID == tID)
+            {
+                //next to itself is where it already is, as long as it is one of the user's tasks at all
+                return firstText(W.exec(pqxx::prepped{"position_of"}, pqxx::params{tID, userID})).has_value();
+            }
+            lockPositions(W, userID);
 
-            if (!R.empty())
+            //find the two tasks it goes between. Only reads through the (user_id, position) index,
+            //and only the moved task is written, however long the list is.
+            std::optional<std::string> lower;
+            std::optional<std::string> upper;
+            if (move.anchorID.has_value())
+            {
+                std::optional<std::string> anchor = firstText(W.exec(pqxx::prepped{"position_of"}, pqxx::params{*move.anchorID, userID}));
+                if (!anchor.has_value())
+                {
+                    return false; // not one of this user's tasks
+                }
+                if (move.after)
+                {
+                    lower = anchor;
+                    upper = firstText(W.exec(pqxx::prepped{"position_after"}, pqxx::params{userID, tID, *anchor}));
+                }
+                else
+                {
+                    upper = anchor;
+                    lower = firstText(W.exec(pqxx::prepped{"position_before"}, pqxx::params{userID, tID, *anchor}));
+                }
+            }
+            else if (move.after)
             {
-                return R[0]["id"].as<int>();
+                upper = firstText(W.exec(pqxx::prepped{"first_position"}, pqxx::params{userID, tID})); // to the top
+            }
+            else
+            {
+                lower = firstText(W.exec(pqxx::prepped{"last_position"}, pqxx::params{userID, tID})); // to the bottom
             }
 
+            std::string position = positionKey::between(lower, upper);
+            pqxx::result R = W.exec(pqxx::prepped{"move_task"}, pqxx::params{position, tID, userID});
+            if (R.affected_rows() == 0)
+            {
+                return false;
+            }
+            W.commit();
+            taskReads().forget(userID);
+            pool::noteWrite(userID);
+            checkKeyLength(userID, position);
+            return true;
+        });
+    }
+
+    TaskStats getTaskStats(int userID)
+    {
+        //served from memory when we can. Otherwise it's a single primary key lookup on task_counts,
+        //so the cost doesn't depend on how many tasks the user has.
+        if (std::optional<TaskStats> cached = statsCache::lookup(userID))
+        {
+            return *cached;
         }
-        catch (const std::exception& e)
+
+        uint64_t generation = statsCache::beginLoad(userID);
+        TaskStats stats;
+
+        pqxx::result R = breaker::call([&]()
         {
-            CROW_LOG_ERROR << "Could not create task: " << e.what();
-            throw;
+            //always the primary: whatever we read here gets cached, and a lagging replica would leave stale counts in the cache
+            pool::Lease C = pool::acquire();
+            pqxx::work W(*C);
+            pqxx::result R = W.exec(pqxx::prepped{"get_task_stats"}, pqxx::params{userID});
+            W.commit();
+            return R;
+        });
+
+        if (!R.empty()) // no row means the user never had a task
+        {
+            stats.todo = R[0]["todo"].as<int>();
+            stats.inprogress = R[0]["inprogress"].as<int>();
+            stats.completed = R[0]["completed"].as<int>();
         }
-        return -1; //we return a failure
+
+        statsCache::store(userID, stats, generation);
+        return stats;
     }
 
-    bool updateTask(int tID, const std::optional<std::string> &description, std::optional<status> Estatus, int userID)
+    long long exportTasks(int userID, std::ostream& out, taskIO::Format format)
     {
-        try
+        //not retried, a second attempt would write the rows already sent to out again
+        return breaker::call([&]()
         {
-            pqxx::connection C(getConnection());
-            pqxx::work W(C);
+            pool::Lease C = pool::acquireRead(userID);
+            pqxx::work W(*C);
+
+            //COPY sends the rows as they are read, and the loop writes each one out before reading the next,
+            //so memory use is the same for ten tasks or ten million. In the user's own order, import appends rows
+            //in file order, so an export imported again keeps it.
+            auto stream = pqxx::stream_from::query(W, "SELECT id, description, status FROM tasks WHERE user_id = " + W.quote(userID) + " ORDER BY position, id");
+            taskIO::writeHeader(out, format);
+            long long rows = 0;
+            for (auto [id, description, Tstatus] : stream.iter<int, std::string_view, std::string_view>())
+            {
+                taskIO::writeRow(out, format, id, description, Tstatus);
+                rows++;
+            }
+            stream.complete();
+            W.commit();
+            return rows;
+        }, false);
+    }
 
-            std::string query = "UPDATE tasks SET";
-            bool first_field = true; //just used to determine which fields have changed.
+    long long importTasks(int userID, std::string_view body, taskIO::Format format)
+    {
+        return breaker::call([&]()
+        {
+            pool::Lease C = pool::acquire();
+            pqxx::work W(*C);
 
-            if (description)
+            //imported tasks go at the bottom in file order
+            lockPositions(W, userID);
+            std::optional<std::string> position = firstText(W.exec(pqxx::prepped{"last_position"}, pqxx::params{userID, 0}));
+
+            auto stream = pqxx::stream_to::table(W, {"tasks"}, {"description", "status", "user_id", "position"});
+            taskIO::Reader reader(body, format);
+            TaskStats added;
+            long long rows = 0;
+            while (std::optional<taskIO::ImportRow> row = reader.next())
             {
-                query += " description = " + W.quote(*description);
-                first_field = false;
+                //checked here so a bad row gives a useful message instead of a postgres error in the middle of the COPY
+                if (!validDescription(row->description))
+                {
+                    throw std::invalid_argument("line " + std::to_string(reader.line()) + ": description must be 1 to 256 characters");
+                }
+                status Estatus = status::Todo;
+                try
+                {
+                    Estatus = toStatus(row->Tstatus);
+                }
+                catch (const std::runtime_error& e)
+                {
+                    throw std::invalid_argument("line " + std::to_string(reader.line()) + ": " + e.what());
+                }
+
+                position = positionKey::between(position, std::nullopt);
+                stream.write_values(row->description, row->Tstatus, userID, *position);
+                rows++;
+                if (Estatus == status::Todo) added.todo++;
+                else if (Estatus == status::InProgress) added.inprogress++;
+                else added.completed++;
             }
-            if (Estatus)
+            stream.complete();
+            if (added.completed > 0)
             {
-                if (!first_field) query += ", ";
-                query += " status = " + W.quote(toString(Estatus.value()));
-                first_field = false;
+                //COPY can't fill this in, and it's only this user's partition
+                W.exec("UPDATE tasks SET completed_at = CURRENT_TIMESTAMP WHERE user_id = " + W.quote(userID) + " AND status = 'completed' AND completed_at IS NULL;");
             }
 
-            query += " WHERE id = " + W.quote(tID) + " AND user_id = " + W.quote(userID) + " RETURNING id;";
-            pqxx::result R = W.exec(query);
+            //one counter update per status for the whole import, not one per row
+            if (added.todo > 0) adjustTaskCount(W, userID, "todo", added.todo);
+            if (added.inprogress > 0) adjustTaskCount(W, userID, "inprogress", added.inprogress);
+            if (added.completed > 0) adjustTaskCount(W, userID, "completed", added.completed);
             W.commit();
-            return R.affected_rows() > 0;
+
+            if (rows > 0)
+            {
+                statsCache::invalidate(userID);
+                taskReads().forget(userID);
+                pool::noteWrite(userID);
+            }
+            logging::info(logging::Subsystem::Database, "Imported tasks", {{"user_id", userID}, {"rows", static_cast<long long>(rows)}});
+            return rows;
+        });
+    }
+
+    size_t archiveCompletedTasks()
+    {
+        std::shared_ptr<const config::Config> cfg = config::get();
+        if (cfg->archive_after_days <= 0)
+        {
+            return 0; // turned off
         }
-        catch (const std::exception& e)
+        //a long backlog (the first run after an upgrade) is worked off over several runs instead of in one go
+        constexpr int max_batches_per_run = 100;
+
+        size_t archived = 0;
+        for (int batch = 0; batch < max_batches_per_run; batch++)
         {
-            CROW_LOG_ERROR << "Could not update task: " << e.what();
+            long long moved = breaker::call([&]() -> long long
+            {
+                pool::Lease C = pool::acquire();
+                pqxx::work W(*C);
+                //with prefork every worker has this job, only one of them moves rows at a time
+                if (!W.query_value<bool>("SELECT pg_try_advisory_xact_lock(2, 0);"))
+                {
+                    return -1;
+                }
+                pqxx::result R = W.exec(pqxx::prepped{"archive_tasks"}, pqxx::params{cfg->archive_after_days, cfg->archive_batch_size});
+                W.commit();
+                long long count = 0;
+                for (const auto& row : R)
+                {
+                    count += row["moved"].as<long long>();
+                    //their counts changed under any cached stats
+                    statsCache::invalidate(row["user_id"].as<int>());
+                }
+                return count;
+            });
+            if (moved < 0)
+            {
+                break; // someone else is at it
+            }
+            archived += moved;
+            if (moved < cfg->archive_batch_size)
+            {
+                break; // nothing left that is old enough
+            }
         }
-        // need a return false here. Logic must be sound so that this is not always triggered
-        return false;
+
+        if (archived > 0)
+        {
+            logging::info(logging::Subsystem::Database, "Archived completed tasks", {{"count", static_cast<long long>(archived)}});
+        }
+        return archived;
     }
 
-    bool deleteTask(int tID, int userID)
+    ArchivePage getArchivedTasks(int userID, int limit, std::optional<int> cursor)
     {
-        try
+        return breaker::call([&]()
         {
-            pqxx::connection C(getConnection());
-            pqxx::work W(C);
-            C.prepare("delete_task", "DELETE FROM tasks WHERE id = $1 AND user_id = $2;");
+            ArchivePage page;
+            pool::Lease C = pool::acquireRead(userID);
+            pqxx::work W(*C);
+            //one row more than asked for tells us whether there is a next page
+            pqxx::result R = cursor
+                ? W.exec(pqxx::prepped{"archive_page_after"}, pqxx::params{userID, limit + 1, cursor.value()})
+                : W.exec(pqxx::prepped{"archive_page"}, pqxx::params{userID, limit + 1});
+            W.commit();
+
+            for (const auto& row : R)
+            {
+                if (static_cast<int>(page.tasks.size()) == limit)
+                {
+                    page.next_cursor = page.tasks.back().id;
+                    break;
+                }
+                page.tasks.push_back(ArchivedTask
+                    {
+                        row["id"].as<int>(),
+                        row["description"].as<std::string>(),
+                        row["status"].as<std::string>(),
+                        row["completed_at"].is_null() ? std::string() : row["completed_at"].as<std::string>()
+                    });
+            }
+            return page;
+        });
+    }
 
-            pqxx::result R = W.exec(pqxx::prepped{"delete_task"}, pqxx::params{tID, userID});
+    std::vector<Reminder> getUpcomingReminders(long long from_ms, int from_id, int limit)
+    {
+        return breaker::call([&]()
+        {
+            std::vector<Reminder> reminders;
+            //the primary: changes are announced from there, a lagging replica could miss one
+            pool::Lease C = pool::acquire();
+            pqxx::work W(*C);
+            for (const auto& row : W.exec(pqxx::prepped{"upcoming_reminders"}, pqxx::params{from_ms, from_id, limit}))
+            {
+                reminders.push_back(Reminder{row["id"].as<int>(), row["user_id"].as<int>(), row["due_ms"].as<long long>()});
+            }
             W.commit();
-            return R.affected_rows() > 0;
-        }
-        catch (const std::exception& e)
+            return reminders;
+        });
+    }
+
+    std::vector<DueTask> getDueTasks(const std::vector<int>& taskIDs)
+    {
+        return breaker::call([&]()
         {
-            CROW_LOG_ERROR << "Could not delete task: " << e.what();
-        }
-        //same idea applies here
-        return false;
+            std::vector<DueTask> tasks;
+            pool::Lease C = pool::acquire();
+            pqxx::work W(*C);
+            for (const auto& row : W.exec(pqxx::prepped{"due_tasks"}, pqxx::params{taskIDs}))
+            {
+                tasks.push_back(DueTask
+                    {
+                        row["user_id"].as<int>(),
+                        Task
+                        {
+                            row["id"].as<int>(),
+                            row["description"].as<std::string>(),
+                            row["status"].as<std::string>(),
+                            row["due_at"].as<std::optional<std::string>>()
+                        }
+                    });
+            }
+            W.commit();
+            return tasks;
+        });
     }
 
     std::optional<int> createUser(const std::string& username, const std::string& password_hash)
     {
-        try
-        { pqxx::connection C(getConnection());
-            pqxx::work W(C);
+        return breaker::call([&]() -> std::optional<int>
+        {
+            pool::Lease C = pool::acquire();
+            pqxx::work W(*C);
 
-            C.prepare("create_user", "INSERT INTO users (username, password_hash) VALUES ($1, $2) RETURNING id;");
             pqxx::result R = W.exec(pqxx::prepped{"create_user"}, pqxx::params{username, password_hash});
 
             W.commit();
-            CROW_LOG_INFO << "User '" << username << "' created successfully with ID: " << R[0]["id"].as<int>();
+            if (R.empty())
+            {
+                logging::info(logging::Subsystem::Database, "Could not create user, the username is taken", {{"username", username}});
+                return std::nullopt;
+            }
+            profileCache::invalidate(R[0]["id"].as<int>()); // in case something cached this id as missing
+            profileReads().forget(R[0]["id"].as<int>());
+            logging::info(logging::Subsystem::Database, "User created", {{"username", username}, {"user_id", R[0]["id"].as<int>()}});
 
 
             return R[0]["id"].as<int>();
-        }
-        catch (const pqxx::unique_violation& e)
-        {
-            CROW_LOG_ERROR << "Could not create user: " << e.what();
-            return std::nullopt;
-        }
-        return -1; // this user was not created
+        });
     }
 
 
-    std::optional<User> getUserID(int userID)
+    std::optional<Profile> getProfile(int userID)
     {
-        try
+        if (std::optional<std::optional<Profile>> cached = profileCache::lookup(userID))
         {
-            pqxx::connection C(getConnection());
-            pqxx::work W(C);
-            C.prepare("get_userID", "SELECT id, username, password_hash FROM users WHERE id = $1;");
-            pqxx::result R = W.exec(pqxx::prepped{"get_userID"}, pqxx::params{userID});
-            W.commit();
-
-            if (!R.empty())
-            {
-                const auto& row = R[0];
-                User user;
-                user.id = row["id"].as<int>();
-                user.username = row["username"].as<std::string>();
-                user.password_hash = row["password_hash"].as<std::string>();
-                return user;
-            }
+            return *cached;
         }
-        catch (const std::exception& e)
+
+        //a burst of /me calls for someone who isn't cached yet goes to the database once
+        return profileReads().run(userID, [&]()
         {
-            CROW_LOG_ERROR << "Could not get user: " << e.what();
-        }
-        return std::nullopt;
+            uint64_t generation = profileCache::beginLoad();
+            std::optional<Profile> profile = breaker::call([&]() -> std::optional<Profile>
+            {
+                try
+                {
+                    //the primary, for the same reason as getTaskStats: a replica that hasn't seen a new user yet
+                    //would get "no such user" cached
+                    pool::Lease C = pool::acquire();
+                    pqxx::work W(*C);
+                    pqxx::result R = W.exec(pqxx::prepped{"get_profile"}, pqxx::params{userID});
+                    W.commit();
+
+                    if (!R.empty())
+                    {
+                        const auto& row = R[0];
+                        return Profile{row["id"].as<int>(), row["username"].as<std::string>()};
+                    }
+                }
+                catch (const std::exception& e)
+                {
+                    logging::error(logging::Subsystem::Database, "Could not get user", {{"error", e.what()}});
+                    throw; // a missing user and a failed lookup are different things
+                }
+                return std::nullopt;
+            });
+
+            profileCache::store(userID, profile, generation);
+            return profile;
+        });
     }
 
     std::optional<User> getUsername(const std::string& username)
     {
-        try
+        auto find = [&username](pool::Lease& C) -> std::optional<User>
         {
-            pqxx::connection C(getConnection());
-            pqxx::work W(C);
-            C.prepare("get_username", "SELECT id, username, password_hash FROM users WHERE username = $1;");
+            pqxx::work W(*C);
             pqxx::result R = W.exec(pqxx::prepped{"get_username"}, pqxx::params{username});
             W.commit();
 
@@ -314,23 +993,68 @@ namespace database
                 user.id = row["id"].as<int>();
                 user.username = row["username"].as<std::string>();
                 user.password_hash = row["password_hash"].as<std::string>();
-                CROW_LOG_INFO << "User found in getUsername: " << user.username;
+                logging::info(logging::Subsystem::Database, "User found in getUsername", {{"username", user.username}});
                 return user;
             }
-        }
-        catch (const std::exception& e)
+            return std::nullopt;
+        };
+
+        return breaker::call([&]() -> std::optional<User>
         {
-            CROW_LOG_ERROR << "Could not get user: " << e.what();
-        }
-        return std::nullopt;
+            try
+            {
+                //we don't know the user id yet so there is nothing to pin on. A user who registered a moment ago
+                //may not be on the replica yet, so a miss there is checked again on the primary.
+                std::optional<User> user;
+                bool from_replica = false;
+                {
+                    pool::Lease C = pool::acquireRead(std::nullopt);
+                    from_replica = C.role() == pool::Role::Replica;
+                    user = find(C);
+                }
+                if (!user.has_value() && from_replica)
+                {
+                    pool::Lease C = pool::acquire(pool::Role::Primary);
+                    user = find(C);
+                }
+                return user;
+            }
+            catch (const std::exception& e)
+            {
+                logging::error(logging::Subsystem::Database, "Could not get user", {{"error", e.what()}});
+                throw;
+            }
+        });
     }
 
+    long long countUsers()
+    {
+        return breaker::call([&]()
+        {
+            pool::Lease C = pool::acquire();
+            pqxx::work W(*C);
+            long long count = W.query_value<long long>("SELECT count(*) FROM users;");
+            W.commit();
+            return count;
+        });
     }
 
+    void forEachUsername(const std::function<void(std::string_view)>& visit)
+    {
+        //streamed so a big users table never sits in memory as a pqxx::result
+        breaker::call([&]()
+        {
+            pool::Lease C = pool::acquire();
+            pqxx::work W(*C);
+            auto stream = pqxx::stream_from::query(W, "SELECT username FROM users");
+            for (auto [username] : stream.iter<std::string_view>())
+            {
+                visit(username);
+            }
+            stream.complete();
+            W.commit();
+            return true;
+        }, false);
+    }
 
-
-
-
-
-
-
+    }
\ No newline at end of file
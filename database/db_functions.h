@@ -3,27 +3,108 @@
 #include "crow.h"
 #include "task.hpp"
 #include "user.h"
+#include "task_io.h"
+#include "circuit_breaker.h" // database::unavailable, thrown by everything below
+#include <ostream>
+#include <string_view>
+#include <functional>
 
 struct Task
 {
     int id;
     std::string description;
     std::string Tstatus;
+    std::optional<std::string> due_at; // ISO 8601 in UTC
 };
 
+//per-user task counts, kept up to date by the write functions so they never need a COUNT(*)
+struct TaskStats
+{
+    int todo = 0;
+    int inprogress = 0;
+    int completed = 0;
+};
+
+//where a task is dragged to: right after (or before) another of the user's tasks. Without an anchor,
+//after means the very top and before the very bottom.
+struct TaskMove
+{
+    bool after;
+    std::optional<int> anchorID;
+};
+
+//one reminder as the scheduler keeps it, see reminders.h
+struct Reminder
+{
+    int taskID;
+    int userID;
+    long long due_ms; // since 1970, UTC
+};
+
+//a task whose reminder just fired, with the owner so it can be delivered
+struct DueTask
+{
+    int userID;
+    Task task;
+};
+
+//a task that archiveCompletedTasks moved out of the tasks table. completed_at is ISO 8601 in UTC.
+struct ArchivedTask
+{
+    int id;
+    std::string description;
+    std::string Tstatus;
+    std::string completed_at;
+};
+
+//one page of the archive, newest first. next_cursor is passed back to get the page after it.
+struct ArchivePage
+{
+    std::vector<ArchivedTask> tasks;
+    std::optional<int> next_cursor;
+};
+
+
 
 namespace database
 {
     std::string getConnection();
     void ensure_db();
+    //runs on every new pooled connection
+    void prepareStatements(pqxx::connection& C);
     std::vector<Task> getTasks(std::optional<int> userID = std::nullopt);
     std::optional<Task> getTask(int tID, std::optional<int> userID = std::nullopt);
-    int createTask(const std::string& description, const std::string& Tstatus, int userID);
-    bool updateTask(int tID, const std::optional<std::string> &description, std::optional<status> Estatus, int userID);
+    //due times are ms since 1970. For updates an empty outer optional leaves the due time alone and an
+    //empty inner one clears it.
+    int createTask(std::string_view description, const std::string& Tstatus, int userID, std::optional<long long> due_ms = std::nullopt);
+    bool updateTask(int tID, std::optional<std::string_view> description, std::optional<status> Estatus, int userID,
+                    std::optional<std::optional<long long>> due_ms = std::nullopt);
     bool deleteTask(int tID, int userID);
+    //rewrites only the moved task's position. False if the task or the anchor isn't the user's.
+    bool moveTask(int tID, int userID, const TaskMove& move);
+    TaskStats getTaskStats(int userID);
+    //streams every task of the user straight from postgres into out. Returns how many rows were written.
+    long long exportTasks(int userID, std::ostream& out, taskIO::Format format);
+    //streams the rows in body into postgres with COPY. All or nothing: a bad row throws std::invalid_argument
+    //(saying which line) and nothing is imported. Returns how many tasks were added.
+    long long importTasks(int userID, std::string_view body, taskIO::Format format);
+    //moves tasks completed more than archive_after_days ago to tasks_archive, in batches. Run by a background timer
+    //in every worker, but only one at a time does anything. Returns how many tasks were moved.
+    size_t archiveCompletedTasks();
+    ArchivePage getArchivedTasks(int userID, int limit, std::optional<int> cursor);
+    //for the reminder scheduler: the next limit open tasks from (from_ms, from_id) on, in (due time, id) order
+    std::vector<Reminder> getUpcomingReminders(long long from_ms, int from_id, int limit);
+    //the tasks out of taskIDs that are still open and still have a due time (a reminder may fire just as it's cancelled)
+    std::vector<DueTask> getDueTasks(const std::vector<int>& taskIDs);
 
 
+    //nullopt means the username is taken. It's one INSERT that leans on the UNIQUE constraint, so two
+    //people registering the same name at once can't both get it.
     std::optional<int> createUser(const std::string& username, const std::string& password_hash);
     std::optional<User> getUsername(const std::string& username);
-    std::optional<User> getUserID(int userID);
+    //served from profileCache when possible, see profile_cache.h
+    std::optional<Profile> getProfile(int userID);
+    //used once at startup to fill the username filter. Both read the primary.
+    long long countUsers();
+    void forEachUsername(const std::function<void(std::string_view)>& visit);
 }
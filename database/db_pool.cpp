@@ -0,0 +1,287 @@
+#include "db_pool.h"
+#include "config.h"
+#include "logger.h"
+#include "deadline.h"
+#include "metrics.h"
+#include "circuit_breaker.h"
+#include "crow.h"
+#include <vector>
+#include <array>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <stdexcept>
+#include <algorithm>
+#include <limits>
+#include <atomic>
+#include <cstring>
+#include <new>
+#ifndef _WIN32
+#include <cerrno>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace database::pool
+{
+    //everything one pool needs. There is one of these for the primary and one for the replica.
+    struct State
+    {
+        bool configured = false;
+        std::string connection_string;
+        size_t max_size = 1;
+        std::function<void(pqxx::connection&)> on_connect;
+
+        std::vector<std::unique_ptr<Pooled>> idle; // connections nobody is using right now
+        size_t open_count = 0; // idle + leased
+        std::mutex mutex;
+        std::condition_variable cv;
+    };
+
+    static std::array<State, 2> pools;
+
+    static State& stateFor(Role role)
+    {
+        return pools[static_cast<size_t>(role)];
+    }
+
+    //when each user last wrote (steady clock ms), in memory every worker shares, so a read that lands on
+    //another worker than the write is pinned too. Users are hashed onto a fixed number of slots; two users
+    //sharing one only sends a few more reads to the primary, never one to the replica that shouldn't go there.
+    static constexpr size_t write_slots = 65536;
+    static std::atomic<int64_t>* last_writes = nullptr;
+    static_assert(std::atomic<int64_t>::is_always_lock_free, "the write table needs lock-free 64 bit atomics");
+
+    static std::atomic<int64_t>& lastWrite(int userID)
+    {
+        //fibonacci hashing spreads the sequential user ids out, the top 16 bits pick one of the 65536 slots
+        static_assert(write_slots == 65536);
+        uint32_t hash = static_cast<uint32_t>(userID) * 2654435769u;
+        return last_writes[hash >> 16];
+    }
+
+    static int64_t nowMs()
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    void createWriteTable()
+    {
+        size_t bytes = write_slots * sizeof(std::atomic<int64_t>);
+#ifdef _WIN32
+        void* memory = ::operator new(bytes); // no fork on windows, so there is only ever one process
+#else
+        //mapped the same way as the session table, before any worker is forked
+        std::string name = "/todo-writes-" + std::to_string(getpid());
+        int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fd < 0)
+        {
+            throw std::runtime_error("shm_open failed for the write table: " + std::string(std::strerror(errno)));
+        }
+        shm_unlink(name.c_str());
+        if (ftruncate(fd, static_cast<off_t>(bytes)) != 0)
+        {
+            int error = errno;
+            close(fd);
+            throw std::runtime_error("Could not size the write table: " + std::string(std::strerror(error)));
+        }
+        void* memory = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (memory == MAP_FAILED)
+        {
+            throw std::runtime_error("mmap failed for the write table: " + std::string(std::strerror(errno)));
+        }
+#endif
+        last_writes = static_cast<std::atomic<int64_t>*>(memory);
+        for (size_t i = 0; i < write_slots; i++)
+        {
+            new (&last_writes[i]) std::atomic<int64_t>(std::numeric_limits<int64_t>::min() / 2); // long ago
+        }
+    }
+
+    void init(Role role, const std::string& connectionString, size_t size, std::function<void(pqxx::connection&)> onConnect)
+    {
+        State& state = stateFor(role);
+        std::lock_guard<std::mutex> lock(state.mutex);
+        state.configured = true;
+        state.connection_string = connectionString;
+        state.max_size = size;
+        state.on_connect = std::move(onConnect);
+        logging::info(logging::Subsystem::Database, "Database pool ready", {{"role", role == Role::Primary ? "primary" : "replica"}, {"connections", static_cast<long long>(size)}});
+    }
+
+    bool hasReplica()
+    {
+        State& state = stateFor(Role::Replica);
+        std::lock_guard<std::mutex> lock(state.mutex);
+        return state.configured;
+    }
+
+    Lease::Lease(std::unique_ptr<Pooled> pooled) : pooled(std::move(pooled))
+    {
+    }
+
+    Lease::~Lease()
+    {
+        if (!pooled) // moved from
+        {
+            return;
+        }
+
+        State& state = stateFor(pooled->role);
+        std::lock_guard<std::mutex> lock(state.mutex);
+        if (pooled->connection->is_open())
+        {
+            state.idle.push_back(std::move(pooled));
+        }
+        else
+        {
+            //a broken connection is dropped, the next acquire will open a fresh one
+            state.open_count--;
+        }
+        state.cv.notify_one();
+    }
+
+    Lease acquire(Role role)
+    {
+        std::shared_ptr<const config::Config> cfg = config::get();
+        State& state = stateFor(role);
+        std::unique_ptr<Pooled> pooled;
+
+        //a request with a deadline never waits past it, neither for a connection nor for a query
+        long long wait_ms = cfg->db_acquire_timeout_ms;
+        int statement_timeout_ms = cfg->statement_timeout_ms;
+        if (std::optional<long long> remaining = deadline::remainingMs())
+        {
+            if (*remaining <= 0)
+            {
+                throw database::unavailable("Request deadline passed before reaching the database");
+            }
+            wait_ms = std::min(wait_ms, *remaining);
+            if (statement_timeout_ms == 0 || *remaining < statement_timeout_ms) // 0 means postgres has no timeout
+            {
+                //rounded down to 250ms steps so back to back requests usually find the connection already set
+                //to the right value and we skip the extra SET round trip
+                statement_timeout_ms = static_cast<int>(*remaining >= 250 ? (*remaining / 250) * 250 : *remaining);
+            }
+        }
+
+        {
+            std::unique_lock<std::mutex> lock(state.mutex);
+            if (!state.configured)
+            {
+                throw std::runtime_error("Database pool used before it was initialised");
+            }
+            bool available = state.cv.wait_for(lock, std::chrono::milliseconds(wait_ms), [&state]()
+            {
+                return !state.idle.empty() || state.open_count < state.max_size;
+            });
+            if (!available)
+            {
+                throw database::unavailable("Timed out waiting for a database connection");
+            }
+
+            if (!state.idle.empty())
+            {
+                pooled = std::move(state.idle.back());
+                state.idle.pop_back();
+            }
+            else
+            {
+                state.open_count++; // reserve the slot now, the connect itself happens without the lock held
+            }
+        }
+
+        if (!pooled)
+        {
+            try
+            {
+                pooled = std::make_unique<Pooled>();
+                pooled->role = role;
+                pooled->connection = std::make_unique<pqxx::connection>(state.connection_string);
+                state.on_connect(*pooled->connection);
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock(state.mutex);
+                state.open_count--;
+                state.cv.notify_one();
+                throw;
+            }
+        }
+
+        //the timeout changes with config reloads and request deadlines. We only pay for the SET when it actually changed.
+        if (pooled->statement_timeout_ms != statement_timeout_ms)
+        {
+            Lease lease(std::move(pooled)); // gives the connection back if the SET throws
+            {
+                pqxx::nontransaction N(*lease);
+                N.exec("SET statement_timeout = " + std::to_string(statement_timeout_ms));
+            }
+            lease.pooled->statement_timeout_ms = statement_timeout_ms;
+            return lease;
+        }
+        return Lease(std::move(pooled));
+    }
+
+    static bool recentlyWrote(int userID)
+    {
+        return nowMs() - lastWrite(userID).load(std::memory_order_acquire) < config::get()->read_your_writes_ms;
+    }
+
+    Lease acquireRead(std::optional<int> userID)
+    {
+        static auto& primary_reads = metrics::counter("todo_db_reads_primary_total");
+        static auto& replica_reads = metrics::counter("todo_db_reads_replica_total");
+        static auto& replica_failures = metrics::counter("todo_db_replica_fallbacks_total");
+
+        if (!hasReplica() || (userID.has_value() && recentlyWrote(userID.value())))
+        {
+            primary_reads.fetch_add(1, std::memory_order_relaxed);
+            return acquire(Role::Primary);
+        }
+
+        try
+        {
+            Lease lease = acquire(Role::Replica);
+            replica_reads.fetch_add(1, std::memory_order_relaxed);
+            return lease;
+        }
+        catch (const pqxx::broken_connection& e)
+        {
+            //the replica being down shouldn't take reads down with it
+            logging::warning(logging::Subsystem::Database, "Replica unavailable, reading from the primary", {{"error", e.what()}});
+            replica_failures.fetch_add(1, std::memory_order_relaxed);
+            primary_reads.fetch_add(1, std::memory_order_relaxed);
+            return acquire(Role::Primary);
+        }
+        catch (const database::unavailable& e)
+        {
+            //every replica connection busy (or the replica too slow to hand one out) says nothing about the primary.
+            //If the request's deadline is what ran out, the primary acquire below throws the same again.
+            logging::warning(logging::Subsystem::Database, "Replica pool exhausted, reading from the primary", {{"error", e.what()}});
+            replica_failures.fetch_add(1, std::memory_order_relaxed);
+            primary_reads.fetch_add(1, std::memory_order_relaxed);
+            return acquire(Role::Primary);
+        }
+    }
+
+    void noteWrite(int userID)
+    {
+        if (!hasReplica())
+        {
+            return; // nothing to pin to
+        }
+
+        //only ever moved forward, a slower worker finishing an older write mustn't shorten the pin
+        std::atomic<int64_t>& slot = lastWrite(userID);
+        int64_t now = nowMs();
+        int64_t seen = slot.load(std::memory_order_relaxed);
+        while (seen < now && !slot.compare_exchange_weak(seen, now, std::memory_order_release, std::memory_order_relaxed))
+        {
+            //seen now holds what another worker stored, try again if ours is still newer
+        }
+    }
+}
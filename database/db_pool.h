@@ -0,0 +1,68 @@
+#pragma once
+#include <pqxx/pqxx>
+#include <memory>
+#include <functional>
+#include <optional>
+#include <string>
+
+
+namespace database::pool
+{
+    //which server a connection goes to. Writes always use the primary.
+    enum class Role
+    {
+        Primary,
+        Replica
+    };
+
+    //a connection we keep open between requests
+    struct Pooled
+    {
+        std::unique_ptr<pqxx::connection> connection;
+        Role role = Role::Primary; // the pool it goes back to
+        int statement_timeout_ms = -1; // what we last set on this connection, -1 means never set
+    };
+
+    //hands out a connection and gives it back to the pool when it goes out of scope.
+    //if the connection broke while we had it, it gets thrown away instead.
+    class Lease
+    {
+    public:
+        explicit Lease(std::unique_ptr<Pooled> pooled);
+        Lease(Lease&& other) noexcept = default;
+        Lease& operator=(Lease&& other) noexcept = default;
+        Lease(const Lease&) = delete;
+        Lease& operator=(const Lease&) = delete;
+        ~Lease();
+
+        pqxx::connection& operator*() { return *pooled->connection; }
+        pqxx::connection* operator->() { return pooled->connection.get(); }
+        Role role() const { return pooled->role; }
+
+    private:
+        friend Lease acquire(Role role);
+        std::unique_ptr<Pooled> pooled;
+    };
+
+    //size is the most connections we will ever have open. onConnect runs once on every new connection
+    //(that's where the prepared statements are created). The replica pool is optional, without it
+    //every read goes to the primary.
+    void init(Role role, const std::string& connectionString, size_t size, std::function<void(pqxx::connection&)> onConnect);
+    bool hasReplica();
+
+    //waits up to db_acquire_timeout_ms (or until the request deadline, whichever is first) for a free connection,
+    //then throws std::runtime_error. Also sets statement_timeout so no query runs past the deadline.
+    Lease acquire(Role role = Role::Primary);
+
+    //a connection for a read. Goes to the replica unless this user wrote something in the last
+    //read_your_writes_ms, so a user always sees their own changes even if the replica lags behind.
+    //falls back to the primary if the replica can't be reached.
+    Lease acquireRead(std::optional<int> userID);
+
+    //maps the table noteWrite and acquireRead share between workers. Call it once, before forking workers.
+    //Throws if the memory can't be had.
+    void createWriteTable();
+
+    //call after a write for this user commits
+    void noteWrite(int userID);
+}
@@ -0,0 +1,96 @@
+#include "profile_cache.h"
+#include "config.h"
+#include <algorithm>
+
+namespace profileCache
+{
+    std::unordered_map<int, Entry> entries;
+    std::mutex entries_mutex;
+
+    static uint64_t write_clock = 0;
+    //the newest write stamp we have thrown away. A user without an entry may have been written up to this point.
+    static uint64_t evicted_last_write = 0;
+
+    //keeps the map inside the profile_cache_entries budget. Caller holds the lock.
+    static void evict(size_t budget)
+    {
+        while (entries.size() > budget && !entries.empty())
+        {
+            auto victim = entries.begin();
+            evicted_last_write = std::max(evicted_last_write, victim->second.last_write);
+            entries.erase(victim);
+        }
+    }
+
+    std::optional<std::optional<Profile>> lookup(int userID)
+    {
+        std::lock_guard<std::mutex> lock(entries_mutex);
+        auto it = entries.find(userID);
+        if (it == entries.end() || !it->second.loaded)
+        {
+            return std::nullopt;
+        }
+        if (!it->second.profile.has_value() && std::chrono::steady_clock::now() >= it->second.expires)
+        {
+            it->second.loaded = false; // the negative entry ran out, look again
+            return std::nullopt;
+        }
+        return it->second.profile;
+    }
+
+    uint64_t beginLoad()
+    {
+        std::lock_guard<std::mutex> lock(entries_mutex);
+        return write_clock;
+    }
+
+    void store(int userID, const std::optional<Profile>& profile, uint64_t generation)
+    {
+        std::shared_ptr<const config::Config> cfg = config::get();
+        if (!profile.has_value() && cfg->profile_negative_ttl_ms == 0)
+        {
+            return; // negative caching is switched off
+        }
+
+        std::lock_guard<std::mutex> lock(entries_mutex);
+        auto it = entries.find(userID);
+        uint64_t last_write = it != entries.end() ? it->second.last_write : evicted_last_write;
+        //the user was created or deleted while we were reading, what we have may already be wrong
+        if (last_write > generation)
+        {
+            return;
+        }
+
+        if (it == entries.end())
+        {
+            it = entries.emplace(userID, Entry{std::nullopt, {}, last_write, false}).first;
+        }
+        it->second.profile = profile;
+        it->second.expires = std::chrono::steady_clock::now() + std::chrono::milliseconds(cfg->profile_negative_ttl_ms);
+        it->second.loaded = true;
+        evict(cfg->profile_cache_entries);
+    }
+
+    void invalidate(int userID)
+    {
+        std::lock_guard<std::mutex> lock(entries_mutex);
+        auto it = entries.find(userID);
+        if (it == entries.end())
+        {
+            //nothing cached, but a reader might be in flight. Remember the write without adding an entry.
+            evicted_last_write = ++write_clock;
+            return;
+        }
+        it->second.last_write = ++write_clock;
+        it->second.profile.reset();
+        it->second.loaded = false;
+    }
+
+    void clear()
+    {
+        std::lock_guard<std::mutex> lock(entries_mutex);
+        entries.clear();
+        //a reader in flight may have read the user before the change we missed, don't let it store that
+        evicted_last_write = ++write_clock;
+    }
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include <optional>
+#include <unordered_map>
+#include <mutex>
+#include <chrono>
+#include <cstdint>
+#include "user.h"
+
+
+//the frontend calls /me on every page load, so the public part of each user (never the password hash) is kept here.
+//a user that doesn't exist is cached too (profile is empty) for profile_negative_ttl_ms, so a session
+//pointing at a deleted user doesn't hit the database on every request either.
+//works like statsCache: invalidate() ticks a clock, and store() refuses a result read before the last invalidate.
+namespace profileCache
+{
+    struct Entry
+    {
+        std::optional<Profile> profile;          // empty means "no such user"
+        std::chrono::steady_clock::time_point expires; // only used for the empty ones
+        uint64_t last_write = 0;
+        bool loaded = false;                     // false: only here to remember last_write
+    };
+
+    extern std::unordered_map<int, Entry> entries;
+    extern std::mutex entries_mutex;
+
+    //the outer optional is a cache miss, the inner one is the cached answer (empty if the user doesn't exist)
+    std::optional<std::optional<Profile>> lookup(int userID);
+    //call this before reading the user from the db, and hand the result to store()
+    uint64_t beginLoad();
+    void store(int userID, const std::optional<Profile>& profile, uint64_t generation);
+    //anything that creates, renames or deletes a user calls this after its transaction commits
+    void invalidate(int userID);
+    //forgets everyone, for when changes may have been missed (the user_changed listener reconnected)
+    void clear();
+}
@@ -0,0 +1,82 @@
+#include "stats_cache.h"
+#include "config.h"
+#include <algorithm>
+
+namespace statsCache
+{
+    std::unordered_map<int, Entry> entries;
+    std::mutex entries_mutex;
+
+    static uint64_t write_clock = 0;
+    //the newest write stamp we have thrown away. A user without an entry may have been written up to this point.
+    static uint64_t evicted_last_write = 0;
+
+    //keeps the map inside the stats_cache_entries budget. Caller holds the lock.
+    static void evict()
+    {
+        size_t budget = config::get()->stats_cache_entries;
+        while (entries.size() > budget && !entries.empty())
+        {
+            //which entry goes doesn't matter much, every one of them is a single cheap query to get back
+            auto victim = entries.begin();
+            evicted_last_write = std::max(evicted_last_write, victim->second.last_write);
+            entries.erase(victim);
+        }
+    }
+
+    std::optional<TaskStats> lookup(int userID)
+    {
+        std::lock_guard<std::mutex> lock(entries_mutex);
+        auto it = entries.find(userID);
+        if (it != entries.end())
+        {
+            return it->second.stats;
+        }
+        return std::nullopt;
+    }
+
+    uint64_t beginLoad(int userID)
+    {
+        std::lock_guard<std::mutex> lock(entries_mutex);
+        return write_clock;
+    }
+
+    void store(int userID, const TaskStats& stats, uint64_t generation)
+    {
+        //with prefork workers a write in one process can't invalidate the copy in another,
+        //so nothing is cached and every lookup misses (the query behind it is a primary key lookup anyway)
+        if (config::get()->workers > 1)
+        {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(entries_mutex);
+        auto it = entries.find(userID);
+        uint64_t last_write = it != entries.end() ? it->second.last_write : evicted_last_write;
+        //if a write happened while we were reading, what we read may already be out of date
+        if (last_write > generation)
+        {
+            return;
+        }
+
+        if (it == entries.end())
+        {
+            it = entries.emplace(userID, Entry{std::nullopt, last_write}).first;
+        }
+        it->second.stats = stats;
+        evict();
+    }
+
+    void invalidate(int userID)
+    {
+        std::lock_guard<std::mutex> lock(entries_mutex);
+        auto it = entries.find(userID);
+        if (it == entries.end())
+        {
+            //nothing cached, but a reader might be in flight. Remember the write without adding an entry.
+            evicted_last_write = ++write_clock;
+            return;
+        }
+        it->second.last_write = ++write_clock;
+        it->second.stats.reset();
+    }
+}
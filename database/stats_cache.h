@@ -0,0 +1,29 @@
+#pragma once
+#include <optional>
+#include <unordered_map>
+#include <mutex>
+#include <cstdint>
+#include "db_functions.h"
+
+
+namespace statsCache
+{
+    //every write ticks a global clock and stamps the user's entry with it.
+    //a reader remembers the clock before going to the db, and store() refuses the result if the user was written since,
+    //so a reader that started before a write can't store stale counts.
+    struct Entry
+    {
+        std::optional<TaskStats> stats;
+        uint64_t last_write = 0;
+    };
+
+    extern std::unordered_map<int, Entry> entries;
+    extern std::mutex entries_mutex;
+
+    std::optional<TaskStats> lookup(int userID);
+    //call this before reading the counters from the db, and hand the result to store()
+    uint64_t beginLoad(int userID);
+    void store(int userID, const TaskStats& stats, uint64_t generation);
+    //called after a write transaction commits
+    void invalidate(int userID);
+}
@@ -1,12 +1,93 @@
 #include <sodium/core.h>
+#include <cstdlib>
 #include "crow/middlewares/cookie_parser.h"
 #include "auth_routes.h"
 #include "crow_routes.h"
+#include "ops_routes.h"
 #include "db_functions.h"
+#include "db_pool.h"
+#include "AuthHandle.h"
+#include "session_table.h"
+#include "idempotency.h"
+#include "username_filter.h"
+#include "prefork.h"
+#include "background.h"
+#include "reminders.h"
+#include "config.h"
+#include "logger.h"
 
 
+//one server: everything that starts threads or holds connections. With workers > 1 every worker process runs this.
+static int serve()
+{
+    //this has to happen before any thread exists, see watchReload
+    config::watchReload();
+    //from here on logging (including CROW_LOG_*) is buffered and written by a background thread
+    logging::start();
+
+    std::shared_ptr<const config::Config> cfg = config::get();
+    AuthHandle::initHashing(cfg->hashing_pool_size);
+
+    crow::App<crow::CookieParser> app;
+    database::pool::init(database::pool::Role::Primary, cfg->connection_string, cfg->db_pool_size, database::prepareStatements);
+    if (!cfg->replica_connection_string.empty())
+    {
+        database::pool::init(database::pool::Role::Replica, cfg->replica_connection_string, cfg->db_replica_pool_size, database::prepareStatements);
+    }
+    usernameFilter::load();
+    background::every("archive", std::chrono::seconds(cfg->archive_interval_seconds), []()
+    {
+        database::archiveCompletedTasks();
+    });
+    reminders::start(cfg->reminder_max_pending);
+
+    taskRoutes(app);
+    authRoutes(app);
+    opsRoutes(app);
+
+    app.port(cfg->port);
+    if (cfg->worker_threads > 0)
+    {
+        app.concurrency(cfg->worker_threads);
+    }
+    else
+    {
+        app.multithreaded();
+    }
+    app.run();
+
+    logging::stop();
+    return 0;
+}
+
 int main()
 {
+    //TODO_CONFIG can point somewhere else, by default we look next to the frontend folder like the html does
+    const char* config_path = std::getenv("TODO_CONFIG");
+    try
+    {
+        config::load(config_path != nullptr ? config_path : "../todo.conf");
+    }
+    catch (const std::exception& e)
+    {
+        CROW_LOG_CRITICAL << e.what();
+        return 1;
+    }
+    std::shared_ptr<const config::Config> cfg = config::get();
+
+    if (!logging::setLevels(cfg->log_levels))
+    {
+        CROW_LOG_CRITICAL << "Invalid log_levels: " << cfg->log_levels;
+        return 1;
+    }
+    config::onReload([](const config::Config& c)
+    {
+        if (!logging::setLevels(c.log_levels))
+        {
+            CROW_LOG_ERROR << "Invalid log_levels on reload, keeping the old levels: " << c.log_levels;
+        }
+    });
+
     if (sodium_init() == -1)
     {
         CROW_LOG_CRITICAL << "sodium_init failed";
@@ -14,15 +95,24 @@ int main()
     }
     CROW_LOG_INFO << "sodium loaded correctly";
 
-    crow::App<crow::CookieParser> app;
+    //everything below is done once, before any worker is forked: the shared session, idempotency and write tables have to be mapped here
+    //for the workers to share it, and the schema should only be created by one process
+    try
+    {
+        sessionTable::create(cfg->session_table_slots);
+        idempotency::create(cfg->idempotency_max_entries);
+        database::pool::createWriteTable();
+    }
+    catch (const std::exception& e)
+    {
+        CROW_LOG_CRITICAL << e.what();
+        return 1;
+    }
     database::ensure_db();
 
-    taskRoutes(app);
-    authRoutes(app);
-
-    app.port(18080)
-        .multithreaded()
-        .run();
-
-    return 0;
+    if (cfg->workers > 1)
+    {
+        return prefork::run(cfg->workers, serve);
+    }
+    return serve();
 }
@@ -1,5 +1,7 @@
 #include "task.hpp"
 #include <stdexcept>
+#include <cctype>
+#include <cstdio>
 
 std::string toString(status eStat) // enum status
 {
@@ -16,9 +18,8 @@ std::string toString(status eStat) // enum status
     }
 }
 
-status toStatus(const std::string &sStatus) // string status
+std::optional<status> parseStatus(std::string_view sStatus)
 {
-    // if-else block for comparisons
     if (sStatus == "todo")
     {
         return status::Todo;
@@ -31,8 +32,171 @@ status toStatus(const std::string &sStatus) // string status
     {
         return status::Completed;
     }
-    else
+    return std::nullopt;
+}
+
+status toStatus(const std::string &sStatus) // string status
+{
+    std::optional<status> Estatus = parseStatus(sStatus);
+    if (!Estatus)
     {
         throw std::runtime_error("Invalid status string: " + sStatus);
     }
+    return *Estatus;
+}
+
+//days since 1970-01-01 in the proleptic gregorian calendar (Howard Hinnant's days_from_civil)
+static long long daysFromCivil(long long y, unsigned m, unsigned d)
+{
+    y -= m <= 2;
+    long long era = (y >= 0 ? y : y - 399) / 400;
+    unsigned yoe = static_cast<unsigned>(y - era * 400);
+    unsigned doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+    unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + static_cast<long long>(doe) - 719468;
+}
+
+std::optional<long long> parseDueTime(std::string_view sTime)
+{
+    size_t pos = 0;
+    //reads exactly n digits
+    auto digits = [&](size_t n) -> std::optional<int>
+    {
+        if (pos + n > sTime.size())
+        {
+            return std::nullopt;
+        }
+        int value = 0;
+        for (size_t i = 0; i < n; i++)
+        {
+            char c = sTime[pos + i];
+            if (!std::isdigit(static_cast<unsigned char>(c)))
+            {
+                return std::nullopt;
+            }
+            value = value * 10 + (c - '0');
+        }
+        pos += n;
+        return value;
+    };
+    auto expect = [&](char c)
+    {
+        if (pos < sTime.size() && sTime[pos] == c)
+        {
+            pos++;
+            return true;
+        }
+        return false;
+    };
+
+    std::optional<int> year = digits(4);
+    if (!year || !expect('-')) return std::nullopt;
+    std::optional<int> month = digits(2);
+    if (!month || !expect('-')) return std::nullopt;
+    std::optional<int> day = digits(2);
+    if (!day || !(expect('T') || expect('t') || expect(' '))) return std::nullopt;
+    std::optional<int> hour = digits(2);
+    if (!hour || !expect(':')) return std::nullopt;
+    std::optional<int> minute = digits(2);
+    if (!minute) return std::nullopt;
+    int second = 0;
+    int millis = 0;
+    if (expect(':'))
+    {
+        std::optional<int> s = digits(2);
+        if (!s) return std::nullopt;
+        second = *s;
+        if (expect('.'))
+        {
+            //anything past milliseconds is dropped
+            size_t start = pos;
+            while (pos < sTime.size() && std::isdigit(static_cast<unsigned char>(sTime[pos])))
+            {
+                if (pos - start < 3)
+                {
+                    millis = millis * 10 + (sTime[pos] - '0');
+                }
+                pos++;
+            }
+            if (pos == start) return std::nullopt;
+            for (size_t n = pos - start; n < 3; n++)
+            {
+                millis *= 10;
+            }
+        }
+    }
+
+    //the zone is required, a time without one would mean whatever the server's clock is set to
+    int offset_minutes = 0;
+    if (!(expect('Z') || expect('z')))
+    {
+        int sign = expect('+') ? 1 : expect('-') ? -1 : 0;
+        if (sign == 0) return std::nullopt;
+        std::optional<int> zone_hours = digits(2);
+        if (!zone_hours) return std::nullopt;
+        expect(':');
+        std::optional<int> zone_minutes = digits(2);
+        if (!zone_minutes || *zone_hours > 23 || *zone_minutes > 59) return std::nullopt;
+        offset_minutes = sign * (*zone_hours * 60 + *zone_minutes);
+    }
+    if (pos != sTime.size()) return std::nullopt;
+
+    static constexpr int days_in_month[] = {31, 29, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+    bool leap = (*year % 4 == 0 && *year % 100 != 0) || *year % 400 == 0;
+    if (*month < 1 || *month > 12 || *day < 1 || *day > days_in_month[*month - 1] ||
+        (*month == 2 && *day == 29 && !leap) || *hour > 23 || *minute > 59 || second > 59)
+    {
+        return std::nullopt;
+    }
+
+    long long seconds = daysFromCivil(*year, *month, *day) * 86400 + *hour * 3600 + *minute * 60 + second - offset_minutes * 60;
+    return seconds * 1000 + millis;
+}
+
+//the inverse of daysFromCivil (Howard Hinnant's civil_from_days)
+static void civilFromDays(long long z, long long& y, unsigned& m, unsigned& d)
+{
+    z += 719468;
+    long long era = (z >= 0 ? z : z - 146096) / 146097;
+    unsigned doe = static_cast<unsigned>(z - era * 146097);
+    unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    unsigned mp = (5 * doy + 2) / 153;
+    d = doy - (153 * mp + 2) / 5 + 1;
+    m = mp < 10 ? mp + 3 : mp - 9;
+    y = static_cast<long long>(yoe) + era * 400 + (m <= 2);
+}
+
+std::string formatDueTime(long long ms)
+{
+    long long seconds = ms >= 0 ? ms / 1000 : (ms - 999) / 1000; // rounded down, also before 1970
+    long long days = seconds >= 0 ? seconds / 86400 : (seconds - 86399) / 86400;
+    unsigned of_day = static_cast<unsigned>(seconds - days * 86400);
+    long long y;
+    unsigned m, d;
+    civilFromDays(days, y, m, d);
+
+    char text[64];
+    std::snprintf(text, sizeof(text), "%04lld-%02u-%02uT%02u:%02u:%02uZ", y, m, d, of_day / 3600, of_day / 60 % 60, of_day % 60);
+    return text;
+}
+
+size_t utf8Length(std::string_view text)
+{
+    //continuation bytes in utf-8 look like 10xxxxxx, everything else starts a character
+    size_t length = 0;
+    for (unsigned char c : text)
+    {
+        if ((c & 0xC0) != 0x80)
+        {
+            length++;
+        }
+    }
+    return length;
+}
+
+bool validDescription(std::string_view description)
+{
+    size_t length = utf8Length(description);
+    return length >= 1 && length <= 256;
 }
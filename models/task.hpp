@@ -1,5 +1,7 @@
 #pragma once
 #include <string>
+#include <optional>
+#include <string_view>
 
 enum class status
 {
@@ -10,4 +12,17 @@ enum class status
 
 std::string toString(status eStat); //a enumerated stat
 
-status toStatus(const std::string &sStat); //a string stat
\ No newline at end of file
+status toStatus(const std::string &sStat); //a string stat
+//the same mapping without throwing, nullopt for anything but todo, inprogress and completed
+std::optional<status> parseStatus(std::string_view sStat);
+
+//reads an ISO 8601 time with a zone, like 2025-03-01T09:00:00Z or 2025-03-01T10:00:00.250+01:00
+//(seconds are optional). Returns milliseconds since 1970 in UTC, or nullopt if the text isn't one of those.
+std::optional<long long> parseDueTime(std::string_view sTime);
+//the other way round, in the same form the database hands out (2025-03-01T09:00:00Z)
+std::string formatDueTime(long long ms);
+
+//characters in utf-8 text, which is what VARCHAR(n) limits (not bytes)
+size_t utf8Length(std::string_view text);
+//1 to 256 characters, what the description column takes
+bool validDescription(std::string_view description);
@@ -0,0 +1,74 @@
+#include "admission.h"
+#include "deadline.h"
+#include "config.h"
+#include "metrics.h"
+#include <atomic>
+#include <array>
+
+namespace admission
+{
+    static std::array<std::atomic<int>, static_cast<size_t>(RouteClass::Count)> running{};
+
+    static int limitFor(RouteClass routeClass, const config::Config& cfg)
+    {
+        switch (routeClass)
+        {
+            case RouteClass::Read:
+                return cfg.max_inflight_read;
+            case RouteClass::Write:
+                return cfg.max_inflight_write;
+            case RouteClass::Bulk:
+                return cfg.max_inflight_bulk;
+            default:
+                return cfg.max_inflight_auth;
+        }
+    }
+
+    Ticket::Ticket(RouteClass routeClass) : routeClass(routeClass)
+    {
+        static auto& rejected = metrics::counter("todo_admission_rejected_total");
+
+        std::shared_ptr<const config::Config> cfg = config::get();
+        std::atomic<int>& count = running[static_cast<size_t>(routeClass)];
+
+        //take a slot first and give it back if that put us over, so two threads can't both squeeze into the last slot
+        if (count.fetch_add(1, std::memory_order_acq_rel) >= limitFor(routeClass, *cfg))
+        {
+            count.fetch_sub(1, std::memory_order_acq_rel);
+            rejected.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        admitted = true;
+        int deadline_ms = routeClass == RouteClass::Bulk ? cfg->bulk_deadline_ms : cfg->request_deadline_ms;
+        deadline::set(std::chrono::steady_clock::now() + std::chrono::milliseconds(deadline_ms));
+    }
+
+    Ticket::~Ticket()
+    {
+        if (admitted)
+        {
+            deadline::clear();
+            running[static_cast<size_t>(routeClass)].fetch_sub(1, std::memory_order_acq_rel);
+        }
+    }
+
+    crow::response overloaded()
+    {
+        return serviceUnavailable("Server is busy, try again shortly");
+    }
+
+    crow::response serviceUnavailable(const std::string& message)
+    {
+        crow::json::wvalue error_json;
+        error_json["message"] = message;
+        crow::response res(crow::status::SERVICE_UNAVAILABLE, error_json);
+        res.set_header("Retry-After", std::to_string(config::get()->retry_after_seconds));
+        return res;
+    }
+
+    int inflight(RouteClass routeClass)
+    {
+        return running[static_cast<size_t>(routeClass)].load(std::memory_order_relaxed);
+    }
+}
@@ -0,0 +1,43 @@
+#pragma once
+#include "crow.h"
+
+
+//admission control. Every api route takes a ticket before doing any work. When its class already has
+//max_inflight requests running, the request is turned away right away with a 503 instead of piling up
+//behind a slow database. The ticket also starts the request's deadline (see deadline.h).
+namespace admission
+{
+    enum class RouteClass
+    {
+        Read,   // GET /tasks, /me...
+        Write,  // POST/PUT/DELETE /tasks
+        Auth,   // /register and /login, limited separately because of the password hashing
+        Bulk,   // export and import, few at a time but each one may run for minutes
+        Count
+    };
+
+    class Ticket
+    {
+    public:
+        explicit Ticket(RouteClass routeClass);
+        Ticket(const Ticket&) = delete;
+        Ticket& operator=(const Ticket&) = delete;
+        ~Ticket();
+
+        //false means the request was not admitted and should answer with overloaded()
+        explicit operator bool() const { return admitted; }
+
+    private:
+        RouteClass routeClass;
+        bool admitted = false;
+    };
+
+    //503 with a Retry-After header
+    crow::response overloaded();
+
+    //the same 503 with our own message, e.g. when the database is down (database::unavailable)
+    crow::response serviceUnavailable(const std::string& message);
+
+    //requests currently running in this class
+    int inflight(RouteClass routeClass);
+}
@@ -2,6 +2,38 @@
 #include "readFile.h"
 #include "db_functions.h"
 #include "AuthHandle.h"
+#include "compression.h"
+#include "admission.h"
+#include "task_io.h"
+#include "reminders.h"
+#include "idempotency.h"
+#include "request_body.h"
+#include <fstream>
+#include <charconv>
+#include <limits>
+
+//websocket upgrades are handled before the middlewares run, so there is no cookie context to ask.
+//this reads the sessionID cookie straight from the header instead.
+static std::string sessionCookie(const crow::request& req)
+{
+    const std::string& header = req.get_header_value("Cookie");
+    size_t pos = 0;
+    while (pos < header.size())
+    {
+        size_t end = header.find(';', pos);
+        if (end == std::string::npos)
+        {
+            end = header.size();
+        }
+        size_t start = header.find_first_not_of(' ', pos);
+        if (start < end && header.compare(start, 10, "sessionID=") == 0)
+        {
+            return header.substr(start + 10, end - start - 10);
+        }
+        pos = end + 1;
+    }
+    return {};
+}
 
 void taskRoutes(crow::App<crow::CookieParser>& app)
 {
@@ -58,6 +90,12 @@ void taskRoutes(crow::App<crow::CookieParser>& app)
     CROW_ROUTE(app, "/tasks")
     ([&](const crow::request& req)
     {
+        admission::Ticket ticket(admission::RouteClass::Read);
+        if (!ticket)
+        {
+            return admission::overloaded();
+        }
+
         std::optional<int> userID = check_auth(req);
         if (!userID.has_value())
         {
@@ -76,9 +114,15 @@ void taskRoutes(crow::App<crow::CookieParser>& app)
                 task_json["id"] = task.id;
                 task_json["description"] = task.description;
                 task_json["status"] = task.Tstatus;
+                task_json["due_at"] = task.due_at ? crow::json::wvalue(*task.due_at) : crow::json::wvalue(nullptr);
                 tasks_array.push_back(std::move(task_json)); // move the object direct? Believe this avoids having to copy
             }
         }
+        catch (const database::unavailable &e)
+        {
+            CROW_LOG_WARNING << "Database unavailable: " << e.what();
+            return admission::serviceUnavailable("Database is unavailable, try again shortly");
+        }
         catch (const std::exception &e)
         {
             CROW_LOG_ERROR << "Error listing tasks from DB in route handler: " << e.what();
@@ -88,13 +132,276 @@ void taskRoutes(crow::App<crow::CookieParser>& app)
         }
 
         response_json["tasks"] = std::move(tasks_array); // sets the all the elements in an array called tasks.
-        return crow::response(crow::status::OK, response_json);
+        crow::response res(crow::status::OK, response_json);
+        compression::apply(req, res); // task lists can get big, gzip/br/zstd them when the client allows it
+        return res;
+    });
+
+    // Endpoint to page through archived tasks, newest first: ?limit=<1-200>&cursor=<next_cursor of the previous page>
+    CROW_ROUTE(app, "/tasks/archive")
+    ([&](const crow::request& req)
+    {
+        admission::Ticket ticket(admission::RouteClass::Read);
+        if (!ticket)
+        {
+            return admission::overloaded();
+        }
+
+        std::optional<int> userID = check_auth(req);
+        if (!userID.has_value())
+        {
+            return crow::response(crow::status::UNAUTHORIZED, "Authentication required.");
+        }
+
+        //both optional, but if they are there they have to be whole numbers
+        auto readNumber = [](const char* text, int min, int max) -> std::optional<int>
+        {
+            int value = 0;
+            std::string_view view(text);
+            auto [end, ec] = std::from_chars(view.data(), view.data() + view.size(), value);
+            if (ec != std::errc() || end != view.data() + view.size() || value < min || value > max)
+            {
+                return std::nullopt;
+            }
+            return value;
+        };
+        int limit = 50;
+        std::optional<int> cursor;
+        const char* limit_param = req.url_params.get("limit");
+        const char* cursor_param = req.url_params.get("cursor");
+        if (limit_param != nullptr)
+        {
+            std::optional<int> parsed = readNumber(limit_param, 1, 200);
+            if (!parsed)
+            {
+                crow::json::wvalue error_json;
+                error_json["message"] = "limit must be a number from 1 to 200";
+                return crow::response(crow::status::BAD_REQUEST, error_json);
+            }
+            limit = parsed.value();
+        }
+        if (cursor_param != nullptr)
+        {
+            cursor = readNumber(cursor_param, 1, std::numeric_limits<int>::max());
+            if (!cursor)
+            {
+                crow::json::wvalue error_json;
+                error_json["message"] = "cursor must be the next_cursor of a previous page";
+                return crow::response(crow::status::BAD_REQUEST, error_json);
+            }
+        }
+
+        crow::json::wvalue response_json;
+        crow::json::wvalue::list tasks_array;
+
+        try
+        {
+            ArchivePage page = database::getArchivedTasks(userID.value(), limit, cursor);
+            for (const auto &task: page.tasks)
+            {
+                crow::json::wvalue task_json;
+                task_json["id"] = task.id;
+                task_json["description"] = task.description;
+                task_json["status"] = task.Tstatus;
+                task_json["completed_at"] = task.completed_at;
+                tasks_array.push_back(std::move(task_json));
+            }
+            if (page.next_cursor)
+            {
+                response_json["next_cursor"] = page.next_cursor.value();
+            }
+            else
+            {
+                response_json["next_cursor"] = nullptr; // last page
+            }
+        }
+        catch (const database::unavailable &e)
+        {
+            CROW_LOG_WARNING << "Database unavailable: " << e.what();
+            return admission::serviceUnavailable("Database is unavailable, try again shortly");
+        }
+        catch (const std::exception &e)
+        {
+            CROW_LOG_ERROR << "Error listing archived tasks: " << e.what();
+            crow::json::wvalue error_json;
+            error_json["error"] = "Database error retrieving archived tasks";
+            return crow::response(crow::status::INTERNAL_SERVER_ERROR, error_json);
+        }
+
+        response_json["tasks"] = std::move(tasks_array);
+        crow::response res(crow::status::OK, response_json);
+        compression::apply(req, res);
+        return res;
+    });
+
+    // Endpoint for the per-status task counts shown on the dashboard
+    CROW_ROUTE(app, "/tasks/stats")
+    ([&](const crow::request& req)
+    {
+        admission::Ticket ticket(admission::RouteClass::Read);
+        if (!ticket)
+        {
+            return admission::overloaded();
+        }
+
+        std::optional<int> userID = check_auth(req);
+        if (!userID.has_value())
+        {
+            return crow::response(crow::status::UNAUTHORIZED, "Authentication required.");
+        }
+
+        try
+        {
+            TaskStats stats = database::getTaskStats(userID.value());
+            crow::json::wvalue stats_json;
+            stats_json["todo"] = stats.todo;
+            stats_json["inprogress"] = stats.inprogress;
+            stats_json["completed"] = stats.completed;
+            stats_json["total"] = stats.todo + stats.inprogress + stats.completed;
+            return crow::response(crow::status::OK, stats_json);
+        }
+        catch (const database::unavailable &e)
+        {
+            CROW_LOG_WARNING << "Database unavailable: " << e.what();
+            return admission::serviceUnavailable("Database is unavailable, try again shortly");
+        }
+        catch (const std::exception &e)
+        {
+            CROW_LOG_ERROR << "Error reading task stats: " << e.what();
+            crow::json::wvalue error_json;
+            error_json["error"] = "Database error retrieving task stats";
+            return crow::response(crow::status::INTERNAL_SERVER_ERROR, error_json);
+        }
+    });
+
+    // Endpoint to download every task as ndjson (default) or csv: /tasks/export?format=csv
+    CROW_ROUTE(app, "/tasks/export")
+    ([&](const crow::request& req)
+    {
+        admission::Ticket ticket(admission::RouteClass::Bulk);
+        if (!ticket)
+        {
+            return admission::overloaded();
+        }
+
+        std::optional<int> userID = check_auth(req);
+        if (!userID.has_value())
+        {
+            return crow::response(crow::status::UNAUTHORIZED, "Authentication required.");
+        }
+
+        const char* format_param = req.url_params.get("format");
+        std::optional<taskIO::Format> format = taskIO::toFormat(format_param != nullptr ? format_param : "");
+        if (!format.has_value())
+        {
+            crow::json::wvalue error_json;
+            error_json["message"] = "format must be ndjson or csv";
+            return crow::response(crow::status::BAD_REQUEST, error_json);
+        }
+
+        std::filesystem::path path;
+        try
+        {
+            //rows go from postgres into a temp file as they arrive, and crow sends the file in chunks.
+            //that way neither side ever holds the whole export in memory.
+            path = taskIO::newExportFile(userID.value(), format.value());
+            long long rows = 0;
+            {
+                std::ofstream file(path, std::ios::binary);
+                rows = database::exportTasks(userID.value(), file, format.value());
+                if (!file)
+                {
+                    throw std::runtime_error("could not write export file " + path.string());
+                }
+            }
+
+            crow::response res;
+            res.set_static_file_info_unsafe(taskIO::releaseExportFile(path));
+            res.set_header("Content-Type", taskIO::contentType(format.value()));
+            res.set_header("Content-Disposition", "attachment; filename=\"tasks" + taskIO::extension(format.value()) + "\"");
+            res.set_header("X-Task-Count", std::to_string(rows));
+            return res;
+        }
+        catch (const database::unavailable &e)
+        {
+            CROW_LOG_WARNING << "Database unavailable: " << e.what();
+            taskIO::discardExportFile(path);
+            return admission::serviceUnavailable("Database is unavailable, try again shortly");
+        }
+        catch (const std::exception &e)
+        {
+            CROW_LOG_ERROR << "Error exporting tasks: " << e.what();
+            taskIO::discardExportFile(path);
+            crow::json::wvalue error_json;
+            error_json["error"] = "Database error exporting tasks";
+            return crow::response(crow::status::INTERNAL_SERVER_ERROR, error_json);
+        }
+    });
+
+    // Endpoint to add many tasks at once from an ndjson (default) or csv body: /tasks/import?format=csv
+    CROW_ROUTE(app, "/tasks/import")
+        .methods("POST"_method)
+    ([&](const crow::request& req)
+    {
+        admission::Ticket ticket(admission::RouteClass::Bulk);
+        if (!ticket)
+        {
+            return admission::overloaded();
+        }
+
+        std::optional<int> userID = check_auth(req);
+        if (!userID.has_value())
+        {
+            return crow::response(crow::status::UNAUTHORIZED, "Authentication required.");
+        }
+
+        const char* format_param = req.url_params.get("format");
+        std::optional<taskIO::Format> format = taskIO::toFormat(format_param != nullptr ? format_param : "");
+        if (!format.has_value())
+        {
+            crow::json::wvalue error_json;
+            error_json["message"] = "format must be ndjson or csv";
+            return crow::response(crow::status::BAD_REQUEST, error_json);
+        }
+
+        try
+        {
+            long long imported = database::importTasks(userID.value(), req.body, format.value());
+            crow::json::wvalue import_json;
+            import_json["imported"] = imported;
+            return crow::response(crow::status::CREATED, import_json);
+        }
+        catch (const std::invalid_argument &e)
+        {
+            //a bad row, nothing was imported
+            crow::json::wvalue error_json;
+            error_json["message"] = e.what();
+            return crow::response(crow::status::BAD_REQUEST, error_json);
+        }
+        catch (const database::unavailable &e)
+        {
+            CROW_LOG_WARNING << "Database unavailable: " << e.what();
+            return admission::serviceUnavailable("Database is unavailable, try again shortly");
+        }
+        catch (const std::exception &e)
+        {
+            CROW_LOG_ERROR << "Error importing tasks: " << e.what();
+            crow::json::wvalue error_json;
+            error_json["error"] = "Database error importing tasks";
+            return crow::response(crow::status::INTERNAL_SERVER_ERROR, error_json);
+        }
     });
 
     // Endpoint to retrieve a single task by ID
     CROW_ROUTE(app, "/tasks/<int>")
     ([&](const crow::request& req, int tID)
     {
+        admission::Ticket ticket(admission::RouteClass::Read);
+        if (!ticket)
+        {
+            return admission::overloaded();
+        }
+
         std::optional<int> userID = check_auth(req);
         if (!userID.has_value())
         {
@@ -112,9 +419,15 @@ void taskRoutes(crow::App<crow::CookieParser>& app)
                 task_json["id"] = task->id;
                 task_json["description"] = task->description;
                 task_json["status"] = task->Tstatus;
+                task_json["due_at"] = task->due_at ? crow::json::wvalue(*task->due_at) : crow::json::wvalue(nullptr);
                 return crow::response(crow::status::OK, task_json);
             }
         }
+        catch (const database::unavailable &e)
+        {
+            CROW_LOG_WARNING << "Database unavailable: " << e.what();
+            return admission::serviceUnavailable("Database is unavailable, try again shortly");
+        }
         catch (const std::exception &e)
         {
             CROW_LOG_ERROR << "Error listing task from DB: " << e.what();
@@ -135,32 +448,51 @@ void taskRoutes(crow::App<crow::CookieParser>& app)
     ([&](const crow::request& req)
     {
 
+        admission::Ticket ticket(admission::RouteClass::Write);
+        if (!ticket)
+        {
+            return admission::overloaded();
+        }
+
         std::optional<int> userID = check_auth(req);
         if (!userID.has_value())
         {
             return crow::response(crow::status::UNAUTHORIZED, "Authentication required.");
         }
 
-
-        auto json_body = crow::json::load(req.body);
-        if (!json_body)
+        //checked and taken apart in one pass, before anything else runs. description is a view into req.body.
+        std::string_view error;
+        std::optional<requestBody::TaskFields> fields = requestBody::parseTask(req.body, error);
+        if (!fields || !fields->description)
         {
             crow::json::wvalue error_json;
-            error_json["message"] = "Invalid json in request body";
+            error_json["message"] = fields ? "'description' is required" : std::string(error);
             return crow::response(crow::status::BAD_REQUEST, error_json); // this a 400 code
         }
+        std::string Tstatus = toString(fields->Estatus.value_or(status::Todo));
+        std::optional<long long> due_ms = fields->due_ms.value_or(std::nullopt);
 
-        std::string description = json_body["description"].s();
-        std::string status = json_body["status"].s(); // default is set if left blank
+        //a retry with the same Idempotency-Key gets the first attempt's response, see idempotency.h
+        idempotency::Claim claim(req, userID.value());
+        if (claim.answer)
+        {
+            return std::move(*claim.answer);
+        }
 
         try
         {
-            int new_id = database::createTask(description, status, userID.value());
+            int new_id = database::createTask(*fields->description, Tstatus, userID.value(), due_ms);
             crow::json::wvalue ntask_json;
             ntask_json["id "] = new_id;
-            ntask_json["description"] = description;
-            ntask_json["status"] = status;
-            return crow::response(crow::status::OK, ntask_json);
+            ntask_json["description"] = std::string(*fields->description);
+            ntask_json["status"] = Tstatus;
+            ntask_json["due_at"] = due_ms ? crow::json::wvalue(formatDueTime(*due_ms)) : crow::json::wvalue(nullptr);
+            return claim.complete(crow::response(crow::status::OK, ntask_json));
+        }
+        catch (const database::unavailable &e)
+        {
+            CROW_LOG_WARNING << "Database unavailable: " << e.what();
+            return admission::serviceUnavailable("Database is unavailable, try again shortly");
         }
         catch (const std::exception &e)
         {
@@ -176,62 +508,62 @@ void taskRoutes(crow::App<crow::CookieParser>& app)
         .methods("PUT"_method)
     ([&](const crow::request& req, int tID)
     {
+        admission::Ticket ticket(admission::RouteClass::Write);
+        if (!ticket)
+        {
+            return admission::overloaded();
+        }
+
         std::optional<int> userID = check_auth(req);
         if (!userID.has_value())
         {
             return crow::response(crow::status::UNAUTHORIZED, "Authentication required.");
         }
 
-        auto json_body = crow::json::load(req.body);
-        if (!json_body)
+        std::string_view error;
+        std::optional<requestBody::TaskFields> fields = requestBody::parseTask(req.body, error);
+        if (!fields)
         {
             crow::json::wvalue error_json;
-            error_json["message"] = "Invalid json in request body";
+            error_json["message"] = std::string(error);
             return crow::response(crow::status::BAD_REQUEST, error_json); // this a 400 code
         }
+        std::optional<std::string_view> description = fields->description;
+        std::optional<status> Estatus = fields->Estatus;
+        std::optional<std::optional<long long>> due_ms = fields->due_ms; // absent leaves the due time alone, null clears it
 
-        std::optional<std::string> description;
-            if (json_body.count("description") && json_body["description"].t() == crow::json::type::String)
-            {
-                description = json_body["description"].s();
-            }
-
-
-        std::optional<status> Estatus;
-        if (json_body.count("status") && json_body["status"].t() == crow::json::type::String) {
-            try
-            {
-                std::string Jstatus = json_body["status"].s();
-                Estatus = toStatus(Jstatus);
-
-            }
-            catch (const std::runtime_error& e)
-            {
-                crow::json::wvalue error_json;
-                error_json["message"] = e.what();
-                return crow::response(crow::status::BAD_REQUEST, error_json);
-            }
-        }
-
-        if (!description && !Estatus) // Check if at least one field is provided for update
+        if (!description && !Estatus && !due_ms) // Check if at least one field is provided for update
         {
             crow::json::wvalue error_json;
-            error_json["message"] = "No valid fields to update were provided (expected 'description' or 'status' as string)";
+            error_json["message"] = "No valid fields to update were provided (expected 'description', 'status' or 'due_at')";
             return crow::response(crow::status::BAD_REQUEST, error_json);
         }
 
+        //a retry with the same Idempotency-Key gets the first attempt's response, see idempotency.h
+        idempotency::Claim claim(req, userID.value());
+        if (claim.answer)
+        {
+            return std::move(*claim.answer);
+        }
+
         try
         {
-            if (bool update = database::updateTask(tID , description, Estatus, userID.value()))
+            if (bool update = database::updateTask(tID , description, Estatus, userID.value(), due_ms))
             {
                 std::optional<Task> utask = database::getTask(tID, userID.value());
                 crow::json::wvalue utask_json;
                 utask_json["id"] = utask->id; // once the updateTask is called we are just getting our task, and displaying it back to the frontend
                 utask_json["description"] = utask->description;
                 utask_json["status"] = utask->Tstatus;
-                return crow::response(crow::status::OK, utask_json);
+                utask_json["due_at"] = utask->due_at ? crow::json::wvalue(*utask->due_at) : crow::json::wvalue(nullptr);
+                return claim.complete(crow::response(crow::status::OK, utask_json));
             }
         }
+        catch (const database::unavailable& e)
+        {
+            CROW_LOG_WARNING << "Database unavailable: " << e.what();
+            return admission::serviceUnavailable("Database is unavailable, try again shortly");
+        }
         catch (const std::exception& e)
         {
             CROW_LOG_ERROR << "Error updating task: " << e.what();
@@ -240,6 +572,59 @@ void taskRoutes(crow::App<crow::CookieParser>& app)
             return crow::response(crow::status::INTERNAL_SERVER_ERROR, error_json);
         }
 
+        crow::json::wvalue error_json;
+        error_json["message"] = "Task not found";
+        return claim.complete(crow::response(crow::status::NOT_FOUND, error_json));
+    });
+
+    // Endpoint for drag and drop: {"after": <id>} or {"before": <id>} puts the task next to another one,
+    // {"after": null} moves it to the top and {"before": null} to the bottom
+    CROW_ROUTE(app, "/tasks/<int>/move")
+        .methods("PATCH"_method)
+    ([&](const crow::request& req, int tID)
+    {
+        admission::Ticket ticket(admission::RouteClass::Write);
+        if (!ticket)
+        {
+            return admission::overloaded();
+        }
+
+        std::optional<int> userID = check_auth(req);
+        if (!userID.has_value())
+        {
+            return crow::response(crow::status::UNAUTHORIZED, "Authentication required.");
+        }
+
+        std::string_view error;
+        std::optional<requestBody::Move> parsed = requestBody::parseMove(req.body, error);
+        if (!parsed)
+        {
+            crow::json::wvalue error_json;
+            error_json["message"] = std::string(error);
+            return crow::response(crow::status::BAD_REQUEST, error_json);
+        }
+        TaskMove move{parsed->after, parsed->anchorID};
+
+        try
+        {
+            if (database::moveTask(tID, userID.value(), move))
+            {
+                return crow::response(crow::status::NO_CONTENT);
+            }
+        }
+        catch (const database::unavailable& e)
+        {
+            CROW_LOG_WARNING << "Database unavailable: " << e.what();
+            return admission::serviceUnavailable("Database is unavailable, try again shortly");
+        }
+        catch (const std::exception& e)
+        {
+            CROW_LOG_ERROR << "Error moving task: " << e.what();
+            crow::json::wvalue error_json;
+            error_json["error"] = "Database error moving task";
+            return crow::response(crow::status::INTERNAL_SERVER_ERROR, error_json);
+        }
+
         crow::json::wvalue error_json;
         error_json["message"] = "Task not found";
         return crow::response(crow::status::NOT_FOUND, error_json);
@@ -250,20 +635,38 @@ void taskRoutes(crow::App<crow::CookieParser>& app)
         .methods("DELETE"_method)
     ([&](const crow::request& req, int task_id)
     {
+        admission::Ticket ticket(admission::RouteClass::Write);
+        if (!ticket)
+        {
+            return admission::overloaded();
+        }
+
         std::optional<int> userID = check_auth(req);
         if (!userID.has_value())
         {
             return crow::response(crow::status::UNAUTHORIZED, "Authentication required.");
         }
 
+        //a retry with the same Idempotency-Key gets the first attempt's response, see idempotency.h
+        idempotency::Claim claim(req, userID.value());
+        if (claim.answer)
+        {
+            return std::move(*claim.answer);
+        }
+
         try
         {
             bool deleted = database::deleteTask(task_id, userID.value());
             if (deleted)
             {
-                return crow::response(crow::status::NO_CONTENT); // indicates successful deletion
+                return claim.complete(crow::response(crow::status::NO_CONTENT)); // indicates successful deletion
             }
         }
+        catch (const database::unavailable& e)
+        {
+            CROW_LOG_WARNING << "Database unavailable: " << e.what();
+            return admission::serviceUnavailable("Database is unavailable, try again shortly");
+        }
         catch (const std::exception& e)
         {
             CROW_LOG_ERROR << "Error deleting task: " << e.what();
@@ -274,7 +677,32 @@ void taskRoutes(crow::App<crow::CookieParser>& app)
 
         crow::json::wvalue error_json;
         error_json["message"] = "Task not found";
-        return crow::response(crow::status::NOT_FOUND, error_json);
+        return claim.complete(crow::response(crow::status::NOT_FOUND, error_json));
     });
 
+    // Websocket that gets {"type": "reminder", "task": {...}} when one of the user's tasks is due
+    CROW_WEBSOCKET_ROUTE(app, "/ws/reminders")
+        .onaccept([](const crow::request& req, void** userdata)
+        {
+            std::optional<int> userID = AuthHandle::loadSession(sessionCookie(req));
+            if (!userID.has_value())
+            {
+                return false; // refuses the upgrade
+            }
+            //the user id fits in the pointer, so there is nothing to free when the socket closes
+            *userdata = reinterpret_cast<void*>(static_cast<intptr_t>(userID.value()));
+            return true;
+        })
+        .onopen([](crow::websocket::connection& conn)
+        {
+            reminders::subscribe(static_cast<int>(reinterpret_cast<intptr_t>(conn.userdata())), &conn);
+        })
+        .onmessage([](crow::websocket::connection&, const std::string&, bool)
+        {
+            // nothing is expected from the client
+        })
+        .onclose([](crow::websocket::connection& conn, const std::string&, uint16_t)
+        {
+            reminders::unsubscribe(&conn);
+        });
 }
@@ -0,0 +1,381 @@
+#include "idempotency.h"
+#include "admission.h"
+#include "config.h"
+#include "metrics.h"
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <stdexcept>
+#include <string>
+#ifdef _WIN32
+#include <mutex>
+#include <process.h>
+#else
+#include <cerrno>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace idempotency
+{
+    //the spec suggests keys are uuids, this leaves plenty of room and keeps one client from using megabyte keys
+    static constexpr size_t max_key_length = 255;
+    //the biggest answer we keep. Task writes answer with one task (a 256 character description at most),
+    //which is well below this. A bigger one is not kept and the claim is let go, as if it had failed.
+    static constexpr size_t max_body_length = 2048;
+    static constexpr size_t max_content_type_length = 64;
+    //how far from its home slot a key may end up, like in the session table
+    static constexpr size_t max_probes = 64;
+
+    enum State : uint8_t
+    {
+        Empty = 0,   // never used. A lookup can stop here.
+        Running = 1, // claimed, the first attempt is still going
+        Done = 2,    // holds the answer for retries
+        Deleted = 3  // free again, but lookups have to keep probing past it
+    };
+
+    //one key and its answer. Everything is plain data, so it can live in memory shared by every worker.
+    struct Slot
+    {
+        uint8_t state;
+        int32_t pid;          // the worker running it, while Running
+        uint64_t seq;         // tells a re-claimed slot apart from the one a Claim holds
+        uint64_t hash;        // of user and key, compared before the key itself
+        int32_t user_id;
+        uint16_t key_length;
+        char key[max_key_length];
+        uint64_t fingerprint; // of the request, a key can't be reused for a different one
+        int64_t expires_ms;   // steady clock, which is the same clock in every process
+        int32_t code;
+        uint8_t content_type_length;
+        char content_type[max_content_type_length];
+        uint16_t body_length;
+        char body[max_body_length];
+    };
+
+    //in front of the slots. The mutex is process shared and robust: a worker that dies holding it
+    //doesn't leave it locked for everyone else.
+    struct Header
+    {
+#ifndef _WIN32
+        pthread_mutex_t mutex;
+#endif
+        uint64_t next_seq;
+    };
+
+    static Header* header = nullptr;
+    static Slot* slots = nullptr;
+    static size_t slot_mask = 0;
+#ifdef _WIN32
+    static std::mutex local_mutex; // no fork on windows, so there is only ever one process
+#endif
+
+    class Lock
+    {
+    public:
+        Lock()
+        {
+#ifdef _WIN32
+            local_mutex.lock();
+#else
+            if (pthread_mutex_lock(&header->mutex) == EOWNERDEAD)
+            {
+                //the owner died halfway through. Every change writes the slot's state last, so at worst
+                //one slot holds a half written key that no lookup will match.
+                pthread_mutex_consistent(&header->mutex);
+            }
+#endif
+        }
+        Lock(const Lock&) = delete;
+        Lock& operator=(const Lock&) = delete;
+        ~Lock()
+        {
+#ifdef _WIN32
+            local_mutex.unlock();
+#else
+            pthread_mutex_unlock(&header->mutex);
+#endif
+        }
+    };
+
+    static int64_t nowMs()
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    static int32_t thisPid()
+    {
+#ifdef _WIN32
+        return static_cast<int32_t>(_getpid());
+#else
+        return static_cast<int32_t>(getpid());
+#endif
+    }
+
+    void create(size_t entries)
+    {
+        size_t capacity = 1024;
+        while (capacity < entries)
+        {
+            capacity <<= 1;
+        }
+        size_t bytes = sizeof(Header) + capacity * sizeof(Slot);
+
+#ifdef _WIN32
+        void* memory = ::operator new(bytes);
+        std::memset(memory, 0, bytes);
+#else
+        //mapped the same way as the session table: unlinked straight away, kept alive by the supervisor and
+        //inherited by every worker. ftruncate zero fills, so every slot starts Empty, and pages nobody touches
+        //never take up memory.
+        std::string name = "/todo-idempotency-" + std::to_string(getpid());
+        int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fd < 0)
+        {
+            throw std::runtime_error("shm_open failed for the idempotency table: " + std::string(std::strerror(errno)));
+        }
+        shm_unlink(name.c_str());
+        if (ftruncate(fd, static_cast<off_t>(bytes)) != 0)
+        {
+            int error = errno;
+            close(fd);
+            throw std::runtime_error("Could not size the idempotency table: " + std::string(std::strerror(error)));
+        }
+        void* memory = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (memory == MAP_FAILED)
+        {
+            throw std::runtime_error("mmap failed for the idempotency table: " + std::string(std::strerror(errno)));
+        }
+#endif
+        header = new (memory) Header();
+#ifndef _WIN32
+        pthread_mutexattr_t attributes;
+        pthread_mutexattr_init(&attributes);
+        pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&header->mutex, &attributes);
+        pthread_mutexattr_destroy(&attributes);
+#endif
+        slots = reinterpret_cast<Slot*>(header + 1);
+        slot_mask = capacity - 1;
+        CROW_LOG_INFO << "Idempotency table ready: " << capacity << " keys (" << bytes / (1024 * 1024) << " MiB at most)";
+    }
+
+    size_t releaseClaims(int pid)
+    {
+        Lock lock;
+        size_t released = 0;
+        for (size_t i = 0; i <= slot_mask; i++)
+        {
+            if (slots[i].state == Running && slots[i].pid == pid)
+            {
+                slots[i].state = Deleted;
+                released++;
+            }
+        }
+        return released;
+    }
+
+    static crow::response message(int code, const std::string& text)
+    {
+        crow::json::wvalue error_json;
+        error_json["message"] = text;
+        return crow::response(code, error_json);
+    }
+
+    static bool matches(const Slot& slot, uint64_t hash, int userID, const std::string& key)
+    {
+        return slot.hash == hash && slot.user_id == userID && slot.key_length == key.size() &&
+               std::memcmp(slot.key, key.data(), key.size()) == 0;
+    }
+
+    //what a retry of a finished request gets, copied out of the slot so it can be built after unlocking
+    struct Replay
+    {
+        int code;
+        std::string body;
+        std::string content_type;
+    };
+
+    Claim::Claim(const crow::request& req, int userID)
+    {
+        const std::string& header_key = req.get_header_value("Idempotency-Key");
+        if (header_key.empty())
+        {
+            return;
+        }
+        if (header_key.size() > max_key_length)
+        {
+            answer = message(crow::status::BAD_REQUEST, "Idempotency-Key can be at most 255 characters");
+            return;
+        }
+
+        static auto& replays = metrics::counter("todo_idempotent_replays_total");
+        std::shared_ptr<const config::Config> cfg = config::get();
+        int64_t now = nowMs();
+        //std::hash is the same in every worker, they are all forks of one binary
+        uint64_t hash = std::hash<std::string>{}(std::to_string(userID) + ':' + header_key);
+        uint64_t fingerprint = std::hash<std::string>{}(std::to_string(static_cast<int>(req.method)) + ' ' + req.url + '\n' + req.body);
+
+        enum class Outcome { Claimed, Mismatch, InFlight, Replayed, Full };
+        Outcome outcome = Outcome::Full;
+        Replay replay;
+        {
+            Lock lock;
+            Slot* found = nullptr;
+            Slot* free = nullptr;   // the first slot the key could go in
+            Slot* oldest = nullptr; // the finished key closest to expiring, taken over when nothing is free
+            for (size_t i = 0; i < max_probes && found == nullptr; i++)
+            {
+                Slot& slot = slots[(hash + i) & slot_mask];
+                if (slot.state == Empty)
+                {
+                    if (free == nullptr)
+                    {
+                        free = &slot;
+                    }
+                    break; // nothing was ever stored past here
+                }
+                bool expired = slot.state != Deleted && slot.expires_ms <= now;
+                if (slot.state != Deleted && !expired && matches(slot, hash, userID, header_key))
+                {
+                    found = &slot;
+                }
+                else if (slot.state == Deleted || expired)
+                {
+                    if (free == nullptr)
+                    {
+                        free = &slot;
+                    }
+                }
+                else if (slot.state == Done && (oldest == nullptr || slot.expires_ms < oldest->expires_ms))
+                {
+                    oldest = &slot;
+                }
+            }
+
+            if (found != nullptr)
+            {
+                if (found->fingerprint != fingerprint)
+                {
+                    outcome = Outcome::Mismatch;
+                }
+                else if (found->state == Running)
+                {
+                    outcome = Outcome::InFlight;
+                }
+                else
+                {
+                    outcome = Outcome::Replayed;
+                    replay.code = found->code;
+                    replay.body.assign(found->body, found->body_length);
+                    replay.content_type.assign(found->content_type, found->content_type_length);
+                }
+            }
+            else if (Slot* target = free != nullptr ? free : oldest)
+            {
+                //everything but the state first, a lookup skips the slot until the state says it is in use
+                target->pid = thisPid();
+                target->seq = ++header->next_seq;
+                target->hash = hash;
+                target->user_id = userID;
+                target->key_length = static_cast<uint16_t>(header_key.size());
+                std::memcpy(target->key, header_key.data(), header_key.size());
+                target->fingerprint = fingerprint;
+                target->expires_ms = now + static_cast<int64_t>(cfg->idempotency_ttl_seconds) * 1000;
+                target->body_length = 0;
+                target->state = Running;
+                index = static_cast<size_t>(target - slots);
+                seq = target->seq;
+                outcome = Outcome::Claimed;
+            }
+        }
+
+        switch (outcome)
+        {
+            case Outcome::Claimed:
+                break;
+            case Outcome::Mismatch:
+                answer = message(crow::status::UNPROCESSABLE_ENTITY, "Idempotency-Key was already used for a different request");
+                break;
+            case Outcome::InFlight:
+                answer = message(crow::status::CONFLICT, "A request with this Idempotency-Key is still being processed");
+                answer->set_header("Retry-After", std::to_string(cfg->retry_after_seconds));
+                break;
+            case Outcome::Replayed:
+            {
+                crow::response res(replay.code);
+                res.body = std::move(replay.body);
+                if (!replay.content_type.empty())
+                {
+                    res.set_header("Content-Type", replay.content_type);
+                }
+                res.set_header("Idempotent-Replayed", "true");
+                answer = std::move(res);
+                replays.fetch_add(1, std::memory_order_relaxed);
+                break;
+            }
+            case Outcome::Full:
+                //every slot the key could go in holds a request that is still running. Running it anyway would
+                //give up the guarantee the client asked for, so it is turned away like any other overload.
+                answer = admission::overloaded();
+                break;
+        }
+    }
+
+    Claim::~Claim()
+    {
+        if (seq == 0 || completed)
+        {
+            return;
+        }
+        Lock lock;
+        Slot& slot = slots[index];
+        if (slot.seq == seq && slot.state == Running)
+        {
+            slot.state = Deleted;
+        }
+    }
+
+    crow::response Claim::complete(crow::response res)
+    {
+        if (seq == 0)
+        {
+            return res;
+        }
+        const std::string& content_type = res.get_header_value("Content-Type");
+        bool fits = res.body.size() <= max_body_length && content_type.size() <= max_content_type_length;
+        if (!fits)
+        {
+            CROW_LOG_WARNING << "Idempotent response of " << res.body.size() << " bytes is too big to keep, a retry will run again";
+        }
+        {
+            Lock lock;
+            Slot& slot = slots[index];
+            if (slot.seq == seq && slot.state == Running) // it may have been taken over while the request ran
+            {
+                if (fits)
+                {
+                    slot.code = res.code;
+                    slot.body_length = static_cast<uint16_t>(res.body.size());
+                    std::memcpy(slot.body, res.body.data(), res.body.size());
+                    slot.content_type_length = static_cast<uint8_t>(content_type.size());
+                    std::memcpy(slot.content_type, content_type.data(), content_type.size());
+                    slot.state = Done;
+                }
+                else
+                {
+                    slot.state = Deleted;
+                }
+            }
+        }
+        completed = true;
+        return res;
+    }
+}
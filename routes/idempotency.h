@@ -0,0 +1,48 @@
+#pragma once
+#include "crow.h"
+#include <optional>
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+
+//Idempotency-Key support for task writes. The first request with a key runs as usual and its response is
+//kept for idempotency_ttl_seconds. A retry with the same key gets that response back from memory, without
+//touching the database, so a client can safely retry a POST that timed out. Keys belong to the user that
+//sent them. The store is a fixed size table in shared memory, like the session table, so a retry that lands
+//on another worker still finds the key.
+namespace idempotency
+{
+    //maps a table for at least entries keys. Call it once, before forking workers. Throws if the memory
+    //can't be had.
+    void create(size_t entries);
+
+    //lets go of every key still being processed by the worker with this pid, for when it died halfway
+    //through a request. Returns how many there were.
+    size_t releaseClaims(int pid);
+
+    class Claim
+    {
+    public:
+        //claims the request's Idempotency-Key header for userID. Without the header nothing happens.
+        Claim(const crow::request& req, int userID);
+        Claim(const Claim&) = delete;
+        Claim& operator=(const Claim&) = delete;
+        //a claim that was never completed is let go, so the client can try again with the same key
+        ~Claim();
+
+        //set when the request must not run: the first attempt's response, 409 while the first attempt is still
+        //running, 422 when the key was already used for a different request, 400 for a key that is too long,
+        //or 503 when the table has no room left for another request in flight
+        std::optional<crow::response> answer;
+
+        //keeps res as the answer for retries and hands it back. Only call it for outcomes a retry should see
+        //again; errors that may go away (the 5xx ones) are left out so the retry runs for real.
+        crow::response complete(crow::response res);
+
+    private:
+        size_t index = 0;
+        uint64_t seq = 0; // 0 when there is nothing claimed
+        bool completed = false;
+    };
+}
@@ -0,0 +1,142 @@
+#include "ops_routes.h"
+#include "metrics.h"
+#include "admission.h"
+#include "circuit_breaker.h"
+#include "profiler.h"
+#include "config.h"
+#include <sodium.h>
+#include <charconv>
+#include <optional>
+#include <string_view>
+
+//the /debug routes answer 404 unless debug_token is set, and 401 unless the request carries it.
+//Returns the response to send, or nothing if the request may go on.
+static std::optional<crow::response> checkDebugToken(const crow::request& req)
+{
+    std::shared_ptr<const config::Config> cfg = config::get();
+    if (cfg->debug_token.empty())
+    {
+        return crow::response(crow::status::NOT_FOUND);
+    }
+    const std::string& token = req.get_header_value("X-Debug-Token");
+    //sodium_memcmp takes as long whatever matches, so the token can't be guessed a byte at a time
+    if (token.size() != cfg->debug_token.size() || sodium_memcmp(token.data(), cfg->debug_token.data(), token.size()) != 0)
+    {
+        return crow::response(crow::status::UNAUTHORIZED, "Debug token required.");
+    }
+    if (!profiler::supported())
+    {
+        return crow::response(crow::status::NOT_IMPLEMENTED, "Profiling is not supported on this platform.");
+    }
+    return std::nullopt;
+}
+
+//a whole number query parameter in [min, max], fallback when it isn't there. std::nullopt if it is there but bad.
+static std::optional<int> numberParam(const crow::request& req, const char* name, int fallback, int min, int max)
+{
+    const char* text = req.url_params.get(name);
+    if (text == nullptr)
+    {
+        return fallback;
+    }
+    int value = 0;
+    std::string_view view(text);
+    auto [end, ec] = std::from_chars(view.data(), view.data() + view.size(), value);
+    if (ec != std::errc() || end != view.data() + view.size() || value < min || value > max)
+    {
+        return std::nullopt;
+    }
+    return value;
+}
+
+static crow::response badParam(const std::string& message)
+{
+    crow::json::wvalue error_json;
+    error_json["message"] = message;
+    return crow::response(crow::status::BAD_REQUEST, error_json);
+}
+
+void opsRoutes(crow::App<crow::CookieParser>& app)
+{
+    //liveness check for load balancers. It takes no ticket and never touches the database,
+    //so it keeps answering while the api routes are shedding load.
+    CROW_ROUTE(app, "/health")
+    ([]()
+    {
+        crow::json::wvalue health_json;
+        health_json["status"] = "ok";
+        health_json["inflight"]["read"] = admission::inflight(admission::RouteClass::Read);
+        health_json["inflight"]["write"] = admission::inflight(admission::RouteClass::Write);
+        health_json["inflight"]["auth"] = admission::inflight(admission::RouteClass::Auth);
+        health_json["inflight"]["bulk"] = admission::inflight(admission::RouteClass::Bulk);
+        //still a 200 when the breaker is open: restarting this process won't bring the database back
+        health_json["database"] = database::breaker::toString(database::breaker::state());
+        return crow::response(crow::status::OK, health_json);
+    });
+
+    CROW_ROUTE(app, "/metrics")
+    ([]()
+    {
+        return crow::response(crow::status::OK, "text/plain; version=0.0.4", metrics::render());
+    });
+
+    //cpu profile of this process as folded stacks, e.g.
+    //  curl -H "X-Debug-Token: ..." "localhost:18080/debug/profile?seconds=30" | flamegraph.pl > cpu.svg
+    //The request holds its worker thread for the whole time. Like /health it takes no admission ticket,
+    //at most one profile runs at a time anyway.
+    CROW_ROUTE(app, "/debug/profile")
+    ([](const crow::request& req)
+    {
+        if (std::optional<crow::response> refused = checkDebugToken(req))
+        {
+            return std::move(*refused);
+        }
+        std::optional<int> seconds = numberParam(req, "seconds", 10, 1, 60);
+        if (!seconds)
+        {
+            return badParam("seconds must be a number from 1 to 60");
+        }
+        //99 rather than 100 so the samples don't line up with anything that runs every 10ms
+        std::optional<int> hz = numberParam(req, "hz", 99, 1, 1000);
+        if (!hz)
+        {
+            return badParam("hz must be a number from 1 to 1000");
+        }
+
+        CROW_LOG_INFO << "CPU profile started for " << *seconds << "s at " << *hz << "Hz";
+        std::optional<std::string> folded = profiler::cpu(*seconds, *hz);
+        if (!folded)
+        {
+            return crow::response(crow::status::CONFLICT, "A CPU profile is already running.");
+        }
+        return crow::response(crow::status::OK, "text/plain", std::move(*folded));
+    });
+
+    //allocation counts and bytes per call site in our own code, recorded for ?seconds (default 10)
+    CROW_ROUTE(app, "/debug/heap")
+    ([](const crow::request& req)
+    {
+        if (std::optional<crow::response> refused = checkDebugToken(req))
+        {
+            return std::move(*refused);
+        }
+        std::optional<int> seconds = numberParam(req, "seconds", 10, 1, 60);
+        if (!seconds)
+        {
+            return badParam("seconds must be a number from 1 to 60");
+        }
+        std::optional<int> top = numberParam(req, "top", 50, 1, 1000);
+        if (!top)
+        {
+            return badParam("top must be a number from 1 to 1000");
+        }
+
+        CROW_LOG_INFO << "Heap profile started for " << *seconds << "s";
+        std::optional<crow::json::wvalue> report = profiler::heap(*seconds, static_cast<size_t>(*top));
+        if (!report)
+        {
+            return crow::response(crow::status::CONFLICT, "A heap profile is already running.");
+        }
+        return crow::response(crow::status::OK, std::move(*report));
+    });
+}
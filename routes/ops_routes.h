@@ -0,0 +1,6 @@
+#pragma once
+#include "crow.h"
+#include "crow/middlewares/cookie_parser.h"
+
+//operational endpoints (metrics and the like) that are not part of the todo api
+void opsRoutes(crow::App<crow::CookieParser>& app);
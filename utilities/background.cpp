@@ -0,0 +1,134 @@
+#include "background.h"
+#include "crow.h"
+#include <deque>
+#include <vector>
+#include <unordered_set>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+namespace background
+{
+    static constexpr size_t max_pending = 1024;
+
+    struct Job
+    {
+        std::string key;
+        std::function<void()> run;
+    };
+
+    static std::mutex jobs_mutex;
+    static std::condition_variable jobs_cv;
+    static std::deque<Job> jobs;
+    static std::unordered_set<std::string> pending_keys;
+    static std::once_flag started;
+
+    struct Timer
+    {
+        Job job;
+        std::chrono::milliseconds interval;
+        std::chrono::steady_clock::time_point next;
+    };
+    //a handful at most, so the earliest one is found by looking at all of them
+    static std::vector<Timer> timers;
+
+    //the timer that is due first, or timers.end()
+    static std::vector<Timer>::iterator nextTimer()
+    {
+        auto earliest = timers.end();
+        for (auto it = timers.begin(); it != timers.end(); ++it)
+        {
+            if (earliest == timers.end() || it->next < earliest->next)
+            {
+                earliest = it;
+            }
+        }
+        return earliest;
+    }
+
+    static void work()
+    {
+        while (true)
+        {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock(jobs_mutex);
+                while (true)
+                {
+                    if (!jobs.empty())
+                    {
+                        job = std::move(jobs.front());
+                        jobs.pop_front();
+                        //taken off before running, so the job can be posted again while this run is still going
+                        pending_keys.erase(job.key);
+                        break;
+                    }
+                    auto timer = nextTimer();
+                    if (timer == timers.end())
+                    {
+                        jobs_cv.wait(lock);
+                    }
+                    else if (timer->next <= std::chrono::steady_clock::now())
+                    {
+                        job = timer->job; // a copy, the timer keeps its own
+                        timer->next = std::chrono::steady_clock::now() + timer->interval;
+                        break;
+                    }
+                    else
+                    {
+                        jobs_cv.wait_until(lock, timer->next);
+                    }
+                }
+            }
+
+            try
+            {
+                job.run();
+            }
+            catch (const std::exception& e)
+            {
+                CROW_LOG_ERROR << "Background job " << job.key << " failed: " << e.what();
+            }
+        }
+    }
+
+    //started on first use. That is always after watchReload, so the thread has SIGHUP blocked like every other.
+    static void start()
+    {
+        std::call_once(started, []()
+        {
+            std::thread(work).detach();
+        });
+    }
+
+    void post(const std::string& key, std::function<void()> job)
+    {
+        start();
+
+        {
+            std::lock_guard<std::mutex> lock(jobs_mutex);
+            if (pending_keys.count(key) > 0)
+            {
+                return;
+            }
+            if (jobs.size() >= max_pending)
+            {
+                CROW_LOG_WARNING << "Background queue is full, dropping job " << key;
+                return;
+            }
+            pending_keys.insert(key);
+            jobs.push_back(Job{key, std::move(job)});
+        }
+        jobs_cv.notify_one();
+    }
+
+    void every(const std::string& key, std::chrono::milliseconds interval, std::function<void()> job)
+    {
+        start();
+        {
+            std::lock_guard<std::mutex> lock(jobs_mutex);
+            timers.push_back(Timer{Job{key, std::move(job)}, interval, std::chrono::steady_clock::now() + interval});
+        }
+        jobs_cv.notify_one();
+    }
+}
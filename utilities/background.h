@@ -0,0 +1,18 @@
+#pragma once
+#include <functional>
+#include <string>
+#include <chrono>
+
+
+//a single thread for housekeeping that shouldn't hold up the request that noticed it is needed
+//(like rebalancing a user's task positions). Jobs run one at a time in the order they were posted.
+namespace background
+{
+    //queues job unless one with the same key is already waiting. The queue is bounded, when it is full
+    //the job is dropped (whoever posted it will notice the need again later). The thread starts on first use.
+    void post(const std::string& key, std::function<void()> job);
+
+    //runs job every interval on the same thread, first one interval from now. A run that takes longer
+    //than the interval just delays the next one, runs never overlap.
+    void every(const std::string& key, std::chrono::milliseconds interval, std::function<void()> job);
+}
@@ -0,0 +1,292 @@
+#include "compression.h"
+#include "metrics.h"
+#include "config.h"
+#include <chrono>
+#include <atomic>
+#include <sstream>
+#include <zlib.h>
+#ifdef TODO_HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+#ifdef TODO_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+namespace compression
+{
+    std::string toString(Encoding encoding)
+    {
+        switch (encoding)
+        {
+            case Encoding::Gzip:
+                return "gzip";
+            case Encoding::Brotli:
+                return "br";
+            case Encoding::Zstd:
+                return "zstd";
+            default:
+                return "identity";
+        }
+    }
+
+    static bool supported(Encoding encoding)
+    {
+        switch (encoding)
+        {
+            case Encoding::Gzip:
+                return true;
+#ifdef TODO_HAVE_BROTLI
+            case Encoding::Brotli:
+                return true;
+#endif
+#ifdef TODO_HAVE_ZSTD
+            case Encoding::Zstd:
+                return true;
+#endif
+            default:
+                return false;
+        }
+    }
+
+    static std::string trim(const std::string& s)
+    {
+        size_t begin = s.find_first_not_of(" \t");
+        if (begin == std::string::npos)
+        {
+            return "";
+        }
+        size_t end = s.find_last_not_of(" \t");
+        return s.substr(begin, end - begin + 1);
+    }
+
+    Encoding negotiate(const std::string& acceptEncoding)
+    {
+        //when two encodings have the same q-value we prefer the one earlier in this list
+        const Encoding preference[] = {Encoding::Zstd, Encoding::Brotli, Encoding::Gzip};
+
+        Encoding best = Encoding::Identity;
+        double best_q = 0.0;
+        int best_rank = 0;
+
+        std::stringstream ss(acceptEncoding);
+        std::string item;
+        while (std::getline(ss, item, ','))
+        {
+            //each item looks like "gzip" or "br;q=0.8"
+            std::string name = trim(item.substr(0, item.find(';')));
+            double q = 1.0;
+            size_t q_pos = item.find("q=");
+            if (q_pos != std::string::npos)
+            {
+                try
+                {
+                    q = std::stod(item.substr(q_pos + 2));
+                }
+                catch (const std::exception&)
+                {
+                    q = 0.0; // a malformed q-value is treated as "not acceptable"
+                }
+            }
+            if (q <= 0.0)
+            {
+                continue;
+            }
+
+            for (int rank = 0; rank < 3; ++rank)
+            {
+                Encoding candidate = preference[rank];
+                if ((name == toString(candidate) || (name == "x-gzip" && candidate == Encoding::Gzip) || name == "*") && supported(candidate))
+                {
+                    int this_rank = 3 - rank;
+                    if (q > best_q || (q == best_q && this_rank > best_rank))
+                    {
+                        best = candidate;
+                        best_q = q;
+                        best_rank = this_rank;
+                    }
+                    if (name != "*")
+                    {
+                        break;
+                    }
+                }
+            }
+        }
+        return best;
+    }
+
+    //one deflate stream per worker thread. deflateReset() reuses its buffers,
+    //so after the first response a thread never allocates compressor state again.
+    static bool gzip(const std::string& in, std::string& out)
+    {
+        struct Deflater
+        {
+            z_stream stream{};
+            bool ready = false;
+            Deflater()
+            {
+                //15 window bits + 16 asks zlib for a gzip header instead of a raw zlib one
+                ready = deflateInit2(&stream, 6, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+            }
+            ~Deflater()
+            {
+                if (ready)
+                {
+                    deflateEnd(&stream);
+                }
+            }
+        };
+        thread_local Deflater deflater;
+        if (!deflater.ready || deflateReset(&deflater.stream) != Z_OK)
+        {
+            return false;
+        }
+
+        out.resize(deflateBound(&deflater.stream, static_cast<uLong>(in.size())));
+        deflater.stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in.data()));
+        deflater.stream.avail_in = static_cast<uInt>(in.size());
+        deflater.stream.next_out = reinterpret_cast<Bytef*>(out.data());
+        deflater.stream.avail_out = static_cast<uInt>(out.size());
+
+        if (deflate(&deflater.stream, Z_FINISH) != Z_STREAM_END)
+        {
+            return false;
+        }
+        out.resize(deflater.stream.total_out);
+        return true;
+    }
+
+#ifdef TODO_HAVE_BROTLI
+    //brotli has no reset call for its encoder state, so this uses the one-shot api.
+    //quality 5 keeps the cpu cost close to gzip's; the default of 11 is meant for static assets.
+    static bool brotli(const std::string& in, std::string& out)
+    {
+        size_t out_size = BrotliEncoderMaxCompressedSize(in.size());
+        if (out_size == 0)
+        {
+            return false;
+        }
+        out.resize(out_size);
+        if (!BrotliEncoderCompress(5, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT,
+                                   in.size(), reinterpret_cast<const uint8_t*>(in.data()),
+                                   &out_size, reinterpret_cast<uint8_t*>(out.data())))
+        {
+            return false;
+        }
+        out.resize(out_size);
+        return true;
+    }
+#endif
+
+#ifdef TODO_HAVE_ZSTD
+    //like gzip, every worker thread keeps its own context and reuses it for each response
+    static bool zstd(const std::string& in, std::string& out)
+    {
+        struct Context
+        {
+            ZSTD_CCtx* cctx = ZSTD_createCCtx();
+            ~Context()
+            {
+                ZSTD_freeCCtx(cctx);
+            }
+        };
+        thread_local Context context;
+        if (context.cctx == nullptr)
+        {
+            return false;
+        }
+
+        out.resize(ZSTD_compressBound(in.size()));
+        size_t written = ZSTD_compressCCtx(context.cctx, out.data(), out.size(), in.data(), in.size(), 3);
+        if (ZSTD_isError(written))
+        {
+            return false;
+        }
+        out.resize(written);
+        return true;
+    }
+#endif
+
+    struct EncodingCounters
+    {
+        std::atomic<uint64_t>& responses;
+        std::atomic<uint64_t>& bytes_in;
+        std::atomic<uint64_t>& bytes_out;
+        std::atomic<uint64_t>& cpu_microseconds;
+    };
+
+    static EncodingCounters makeCounters(Encoding encoding)
+    {
+        std::string prefix = "todo_compression_" + toString(encoding) + "_";
+        return EncodingCounters{
+            metrics::counter(prefix + "responses_total"),
+            metrics::counter(prefix + "bytes_in_total"),
+            metrics::counter(prefix + "bytes_out_total"),
+            metrics::counter(prefix + "cpu_microseconds_total")};
+    }
+
+    void apply(const crow::request& req, crow::response& res)
+    {
+        static auto& skipped = metrics::counter("todo_compression_skipped_total");
+        static auto& failed = metrics::counter("todo_compression_failed_total");
+        static auto& wire_bytes = metrics::counter("todo_api_response_bytes_total");
+        //looked up once, indexed by the Encoding value
+        static EncodingCounters per_encoding[] = {
+            makeCounters(Encoding::Identity), makeCounters(Encoding::Gzip),
+            makeCounters(Encoding::Brotli), makeCounters(Encoding::Zstd)};
+
+        //the body changes with Accept-Encoding, caches in between need to know that
+        res.set_header("Vary", "Accept-Encoding");
+
+        Encoding encoding = negotiate(req.get_header_value("Accept-Encoding"));
+        //small bodies go out uncompressed, the headers would eat most of the savings anyway
+        if (encoding == Encoding::Identity || res.body.size() < config::get()->compression_min_size)
+        {
+            skipped.fetch_add(1, std::memory_order_relaxed);
+            wire_bytes.fetch_add(res.body.size(), std::memory_order_relaxed);
+            return;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        std::string compressed;
+        bool ok = false;
+        switch (encoding)
+        {
+            case Encoding::Gzip:
+                ok = gzip(res.body, compressed);
+                break;
+#ifdef TODO_HAVE_BROTLI
+            case Encoding::Brotli:
+                ok = brotli(res.body, compressed);
+                break;
+#endif
+#ifdef TODO_HAVE_ZSTD
+            case Encoding::Zstd:
+                ok = zstd(res.body, compressed);
+                break;
+#endif
+            default:
+                break;
+        }
+        //compression is pure computation on this thread, so wall time here is the cpu it cost us
+        auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+
+        if (!ok)
+        {
+            //sending the original body is always correct, so a failure here is not fatal
+            CROW_LOG_WARNING << "Could not " << toString(encoding) << " compress a response, sending it uncompressed";
+            failed.fetch_add(1, std::memory_order_relaxed);
+            wire_bytes.fetch_add(res.body.size(), std::memory_order_relaxed);
+            return;
+        }
+
+        EncodingCounters& counters = per_encoding[static_cast<int>(encoding)];
+        counters.responses.fetch_add(1, std::memory_order_relaxed);
+        counters.bytes_in.fetch_add(res.body.size(), std::memory_order_relaxed);
+        counters.bytes_out.fetch_add(compressed.size(), std::memory_order_relaxed);
+        counters.cpu_microseconds.fetch_add(elapsed.count(), std::memory_order_relaxed);
+        wire_bytes.fetch_add(compressed.size(), std::memory_order_relaxed);
+
+        res.body = std::move(compressed);
+        res.set_header("Content-Encoding", toString(encoding));
+    }
+}
@@ -0,0 +1,24 @@
+#pragma once
+#include <string>
+#include "crow.h"
+
+
+namespace compression
+{
+    enum class Encoding
+    {
+        Identity,
+        Gzip,
+        Brotli,
+        Zstd
+    };
+
+    std::string toString(Encoding encoding);
+
+    //picks the best encoding we support from an Accept-Encoding header (honours q-values, q=0 means "never")
+    Encoding negotiate(const std::string& acceptEncoding);
+
+    //compresses res.body in place if the client accepts it and the body is at least compression_min_size bytes.
+    //sets Content-Encoding and Vary, and records bytes and time spent in the metrics.
+    void apply(const crow::request& req, crow::response& res);
+}
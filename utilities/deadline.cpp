@@ -0,0 +1,25 @@
+#include "deadline.h"
+
+namespace deadline
+{
+    thread_local std::optional<std::chrono::steady_clock::time_point> current;
+
+    void set(std::chrono::steady_clock::time_point when)
+    {
+        current = when;
+    }
+
+    void clear()
+    {
+        current.reset();
+    }
+
+    std::optional<long long> remainingMs()
+    {
+        if (!current)
+        {
+            return std::nullopt;
+        }
+        return std::chrono::duration_cast<std::chrono::milliseconds>(*current - std::chrono::steady_clock::now()).count();
+    }
+}
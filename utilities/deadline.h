@@ -0,0 +1,15 @@
+#pragma once
+#include <chrono>
+#include <optional>
+
+
+//the deadline of the request the current thread is working on. Crow runs a handler start to finish on one thread,
+//so a thread local is enough to get it from the route down to the database layer without passing it everywhere.
+namespace deadline
+{
+    void set(std::chrono::steady_clock::time_point when);
+    void clear();
+
+    //milliseconds left, or nullopt when the thread has no deadline. Can be zero or negative once it has passed.
+    std::optional<long long> remainingMs();
+}
@@ -0,0 +1,378 @@
+#include "logger.h"
+#include "metrics.h"
+#include <array>
+#include <cctype>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace logging
+{
+    //one line waiting to be written. The text (the quoted msg and its fields) is already formatted, the writer
+    //only adds the timestamp, level and subsystem in front.
+    struct Record
+    {
+        std::chrono::system_clock::time_point time;
+        Level level = Level::Info;
+        Subsystem subsystem = Subsystem::App;
+        std::string text;
+    };
+
+    //single producer (the thread that owns it), single consumer (the writer).
+    //head and tail only ever grow; the slot is index % capacity.
+    struct Ring
+    {
+        static constexpr size_t capacity = 4096;
+        std::array<Record, capacity> slots;
+        std::atomic<size_t> head{0}; // next slot the writer reads
+        std::atomic<size_t> tail{0}; // next slot the owner writes
+        std::atomic<bool> abandoned{false}; // the owning thread exited
+    };
+
+    static std::vector<std::shared_ptr<Ring>> rings; // every thread that ever logged
+    static std::mutex rings_mutex; // only taken when a thread logs for the first time, and by the writer
+
+    static std::array<std::atomic<int>, static_cast<size_t>(Subsystem::Count)> levels = {
+        static_cast<int>(Level::Info), static_cast<int>(Level::Info), static_cast<int>(Level::Info), static_cast<int>(Level::Info)};
+
+    static std::atomic<bool> running{false};
+    static std::thread writer;
+
+    //keys whose values are secrets. Compared case-insensitively.
+    static bool isSecret(std::string_view key)
+    {
+        static const std::string_view secrets[] = {"password", "plain_password", "password_hash", "sessionid", "session_id", "cookie", "token", "secret", "body"};
+        for (std::string_view secret : secrets)
+        {
+            if (secret.size() == key.size())
+            {
+                bool same = true;
+                for (size_t i = 0; i < key.size() && same; ++i)
+                {
+                    same = std::tolower(static_cast<unsigned char>(key[i])) == secret[i];
+                }
+                if (same)
+                {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    Field::Field(std::string_view key, std::string_view value) : key(key), value(isSecret(key) ? "[redacted]" : std::string(value)) {}
+    Field::Field(std::string_view key, const char* value) : Field(key, std::string_view(value)) {}
+    Field::Field(std::string_view key, const std::string& value) : Field(key, std::string_view(value)) {}
+    Field::Field(std::string_view key, long long value) : key(key), value(std::to_string(value)) {}
+    Field::Field(std::string_view key, int value) : key(key), value(std::to_string(value)) {}
+
+    static const char* toString(Level level)
+    {
+        switch (level)
+        {
+            case Level::Debug: return "DEBUG";
+            case Level::Info: return "INFO";
+            case Level::Warning: return "WARNING";
+            case Level::Error: return "ERROR";
+            default: return "CRITICAL";
+        }
+    }
+
+    static const char* toString(Subsystem subsystem)
+    {
+        switch (subsystem)
+        {
+            case Subsystem::Http: return "http";
+            case Subsystem::Auth: return "auth";
+            case Subsystem::Database: return "db";
+            default: return "app";
+        }
+    }
+
+    //every msg and field value goes out in double quotes, with quotes, backslashes and control characters
+    //escaped. Usernames and database errors end up in here, and a newline in one mustn't start a fake line.
+    static void appendQuoted(std::string& out, std::string_view value)
+    {
+        out += '"';
+        for (char c : value)
+        {
+            switch (c)
+            {
+                case '"': out += "\\\""; break;
+                case '\\': out += "\\\\"; break;
+                case '\n': out += "\\n"; break;
+                case '\r': out += "\\r"; break;
+                case '\t': out += "\\t"; break;
+                default:
+                    if (static_cast<unsigned char>(c) < 0x20 || c == 0x7f)
+                    {
+                        char escaped[8];
+                        std::snprintf(escaped, sizeof(escaped), "\\u%04x", static_cast<unsigned>(static_cast<unsigned char>(c)));
+                        out += escaped;
+                    }
+                    else
+                    {
+                        out += c;
+                    }
+            }
+        }
+        out += '"';
+    }
+
+    bool enabled(Subsystem subsystem, Level level)
+    {
+        return static_cast<int>(level) >= levels[static_cast<size_t>(subsystem)].load(std::memory_order_relaxed);
+    }
+
+    //the calling thread's ring. Created and registered the first time a thread logs.
+    static Ring& threadRing()
+    {
+        struct Owner
+        {
+            std::shared_ptr<Ring> ring = std::make_shared<Ring>();
+            Owner()
+            {
+                std::lock_guard<std::mutex> lock(rings_mutex);
+                rings.push_back(ring);
+            }
+            ~Owner()
+            {
+                //the writer still drains what's left and then forgets the ring
+                ring->abandoned.store(true, std::memory_order_release);
+            }
+        };
+        thread_local Owner owner;
+        return *owner.ring;
+    }
+
+    static void format(std::string& out, const Record& record)
+    {
+        std::time_t seconds = std::chrono::system_clock::to_time_t(record.time);
+        std::tm utc{};
+#ifdef _WIN32
+        gmtime_s(&utc, &seconds);
+#else
+        gmtime_r(&seconds, &utc);
+#endif
+        char stamp[32];
+        std::strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%SZ", &utc);
+
+        out += stamp;
+        out += " level=";
+        out += toString(record.level);
+        out += " subsystem=";
+        out += toString(record.subsystem);
+        out += " msg=";
+        out += record.text;
+        out += '\n';
+    }
+
+    static void push(Subsystem subsystem, Level level, std::string text)
+    {
+        if (!running.load(std::memory_order_acquire))
+        {
+            //no writer yet (startup, the prefork supervisor) or any more. Buffering would leave the line in this
+            //thread's ring for good, or hand a copy to every forked worker, so it is written out right here.
+            std::string out;
+            format(out, Record{std::chrono::system_clock::now(), level, subsystem, std::move(text)});
+            std::fwrite(out.data(), 1, out.size(), stderr);
+            std::fflush(stderr);
+            return;
+        }
+
+        static auto& dropped = metrics::counter("todo_log_lines_dropped_total");
+
+        Ring& ring = threadRing();
+        size_t tail = ring.tail.load(std::memory_order_relaxed);
+        if (tail - ring.head.load(std::memory_order_acquire) >= Ring::capacity)
+        {
+            //the writer is behind. Dropping a line is better than making a request wait for a disk.
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        Record& record = ring.slots[tail % Ring::capacity];
+        record.time = std::chrono::system_clock::now();
+        record.level = level;
+        record.subsystem = subsystem;
+        record.text = std::move(text);
+        ring.tail.store(tail + 1, std::memory_order_release);
+    }
+
+    void log(Subsystem subsystem, Level level, std::string_view message, std::initializer_list<Field> fields)
+    {
+        std::string text;
+        appendQuoted(text, message);
+        for (const Field& field : fields)
+        {
+            text += ' ';
+            text += field.key; // keys come from our own code, never from a request
+            text += '=';
+            appendQuoted(text, field.value);
+        }
+        push(subsystem, level, std::move(text));
+    }
+
+    bool setLevels(const std::string& spec)
+    {
+        auto parseLevel = [](std::string_view name, int& out)
+        {
+            const std::pair<std::string_view, Level> names[] = {
+                {"debug", Level::Debug}, {"info", Level::Info}, {"warning", Level::Warning}, {"error", Level::Error}, {"critical", Level::Critical}};
+            for (const auto& [n, l] : names)
+            {
+                if (n == name)
+                {
+                    out = static_cast<int>(l);
+                    return true;
+                }
+            }
+            return false;
+        };
+        const std::string_view subsystem_names[] = {"app", "http", "auth", "db"};
+
+        std::array<int, static_cast<size_t>(Subsystem::Count)> parsed;
+        for (size_t i = 0; i < parsed.size(); ++i)
+        {
+            parsed[i] = levels[i].load();
+        }
+
+        std::string_view rest = spec;
+        while (!rest.empty())
+        {
+            size_t comma = rest.find(',');
+            std::string_view item = rest.substr(0, comma);
+            rest = comma == std::string_view::npos ? std::string_view() : rest.substr(comma + 1);
+            if (item.empty())
+            {
+                continue;
+            }
+
+            size_t equals = item.find('=');
+            std::string_view who = equals == std::string_view::npos ? "*" : item.substr(0, equals);
+            std::string_view level_name = equals == std::string_view::npos ? item : item.substr(equals + 1);
+            int level = 0;
+            if (!parseLevel(level_name, level))
+            {
+                return false;
+            }
+
+            bool matched = false;
+            for (size_t i = 0; i < parsed.size(); ++i)
+            {
+                if (who == "*" || who == subsystem_names[i])
+                {
+                    parsed[i] = level;
+                    matched = true;
+                }
+            }
+            if (!matched)
+            {
+                return false;
+            }
+        }
+
+        for (size_t i = 0; i < parsed.size(); ++i)
+        {
+            levels[i].store(parsed[i], std::memory_order_relaxed);
+        }
+        //crow filters before our handler sees anything, so it has to let through what we want from app
+        crow::logger::setLogLevel(static_cast<crow::LogLevel>(parsed[static_cast<size_t>(Subsystem::App)]));
+        return true;
+    }
+
+    //writes everything currently buffered. Returns how many lines it wrote.
+    static size_t drain(std::string& out)
+    {
+        std::vector<std::shared_ptr<Ring>> snapshot;
+        {
+            std::lock_guard<std::mutex> lock(rings_mutex);
+            snapshot = rings;
+        }
+
+        size_t written = 0;
+        for (const auto& ring : snapshot)
+        {
+            size_t head = ring->head.load(std::memory_order_relaxed);
+            size_t tail = ring->tail.load(std::memory_order_acquire);
+            for (; head != tail; ++head)
+            {
+                Record& record = ring->slots[head % Ring::capacity];
+                format(out, record);
+                record.text.clear();
+                written++;
+            }
+            ring->head.store(head, std::memory_order_release);
+        }
+
+        //forget rings whose threads are gone and that we have emptied
+        std::lock_guard<std::mutex> lock(rings_mutex);
+        std::erase_if(rings, [](const std::shared_ptr<Ring>& ring)
+        {
+            return ring->abandoned.load(std::memory_order_acquire) &&
+                   ring->head.load(std::memory_order_relaxed) == ring->tail.load(std::memory_order_acquire);
+        });
+        return written;
+    }
+
+    static void flush(std::string& out)
+    {
+        if (!out.empty())
+        {
+            std::fwrite(out.data(), 1, out.size(), stderr);
+            std::fflush(stderr);
+            out.clear();
+        }
+    }
+
+    //CROW_LOG_* ends up here, which makes every existing log call asynchronous too
+    class CrowHandler : public crow::ILogHandler
+    {
+    public:
+        void log(const std::string& message, crow::LogLevel level) override
+        {
+            std::string text;
+            appendQuoted(text, message);
+            push(Subsystem::App, static_cast<Level>(static_cast<int>(level)), std::move(text));
+        }
+    };
+
+    void start()
+    {
+        static CrowHandler handler;
+        if (running.exchange(true))
+        {
+            return;
+        }
+        crow::logger::setHandler(&handler);
+
+        writer = std::thread([]()
+        {
+            std::string out;
+            while (running.load(std::memory_order_acquire))
+            {
+                if (drain(out) == 0)
+                {
+                    //nothing to do. A short sleep keeps the writer off the cpu without any producer ever signalling it.
+                    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+                }
+                flush(out);
+            }
+            drain(out);
+            flush(out);
+        });
+    }
+
+    void stop()
+    {
+        if (running.exchange(false) && writer.joinable())
+        {
+            writer.join();
+        }
+    }
+}
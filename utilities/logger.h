@@ -0,0 +1,62 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <initializer_list>
+#include "crow.h"
+
+
+namespace logging
+{
+    enum class Level
+    {
+        Debug,
+        Info,
+        Warning,
+        Error,
+        Critical
+    };
+
+    //every log line belongs to one of these, and each one has its own level (see setLevels)
+    enum class Subsystem
+    {
+        App,      // anything logged through CROW_LOG_*
+        Http,     // static files and request handling
+        Auth,
+        Database,
+        Count     // not a subsystem, just how many there are
+    };
+
+    //a key=value pair attached to a line. Values for keys like "password" or "sessionID" never reach the output.
+    struct Field
+    {
+        Field(std::string_view key, std::string_view value);
+        Field(std::string_view key, const char* value);
+        Field(std::string_view key, const std::string& value);
+        Field(std::string_view key, long long value);
+        Field(std::string_view key, int value);
+
+        std::string_view key;
+        std::string value;
+    };
+
+    //cheap check, safe to call from any thread. Use it to skip building expensive fields.
+    bool enabled(Subsystem subsystem, Level level);
+
+    //formats the line on the calling thread and hands it to the background writer.
+    //never blocks and never does I/O. If this thread's buffer is full the line is dropped and counted.
+    void log(Subsystem subsystem, Level level, std::string_view message, std::initializer_list<Field> fields = {});
+
+    inline void debug(Subsystem s, std::string_view m, std::initializer_list<Field> f = {}) { if (enabled(s, Level::Debug)) log(s, Level::Debug, m, f); }
+    inline void info(Subsystem s, std::string_view m, std::initializer_list<Field> f = {}) { if (enabled(s, Level::Info)) log(s, Level::Info, m, f); }
+    inline void warning(Subsystem s, std::string_view m, std::initializer_list<Field> f = {}) { if (enabled(s, Level::Warning)) log(s, Level::Warning, m, f); }
+    inline void error(Subsystem s, std::string_view m, std::initializer_list<Field> f = {}) { if (enabled(s, Level::Error)) log(s, Level::Error, m, f); }
+
+    //"info" or "*=info,db=debug,auth=warning". Subsystem names are app, http, auth and db.
+    //returns false (and changes nothing) if the spec doesn't parse.
+    bool setLevels(const std::string& spec);
+
+    //starts the writer thread and routes CROW_LOG_* through it
+    void start();
+    //writes out whatever is still buffered and stops the writer thread
+    void stop();
+}
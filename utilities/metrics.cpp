@@ -0,0 +1,34 @@
+#include "metrics.h"
+#include <map>
+#include <mutex>
+#include <memory>
+
+namespace metrics
+{
+    //the map owns the atomics through unique_ptr so their addresses never move
+    static std::map<std::string, std::unique_ptr<std::atomic<uint64_t>>> counters;
+    static std::mutex counters_mutex;
+
+    std::atomic<uint64_t>& counter(const std::string& name)
+    {
+        std::lock_guard<std::mutex> lock(counters_mutex);
+        auto& slot = counters[name];
+        if (!slot)
+        {
+            slot = std::make_unique<std::atomic<uint64_t>>(0);
+        }
+        return *slot;
+    }
+
+    std::string render()
+    {
+        std::lock_guard<std::mutex> lock(counters_mutex);
+        std::string out;
+        for (const auto& [name, value] : counters)
+        {
+            out += "# TYPE " + name + " counter\n";
+            out += name + " " + std::to_string(value->load(std::memory_order_relaxed)) + "\n";
+        }
+        return out;
+    }
+}
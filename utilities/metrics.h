@@ -0,0 +1,17 @@
+#pragma once
+#include <string>
+#include <atomic>
+#include <cstdint>
+
+
+namespace metrics
+{
+    //returns the counter with this name, creating it the first time.
+    //the reference stays valid for the life of the program, so callers can keep it in a static:
+    //    static auto& served = metrics::counter("todo_things_served_total");
+    //    served.fetch_add(1, std::memory_order_relaxed);
+    std::atomic<uint64_t>& counter(const std::string& name);
+
+    //all counters in the prometheus text format, sorted by name
+    std::string render();
+}
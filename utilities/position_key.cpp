@@ -0,0 +1,230 @@
+#include "position_key.h"
+#include <stdexcept>
+#include <cmath>
+
+namespace positionKey
+{
+    //base 62 in ascii order, so comparing keys as bytes compares the numbers
+    static constexpr std::string_view digits = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+    //the lowest integer there is. It can't be counted down, so keys below it only get a fraction.
+    static const std::string smallest_integer = "A" + std::string(26, '0');
+
+    static int digitValue(char c)
+    {
+        size_t at = digits.find(c);
+        if (at == std::string_view::npos)
+        {
+            throw std::invalid_argument("invalid character in position key");
+        }
+        return static_cast<int>(at);
+    }
+
+    //a key strictly between two fractions. upper empty means 1. Neither may end in '0', or there would be
+    //no key between "x" and "x0".
+    static std::string midpoint(std::string_view lower, std::optional<std::string_view> upper)
+    {
+        if (upper.has_value())
+        {
+            //copy the common prefix (lower counts as padded with zeros) and split what's left
+            size_t n = 0;
+            while (n < upper->size() && (n < lower.size() ? lower[n] : '0') == (*upper)[n])
+            {
+                n++;
+            }
+            if (n > 0)
+            {
+                return std::string(upper->substr(0, n)) + midpoint(lower.substr(std::min(n, lower.size())), upper->substr(n));
+            }
+        }
+
+        int digit_lower = lower.empty() ? 0 : digitValue(lower[0]);
+        int digit_upper = upper.has_value() ? digitValue((*upper)[0]) : static_cast<int>(digits.size());
+        if (digit_upper - digit_lower > 1)
+        {
+            return std::string(1, digits[static_cast<size_t>(std::lround(0.5 * (digit_lower + digit_upper)))]);
+        }
+        //the first digits are neighbours
+        if (upper.has_value() && upper->size() > 1)
+        {
+            return std::string(1, (*upper)[0]);
+        }
+        return std::string(1, digits[digit_lower]) + midpoint(lower.empty() ? lower : lower.substr(1), std::nullopt);
+    }
+
+    static size_t integerLength(char head)
+    {
+        if (head >= 'a' && head <= 'z')
+        {
+            return static_cast<size_t>(head - 'a' + 2);
+        }
+        if (head >= 'A' && head <= 'Z')
+        {
+            return static_cast<size_t>('Z' - head + 2);
+        }
+        throw std::invalid_argument("invalid position key head");
+    }
+
+    static std::string_view integerPart(std::string_view key)
+    {
+        if (key.empty() || integerLength(key[0]) > key.size())
+        {
+            throw std::invalid_argument("invalid position key");
+        }
+        return key.substr(0, integerLength(key[0]));
+    }
+
+    static void validate(std::string_view key)
+    {
+        std::string_view integer = integerPart(key);
+        if (key == smallest_integer || (key.size() > integer.size() && key.back() == '0'))
+        {
+            throw std::invalid_argument("invalid position key");
+        }
+        for (char c : key.substr(1))
+        {
+            digitValue(c);
+        }
+    }
+
+    //the next integer, or nullopt past the largest one ("z" followed by 26 'z's)
+    static std::optional<std::string> increment(std::string_view integer)
+    {
+        char head = integer[0];
+        std::string body(integer.substr(1));
+        for (size_t i = body.size(); i-- > 0;)
+        {
+            int d = digitValue(body[i]) + 1;
+            if (d < static_cast<int>(digits.size()))
+            {
+                body[i] = digits[d];
+                return head + body;
+            }
+            body[i] = digits[0];
+        }
+        //carried out of every digit: the integer needs one more digit (or one less for the negative ones)
+        if (head == 'Z')
+        {
+            return std::string("a") + digits[0];
+        }
+        if (head == 'z')
+        {
+            return std::nullopt;
+        }
+        head++;
+        if (head > 'a')
+        {
+            body.push_back(digits[0]);
+        }
+        else
+        {
+            body.pop_back();
+        }
+        return head + body;
+    }
+
+    static std::optional<std::string> decrement(std::string_view integer)
+    {
+        char head = integer[0];
+        std::string body(integer.substr(1));
+        for (size_t i = body.size(); i-- > 0;)
+        {
+            int d = digitValue(body[i]) - 1;
+            if (d >= 0)
+            {
+                body[i] = digits[d];
+                return head + body;
+            }
+            body[i] = digits.back();
+        }
+        if (head == 'a')
+        {
+            return std::string("Z") + digits.back();
+        }
+        if (head == 'A')
+        {
+            return std::nullopt;
+        }
+        head--;
+        if (head < 'Z')
+        {
+            body.push_back(digits.back());
+        }
+        else
+        {
+            body.pop_back();
+        }
+        return head + body;
+    }
+
+    std::string between(const std::optional<std::string_view>& lower, const std::optional<std::string_view>& upper)
+    {
+        if (lower.has_value())
+        {
+            validate(*lower);
+        }
+        if (upper.has_value())
+        {
+            validate(*upper);
+        }
+        if (lower.has_value() && upper.has_value() && *lower >= *upper)
+        {
+            throw std::invalid_argument("position keys out of order");
+        }
+
+        if (!lower.has_value())
+        {
+            if (!upper.has_value())
+            {
+                return std::string("a") + digits[0];
+            }
+            std::string_view integer = integerPart(*upper);
+            if (integer == smallest_integer)
+            {
+                return std::string(integer) + midpoint("", upper->substr(integer.size()));
+            }
+            if (integer < *upper)
+            {
+                return std::string(integer); // upper has a fraction, its integer alone sorts just before it
+            }
+            std::optional<std::string> before = decrement(integer);
+            if (!before.has_value())
+            {
+                throw std::invalid_argument("no position key below the smallest one");
+            }
+            return *before;
+        }
+
+        std::string_view integer_lower = integerPart(*lower);
+        std::string_view fraction_lower = lower->substr(integer_lower.size());
+        if (!upper.has_value())
+        {
+            std::optional<std::string> after = increment(integer_lower);
+            return after.has_value() ? *after : std::string(integer_lower) + midpoint(fraction_lower, std::nullopt);
+        }
+
+        std::string_view integer_upper = integerPart(*upper);
+        if (integer_lower == integer_upper)
+        {
+            return std::string(integer_lower) + midpoint(fraction_lower, upper->substr(integer_upper.size()));
+        }
+        std::optional<std::string> after = increment(integer_lower);
+        if (after.has_value() && *after < *upper)
+        {
+            return *after;
+        }
+        return std::string(integer_lower) + midpoint(fraction_lower, std::nullopt);
+    }
+
+    std::vector<std::string> sequence(size_t count)
+    {
+        std::vector<std::string> keys;
+        keys.reserve(count);
+        std::optional<std::string_view> previous;
+        for (size_t i = 0; i < count; i++)
+        {
+            keys.push_back(between(previous, std::nullopt));
+            previous = keys.back();
+        }
+        return keys;
+    }
+}
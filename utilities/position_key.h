@@ -0,0 +1,22 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <optional>
+#include <vector>
+
+
+//order keys for tasks. A key is a string that sorts correctly byte by byte (the column uses COLLATE "C"),
+//and there is always room for another key between two of them, so moving a task only rewrites that task.
+//the format is the usual fractional indexing one: an integer part whose first character gives its length
+//('a' is 2 characters, 'b' 3...; 'A'-'Z' the same for negative numbers), then an optional fraction.
+//appending or prepending just counts the integer up or down, so those keys stay short. Only dropping
+//tasks into the same gap over and over grows the fraction, and rebalancing fixes that.
+namespace positionKey
+{
+    //a key that sorts after lower and before upper. No lower means "before everything", no upper "after everything".
+    //throws std::invalid_argument if lower >= upper or either one isn't a valid key.
+    std::string between(const std::optional<std::string_view>& lower, const std::optional<std::string_view>& upper);
+
+    //count short keys in order, for giving every task of a user fresh positions
+    std::vector<std::string> sequence(size_t count);
+}
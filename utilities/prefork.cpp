@@ -0,0 +1,190 @@
+#include "prefork.h"
+#include "session_table.h"
+#include "idempotency.h"
+#include "config.h"
+#include "crow.h"
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <unordered_map>
+#include <cstdlib>
+#ifdef TODO_HAVE_REUSEPORT
+#include <csignal>
+#include <cerrno>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/prctl.h>
+#endif
+
+namespace prefork
+{
+    static std::atomic<bool> worker{false};
+
+    bool isWorker()
+    {
+        return worker.load(std::memory_order_relaxed);
+    }
+
+#ifdef TODO_HAVE_REUSEPORT
+    //a worker that dies this soon after starting is probably going to keep dying (bad config, port taken),
+    //so we wait a bit before starting the next one instead of forking in a tight loop
+    static constexpr auto crash_loop_window = std::chrono::seconds(1);
+
+    struct Worker
+    {
+        unsigned slot;
+        std::chrono::steady_clock::time_point started;
+    };
+
+    static pid_t spawn(unsigned slot, const sigset_t& original_mask, const std::function<int()>& serve)
+    {
+        pid_t pid = fork();
+        if (pid != 0)
+        {
+            return pid; // the supervisor, or -1
+        }
+
+        //the worker: take back the signals the supervisor blocked, and go down with the supervisor
+        //if it is killed outright so we never leave orphans holding the port.
+        //SIGHUP stays blocked: serve() blocks it again in config::watchReload anyway, and one forwarded by the
+        //supervisor before then would kill the worker. Blocked, it waits for watchReload's sigwait instead.
+        sigset_t worker_mask = original_mask;
+        sigaddset(&worker_mask, SIGHUP);
+        pthread_sigmask(SIG_SETMASK, &worker_mask, nullptr);
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        worker.store(true, std::memory_order_relaxed);
+        CROW_LOG_INFO << "Worker " << slot << " started, pid " << getpid();
+        std::exit(serve());
+    }
+
+    int run(unsigned workers, const std::function<int()>& serve)
+    {
+        //everything the supervisor reacts to is taken synchronously with sigwait, like config::watchReload does
+        sigset_t set;
+        sigset_t original_mask;
+        sigemptyset(&set);
+        sigaddset(&set, SIGCHLD);
+        sigaddset(&set, SIGTERM);
+        sigaddset(&set, SIGINT);
+        sigaddset(&set, SIGHUP);
+        pthread_sigmask(SIG_BLOCK, &set, &original_mask);
+
+        std::unordered_map<pid_t, Worker> running;
+        for (unsigned slot = 0; slot < workers; slot++)
+        {
+            pid_t pid = spawn(slot, original_mask, serve);
+            if (pid < 0)
+            {
+                CROW_LOG_CRITICAL << "fork failed for worker " << slot;
+                continue;
+            }
+            running[pid] = Worker{slot, std::chrono::steady_clock::now()};
+        }
+        CROW_LOG_INFO << "Supervisor " << getpid() << " running " << running.size() << " workers";
+
+        bool stopping = false;
+        while (!running.empty())
+        {
+            int signal = 0;
+            if (sigwait(&set, &signal) != 0)
+            {
+                continue;
+            }
+
+            if (signal == SIGHUP)
+            {
+                config::reload();
+                for (const auto& [pid, info] : running)
+                {
+                    kill(pid, SIGHUP);
+                }
+            }
+            else if (signal == SIGTERM || signal == SIGINT)
+            {
+                CROW_LOG_INFO << "Stopping " << running.size() << " workers";
+                stopping = true;
+                for (const auto& [pid, info] : running)
+                {
+                    kill(pid, SIGTERM); // crow shuts down cleanly on SIGTERM
+                }
+            }
+            else if (signal == SIGCHLD)
+            {
+                int status = 0;
+                pid_t pid;
+                while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+                {
+                    auto it = running.find(pid);
+                    if (it == running.end())
+                    {
+                        continue;
+                    }
+                    Worker info = it->second;
+                    running.erase(it);
+
+                    //a worker killed halfway through storing a session would leave its slot claimed forever,
+                    //and one killed halfway through an idempotent request would leave its key answering 409
+                    size_t released = sessionTable::releaseClaims(pid);
+                    idempotency::releaseClaims(pid);
+                    if (stopping)
+                    {
+                        continue;
+                    }
+
+                    if (WIFSIGNALED(status))
+                    {
+                        CROW_LOG_ERROR << "Worker " << info.slot << " (pid " << pid << ") killed by signal " << WTERMSIG(status)
+                                       << ", released " << released << " session slots, restarting it";
+                    }
+                    else
+                    {
+                        CROW_LOG_WARNING << "Worker " << info.slot << " (pid " << pid << ") exited with " << WEXITSTATUS(status) << ", restarting it";
+                    }
+                    if (std::chrono::steady_clock::now() - info.started < crash_loop_window)
+                    {
+                        std::this_thread::sleep_for(crash_loop_window);
+                    }
+
+                    pid_t replacement = spawn(info.slot, original_mask, serve);
+                    if (replacement < 0)
+                    {
+                        CROW_LOG_CRITICAL << "fork failed, running one worker short";
+                        continue;
+                    }
+                    running[replacement] = Worker{info.slot, std::chrono::steady_clock::now()};
+                }
+            }
+        }
+        CROW_LOG_INFO << "All workers stopped";
+        return 0;
+    }
+#else
+    int run(unsigned workers, const std::function<int()>& serve)
+    {
+        CROW_LOG_WARNING << "workers = " << workers << " needs SO_REUSEPORT (linux), running a single process instead";
+        return serve();
+    }
+#endif
+}
+
+#ifdef TODO_HAVE_REUSEPORT
+//crow creates and binds its acceptor itself and has no option for SO_REUSEPORT, which every worker's
+//listening socket needs before bind() or only the first one gets the port. The executable is linked with
+//--wrap=bind (see CMakeLists.txt), so the bind() inside crow's header-only asio code lands here first.
+extern "C" int __real_bind(int fd, const struct sockaddr* address, socklen_t length);
+
+extern "C" int __wrap_bind(int fd, const struct sockaddr* address, socklen_t length)
+{
+    int type = 0;
+    socklen_t type_length = sizeof(type);
+    if (prefork::isWorker() && address != nullptr && (address->sa_family == AF_INET || address->sa_family == AF_INET6) &&
+        getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &type_length) == 0 && type == SOCK_STREAM)
+    {
+        int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+    }
+    return __real_bind(fd, address, length);
+}
+#endif
@@ -0,0 +1,19 @@
+#pragma once
+#include <functional>
+
+
+//prefork mode: one supervisor process and N workers, each a full server with its own threads and
+//connection pool. They all listen on the same port with SO_REUSEPORT and the kernel spreads new
+//connections between them. Sessions are shared through sessionTable; everything else (caches,
+//admission limits, read-your-writes pinning) is per worker.
+namespace prefork
+{
+    //true in a worker started by run()
+    bool isWorker();
+
+    //forks workers processes that each return serve() as their exit code, and keeps that many running:
+    //one that exits or crashes is replaced. SIGTERM/SIGINT stop every worker and then run() returns,
+    //SIGHUP reloads the config here (for workers started later) and is passed on to every worker.
+    //must be called before any thread exists. Without SO_REUSEPORT support it just calls serve().
+    int run(unsigned workers, const std::function<int()>& serve);
+}
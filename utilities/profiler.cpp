@@ -0,0 +1,545 @@
+#include "profiler.h"
+#include <atomic>
+#include <chrono>
+#include <thread>
+#ifdef TODO_HAVE_PROFILER
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <unordered_map>
+#include <vector>
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <sys/time.h>
+#endif
+
+#ifdef TODO_HAVE_PROFILER
+namespace profiler
+{
+    //set while a heap profile runs. Read by operator new below on every allocation, which is all it costs otherwise.
+    //While it is set every allocation also counts down a thread local byte budget, and only the ones that use it
+    //up are recorded (see recordAllocation).
+    static std::atomic<bool> heap_recording{false};
+    [[gnu::noinline]] static void recordAllocation(size_t size);
+}
+
+//replaces the global operator new of the whole program (new[], nothrow and the sized variants all end up here),
+//so /debug/heap can see allocations without a custom allocator anywhere. delete stays the default, which frees.
+void* operator new(std::size_t size)
+{
+    if (profiler::heap_recording.load(std::memory_order_relaxed)) [[unlikely]]
+    {
+        profiler::recordAllocation(size);
+    }
+    if (size == 0)
+    {
+        size = 1;
+    }
+    while (true)
+    {
+        void* memory = std::malloc(size);
+        if (memory != nullptr)
+        {
+            return memory;
+        }
+        std::new_handler handler = std::get_new_handler();
+        if (handler == nullptr)
+        {
+            throw std::bad_alloc();
+        }
+        handler();
+    }
+}
+
+void operator delete(void* memory) noexcept
+{
+    std::free(memory);
+}
+
+void operator delete(void* memory, std::size_t) noexcept
+{
+    std::free(memory);
+}
+#endif
+
+namespace profiler
+{
+#ifdef TODO_HAVE_PROFILER
+    bool supported()
+    {
+        return true;
+    }
+
+    //turns a code address into a function name. Only exported symbols have names (the executable is linked with
+    //--export-dynamic for this), static functions come out as binary+offset, which addr2line can still resolve.
+    static std::string symbolize(void* address)
+    {
+        Dl_info info;
+        if (dladdr(address, &info) == 0)
+        {
+            char text[32];
+            std::snprintf(text, sizeof(text), "%p", address);
+            return text;
+        }
+        std::string name;
+        if (info.dli_sname != nullptr)
+        {
+            int status = 0;
+            char* demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+            name = status == 0 && demangled != nullptr ? demangled : info.dli_sname;
+            std::free(demangled);
+        }
+        else
+        {
+            const char* file = info.dli_fname != nullptr ? info.dli_fname : "?";
+            const char* slash = std::strrchr(file, '/');
+            char offset[32];
+            std::snprintf(offset, sizeof(offset), "+0x%zx", static_cast<size_t>(static_cast<char*>(address) - static_cast<char*>(info.dli_fbase)));
+            name = std::string(slash != nullptr ? slash + 1 : file) + offset;
+        }
+        //; separates frames in the folded format
+        std::replace(name.begin(), name.end(), ';', ':');
+        return name;
+    }
+
+    //the same address comes up in thousands of stacks, dladdr and demangling it every time would take longer than the profile
+    class Symbols
+    {
+    public:
+        const std::string& name(void* address)
+        {
+            auto it = names.find(address);
+            if (it == names.end())
+            {
+                it = names.emplace(address, symbolize(address)).first;
+            }
+            return it->second;
+        }
+
+    private:
+        std::unordered_map<void*, std::string> names;
+    };
+
+    //the first backtrace() loads libgcc's unwinder, which allocates and takes locks. Neither is allowed in a signal
+    //handler or inside operator new, so it is done once up front.
+    static void warmUpBacktrace()
+    {
+        static std::once_flag once;
+        std::call_once(once, []()
+        {
+            void* frames[4];
+            backtrace(frames, 4);
+        });
+    }
+
+    //---- cpu ----
+
+    static constexpr int cpu_max_depth = 64;
+    //the signal handler's own frame and the kernel's signal trampoline, above the interrupted function
+    static constexpr int cpu_skip_frames = 2;
+    //about 34 MiB of stacks
+    static constexpr size_t cpu_max_samples = 65536;
+
+    struct CpuSample
+    {
+        int depth;
+        void* frames[cpu_max_depth];
+    };
+
+    static std::atomic<bool> cpu_running{false};
+    static std::atomic<bool> cpu_sampling{false};
+    static std::atomic<int> cpu_in_handler{0};
+    static std::atomic<size_t> cpu_taken{0};
+    static CpuSample* cpu_samples = nullptr;
+    static size_t cpu_capacity = 0;
+
+    //runs on whichever thread was using the cpu when the timer expired. Only async-signal-safe work in here:
+    //claim a slot with an atomic and let backtrace() fill it.
+    static void onProf(int, siginfo_t*, void*)
+    {
+        int saved_errno = errno;
+        //in_handler goes up before sampling is checked, so once cpu() has cleared sampling and seen in_handler at 0
+        //no handler can still be writing into the buffer
+        cpu_in_handler.fetch_add(1);
+        if (cpu_sampling.load())
+        {
+            size_t slot = cpu_taken.fetch_add(1, std::memory_order_relaxed);
+            if (slot < cpu_capacity)
+            {
+                cpu_samples[slot].depth = backtrace(cpu_samples[slot].frames, cpu_max_depth);
+            }
+        }
+        cpu_in_handler.fetch_sub(1);
+        errno = saved_errno;
+    }
+
+    //the handler stays installed after the first profile: a SIGPROF still in flight when the timer is stopped
+    //would otherwise hit the default action and kill the process
+    static void installHandler()
+    {
+        static std::once_flag once;
+        std::call_once(once, []()
+        {
+            struct sigaction action{};
+            action.sa_sigaction = onProf;
+            action.sa_flags = SA_SIGINFO | SA_RESTART;
+            sigemptyset(&action.sa_mask);
+            sigaction(SIGPROF, &action, nullptr);
+        });
+    }
+
+    static void setTimer(int hz)
+    {
+        itimerval timer{};
+        if (hz > 0)
+        {
+            timer.it_interval.tv_sec = 0;
+            timer.it_interval.tv_usec = 1000000 / hz;
+            timer.it_value = timer.it_interval;
+        }
+        setitimer(ITIMER_PROF, &timer, nullptr);
+    }
+
+    std::optional<std::string> cpu(int seconds, int hz)
+    {
+        if (cpu_running.exchange(true))
+        {
+            return std::nullopt;
+        }
+
+        //every core busy for the whole time is the most samples we can get, past cpu_max_samples the rest are dropped
+        size_t capacity = static_cast<size_t>(seconds) * static_cast<size_t>(hz) * std::max(1u, std::thread::hardware_concurrency());
+        capacity = std::min(capacity, cpu_max_samples);
+        std::unique_ptr<CpuSample[]> samples(new CpuSample[capacity]);
+        cpu_samples = samples.get();
+        cpu_capacity = capacity;
+        cpu_taken.store(0, std::memory_order_relaxed);
+        warmUpBacktrace();
+        installHandler();
+
+        //ITIMER_PROF counts the cpu time of the whole process and linux sends the signal to the thread that was running,
+        //so every thread is sampled in proportion to the cpu it uses. This thread only sleeps and won't show up.
+        cpu_sampling.store(true);
+        setTimer(hz);
+        std::this_thread::sleep_for(std::chrono::seconds(seconds));
+        setTimer(0);
+        cpu_sampling.store(false);
+        while (cpu_in_handler.load() != 0)
+        {
+            std::this_thread::yield();
+        }
+
+        size_t taken = std::min(cpu_taken.load(std::memory_order_relaxed), capacity);
+        Symbols symbols;
+        std::map<std::string, size_t> folded;
+        std::string stack;
+        for (size_t i = 0; i < taken; i++)
+        {
+            const CpuSample& sample = samples[i];
+            stack.clear();
+            //backtrace() lists the innermost frame first, folded stacks start at the root
+            for (int frame = sample.depth - 1; frame >= cpu_skip_frames; frame--)
+            {
+                if (!stack.empty())
+                {
+                    stack += ';';
+                }
+                //return addresses point after the call, one byte back keeps us inside the calling function.
+                //The innermost frame is the interrupted instruction itself.
+                char* address = static_cast<char*>(sample.frames[frame]);
+                stack += symbols.name(frame == cpu_skip_frames ? address : address - 1);
+            }
+            if (!stack.empty())
+            {
+                folded[stack]++;
+            }
+        }
+
+        std::string out;
+        for (const auto& [line, count] : folded)
+        {
+            out += line;
+            out += ' ';
+            out += std::to_string(count);
+            out += '\n';
+        }
+        size_t lost = cpu_taken.load(std::memory_order_relaxed) - taken;
+        if (lost > 0)
+        {
+            CROW_LOG_WARNING << "CPU profile dropped " << lost << " samples over its buffer";
+        }
+        cpu_samples = nullptr;
+        cpu_capacity = 0;
+        cpu_running.store(false);
+        return out;
+    }
+
+    //---- heap ----
+
+    static constexpr int heap_max_depth = 32;
+    //recordAllocation and operator new, above whoever called new
+    static constexpr int heap_skip_frames = 2;
+    //distinct stacks kept per profile. Samples from stacks that don't fit are only counted as dropped.
+    static constexpr size_t heap_slots = 16384;
+    static constexpr size_t heap_max_probe = 64;
+    //one allocation is sampled per this many bytes allocated on a thread, on average. Taking the stack and the
+    //lock for every allocation slowed every thread down for as long as a profile ran; this way a thread stops
+    //about once per 512 KiB, and the numbers are scaled back up (see weight below).
+    static constexpr size_t heap_sample_bytes = 512 * 1024;
+
+    struct HeapStack
+    {
+        uint64_t hash;
+        int depth;
+        void* frames[heap_max_depth];
+        uint64_t samples; // 0 for an unused slot
+        double count;     // estimated allocations and bytes behind the samples
+        double bytes;
+    };
+
+    static std::atomic<bool> heap_running{false};
+    static std::mutex heap_mutex;
+    //allocated the first time a heap profile runs and kept, stragglers that passed the heap_recording check
+    //just before it was cleared may still be on their way to it
+    static HeapStack* heap_stacks = nullptr;
+    static uint64_t heap_dropped = 0;
+    //operator new called from inside recordAllocation (or anything it calls) is not recorded again
+    static thread_local bool in_record = false;
+    //bytes this thread may still allocate before the next sample, and the generator that picks the gaps.
+    //Plain integers, so touching them never allocates.
+    static thread_local int64_t heap_countdown = 0;
+    static thread_local uint64_t heap_random = 0;
+
+    //the gap to the next sample is drawn from an exponential distribution with a mean of heap_sample_bytes,
+    //which makes every byte equally likely to be sampled no matter how the allocations are sized or spaced
+    static int64_t nextSampleGap()
+    {
+        if (heap_random == 0)
+        {
+            heap_random = reinterpret_cast<uintptr_t>(&heap_random) ^ static_cast<uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+            heap_random |= 1;
+        }
+        //xorshift64*
+        heap_random ^= heap_random >> 12;
+        heap_random ^= heap_random << 25;
+        heap_random ^= heap_random >> 27;
+        double uniform = static_cast<double>(((heap_random * 2685821657736338717ull) >> 11) + 1) * 0x1.0p-53; // (0, 1]
+        return static_cast<int64_t>(-std::log(uniform) * heap_sample_bytes) + 1;
+    }
+
+    //FNV-1a over the frame addresses
+    static uint64_t hashFrames(void* const* frames, int depth)
+    {
+        uint64_t hash = 14695981039346656037ull;
+        for (int i = 0; i < depth; i++)
+        {
+            hash ^= reinterpret_cast<uintptr_t>(frames[i]);
+            hash *= 1099511628211ull;
+        }
+        return hash;
+    }
+
+    [[gnu::noinline]] static void recordAllocation(size_t size)
+    {
+        if (in_record)
+        {
+            return;
+        }
+        if (heap_random == 0)
+        {
+            //this thread's first allocation since it started, start counting without sampling it
+            heap_countdown = nextSampleGap();
+        }
+        heap_countdown -= static_cast<int64_t>(size);
+        if (heap_countdown > 0) [[likely]]
+        {
+            return;
+        }
+        heap_countdown = nextSampleGap();
+        //an allocation of size bytes is sampled with probability 1 - e^(-size / heap_sample_bytes), so one sample
+        //stands for 1 / that many allocations like it
+        double weight = 1.0 / -std::expm1(-static_cast<double>(size) / heap_sample_bytes);
+
+        in_record = true;
+        void* frames[heap_max_depth + heap_skip_frames];
+        int depth = backtrace(frames, heap_max_depth + heap_skip_frames) - heap_skip_frames;
+        if (depth > 0)
+        {
+            void* const* stack = frames + heap_skip_frames;
+            uint64_t hash = hashFrames(stack, depth);
+            std::lock_guard<std::mutex> lock(heap_mutex);
+            if (heap_recording.load(std::memory_order_relaxed))
+            {
+                bool stored = false;
+                for (size_t probe = 0; probe < heap_max_probe && !stored; probe++)
+                {
+                    HeapStack& slot = heap_stacks[(hash + probe) % heap_slots];
+                    if (slot.samples == 0)
+                    {
+                        slot.hash = hash;
+                        slot.depth = depth;
+                        std::memcpy(slot.frames, stack, sizeof(void*) * static_cast<size_t>(depth));
+                    }
+                    else if (slot.hash != hash || slot.depth != depth || std::memcmp(slot.frames, stack, sizeof(void*) * static_cast<size_t>(depth)) != 0)
+                    {
+                        continue;
+                    }
+                    slot.samples++;
+                    slot.count += weight;
+                    slot.bytes += weight * static_cast<double>(size);
+                    stored = true;
+                }
+                if (!stored)
+                {
+                    heap_dropped++;
+                }
+            }
+        }
+        in_record = false;
+    }
+
+    //the code we want allocations charged to. Route handlers are lambdas inside taskRoutes/authRoutes/opsRoutes
+    //and demangle as e.g. "taskRoutes(crow::App<crow::CookieParser>&)::{lambda(crow::request const&)#1}::operator()..."
+    static bool ourCode(const std::string& name)
+    {
+        static const char* const prefixes[] = {
+            "database::", "AuthHandle::", "taskRoutes(", "authRoutes(", "opsRoutes(",
+            "idempotency::", "requestBody::", "admission::", "reminders::", "taskIO::",
+        };
+        for (const char* prefix : prefixes)
+        {
+            if (name.starts_with(prefix))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    struct SiteTotal
+    {
+        double count = 0;
+        double bytes = 0;
+    };
+
+    std::optional<crow::json::wvalue> heap(int seconds, size_t top)
+    {
+        if (heap_running.exchange(true))
+        {
+            return std::nullopt;
+        }
+        warmUpBacktrace();
+        {
+            std::lock_guard<std::mutex> lock(heap_mutex);
+            if (heap_stacks == nullptr)
+            {
+                heap_stacks = new HeapStack[heap_slots];
+            }
+            std::memset(heap_stacks, 0, sizeof(HeapStack) * heap_slots);
+            heap_dropped = 0;
+        }
+
+        heap_recording.store(true, std::memory_order_relaxed);
+        std::this_thread::sleep_for(std::chrono::seconds(seconds));
+        heap_recording.store(false, std::memory_order_relaxed);
+
+        //copied out under the lock and symbolized after, symbolizing allocates and would be recorded otherwise
+        std::vector<HeapStack> stacks;
+        uint64_t dropped = 0;
+        {
+            std::lock_guard<std::mutex> lock(heap_mutex);
+            for (size_t i = 0; i < heap_slots; i++)
+            {
+                if (heap_stacks[i].samples > 0)
+                {
+                    stacks.push_back(heap_stacks[i]);
+                }
+            }
+            dropped = heap_dropped;
+        }
+
+        //a site is the innermost frame of our own code on the stack, so an allocation deep inside pqxx or
+        //std::string is charged to the database:: function that asked for it
+        Symbols symbols;
+        std::map<std::string, SiteTotal> sites;
+        SiteTotal other;
+        SiteTotal total;
+        uint64_t samples = 0;
+        for (const HeapStack& stack : stacks)
+        {
+            samples += stack.samples;
+            total.count += stack.count;
+            total.bytes += stack.bytes;
+            const std::string* site = nullptr;
+            for (int frame = 0; frame < stack.depth && site == nullptr; frame++)
+            {
+                const std::string& name = symbols.name(static_cast<char*>(stack.frames[frame]) - 1);
+                if (ourCode(name))
+                {
+                    site = &name;
+                }
+            }
+            SiteTotal& into = site != nullptr ? sites[*site] : other;
+            into.count += stack.count;
+            into.bytes += stack.bytes;
+        }
+
+        std::vector<std::pair<std::string, SiteTotal>> ranked(sites.begin(), sites.end());
+        std::sort(ranked.begin(), ranked.end(), [](const auto& a, const auto& b) { return a.second.bytes > b.second.bytes; });
+        if (ranked.size() > top)
+        {
+            ranked.resize(top);
+        }
+
+        //the counts are estimates scaled up from the samples, rounded for the report
+        auto rounded = [](double value) { return static_cast<uint64_t>(std::llround(value)); };
+        crow::json::wvalue report;
+        report["seconds"] = seconds;
+        report["sample_bytes"] = static_cast<uint64_t>(heap_sample_bytes);
+        report["samples"] = samples;
+        report["allocations"] = rounded(total.count);
+        report["bytes"] = rounded(total.bytes);
+        crow::json::wvalue::list list;
+        for (const auto& [name, site] : ranked)
+        {
+            crow::json::wvalue entry;
+            entry["site"] = name;
+            entry["allocations"] = rounded(site.count);
+            entry["bytes"] = rounded(site.bytes);
+            list.push_back(std::move(entry));
+        }
+        report["sites"] = std::move(list);
+        report["other"]["allocations"] = rounded(other.count);
+        report["other"]["bytes"] = rounded(other.bytes);
+        //samples from more distinct stacks than heap_slots, not in any of the numbers above
+        report["dropped"] = dropped;
+        heap_running.store(false);
+        return report;
+    }
+#else
+    bool supported()
+    {
+        return false;
+    }
+
+    std::optional<std::string> cpu(int, int)
+    {
+        return std::nullopt;
+    }
+
+    std::optional<crow::json::wvalue> heap(int, size_t)
+    {
+        return std::nullopt;
+    }
+#endif
+}
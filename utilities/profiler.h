@@ -0,0 +1,29 @@
+#pragma once
+#include "crow.h"
+#include <string>
+#include <optional>
+#include <cstddef>
+
+
+//on-demand profiling of a running server, served by /debug/profile and /debug/heap (see ops_routes.cpp).
+//Nothing is sampled or recorded unless one of those is running. Both only see the process they run in,
+//so with workers > 1 you profile whichever worker the request landed on.
+//Only available on linux (TODO_HAVE_PROFILER).
+namespace profiler
+{
+    //false where this was built without profiling support, cpu() and heap() then always return std::nullopt
+    bool supported();
+
+    //samples the call stacks of every thread with SIGPROF, hz times per second of cpu time, for the given
+    //number of seconds and returns them in the folded format ("outer;inner;leaf 42" per line) that
+    //flamegraph.pl and speedscope read. Blocks the calling thread for the whole time.
+    //Returns std::nullopt if another cpu profile is already running or profiling isn't supported.
+    std::optional<std::string> cpu(int seconds, int hz);
+
+    //samples operator new for the given number of seconds, about once per 512 KiB allocated on each thread,
+    //and returns the estimated allocation count and bytes per call site in database::, AuthHandle and the
+    //route code, biggest first (top of them). Allocations made outside those are summed up as "other".
+    //The estimates are scaled up from the samples, so sites that allocate little can be missing or rough.
+    //Returns std::nullopt if another heap profile is already running or profiling isn't supported.
+    std::optional<crow::json::wvalue> heap(int seconds, size_t top);
+}
@@ -1,4 +1,5 @@
 #include "readFile.h"
+#include "logger.h"
 
 namespace utilities
 {
@@ -8,10 +9,10 @@ namespace utilities
         if (file) {
             std::stringstream ss;
             ss << file.rdbuf();
-            CROW_LOG_INFO << "Successfully read file: " << filepath;
+            logging::debug(logging::Subsystem::Http, "Successfully read file", {{"path", filepath}}); // every asset serve ends up here, so debug only
             return ss.str();
         }
-        CROW_LOG_ERROR << "Failed to read file: " << filepath << ". File might not exist or path is incorrect.";
+        logging::error(logging::Subsystem::Http, "Failed to read file. File might not exist or path is incorrect.", {{"path", filepath}});
         return ""; // Return empty string if file not found
     }
 }
\ No newline at end of file
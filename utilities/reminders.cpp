@@ -0,0 +1,366 @@
+#include "reminders.h"
+#include "db_functions.h"
+#include "profile_cache.h"
+#include "config.h"
+#include "metrics.h"
+#include "logger.h"
+#include <pqxx/pqxx>
+#include <vector>
+#include <unordered_map>
+#include <optional>
+#include <algorithm>
+#include <functional>
+#include <charconv>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <utility>
+
+namespace reminders
+{
+    //longest the scheduler sleeps without a reason to wake up, so it notices a dead connection eventually
+    static constexpr long long max_wait_ms = 60000;
+
+    static long long nowMs()
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    //everything from here to the subscribers is only touched by the scheduler thread, so none of it is locked
+
+    //the reminder that currently counts for each task
+    struct Pending
+    {
+        long long due_ms;
+        int userID;
+    };
+    static std::unordered_map<int, Pending> pending;
+
+    //min-heap on due time. A change doesn't search the heap for the task's old entry, it pushes a new one and
+    //updates pending. Entries that don't match pending any more are skipped when they reach the top (lazy deletion).
+    struct Entry
+    {
+        long long due_ms;
+        int taskID;
+
+        bool operator>(const Entry& other) const
+        {
+            return due_ms > other.due_ms;
+        }
+    };
+    static std::vector<Entry> heap;
+
+    //where a reminder sits in the table's order: due time, then task id. Paging by the id too means tasks that
+    //share a due time can be split over two loads without any of them falling through the gap.
+    using Cursor = std::pair<long long, int>;
+
+    //when there are more than max_pending reminders only the soonest are kept. horizon is where those end:
+    //anything at or after it is only in the table, and is loaded once everything before it has fired.
+    static size_t max_pending = 0;
+    static std::optional<Cursor> horizon;
+
+    //every reminder due at or before this has been fired by this process. After a lost connection loading
+    //starts right after it, so nothing that fell due in between is skipped and nothing fires twice.
+    static std::optional<long long> fired_through;
+
+    static void rebuildHeap()
+    {
+        heap.clear();
+        heap.reserve(pending.size());
+        for (const auto& [taskID, reminder] : pending)
+        {
+            heap.push_back(Entry{reminder.due_ms, taskID});
+        }
+        std::make_heap(heap.begin(), heap.end(), std::greater<Entry>());
+    }
+
+    //keeps the soonest three quarters and pulls the horizon in front of the rest, so the next trim is a while off
+    static void trim()
+    {
+        std::vector<Cursor> keys;
+        keys.reserve(pending.size());
+        for (const auto& [taskID, reminder] : pending)
+        {
+            keys.push_back(Cursor{reminder.due_ms, taskID});
+        }
+        auto cut = keys.begin() + static_cast<std::ptrdiff_t>(max_pending * 3 / 4);
+        std::nth_element(keys.begin(), cut, keys.end());
+        horizon = *cut;
+        std::erase_if(pending, [](const auto& item) { return Cursor{item.second.due_ms, item.first} >= *horizon; });
+        rebuildHeap();
+    }
+
+    //a task's due time changed, nullopt means there is nothing to remind of any more
+    static void set(int taskID, int userID, std::optional<long long> due_ms)
+    {
+        if (!due_ms || (horizon && Cursor{*due_ms, taskID} >= *horizon))
+        {
+            //its heap entry goes stale. Past the horizon it comes back from the table when its turn is near.
+            pending.erase(taskID);
+            return;
+        }
+        pending[taskID] = Pending{*due_ms, userID};
+        heap.push_back(Entry{*due_ms, taskID});
+        std::push_heap(heap.begin(), heap.end(), std::greater<Entry>());
+
+        if (pending.size() > max_pending)
+        {
+            trim();
+        }
+        else if (heap.size() > 2 * pending.size() + 1024)
+        {
+            rebuildHeap(); // due times that keep changing leave stale entries behind, this drops them
+        }
+    }
+
+    //fills memory with the reminders from the given place in the table on. Only called with nothing pending.
+    static void load(Cursor from)
+    {
+        std::vector<Reminder> rows = database::getUpcomingReminders(from.first, from.second, static_cast<int>(max_pending));
+        horizon.reset();
+        if (rows.size() == max_pending && !rows.empty())
+        {
+            //there may be more. The last row becomes the horizon and is loaded again with the next lot,
+            //max_pending is at least 16 so this always leaves some to fire first.
+            horizon = Cursor{rows.back().due_ms, rows.back().taskID};
+            rows.pop_back();
+        }
+        for (const Reminder& reminder : rows)
+        {
+            pending[reminder.taskID] = Pending{reminder.due_ms, reminder.userID};
+        }
+        rebuildHeap();
+    }
+
+    //the next due time that still counts. Stale entries on top are thrown away on the way.
+    static std::optional<long long> nextDue()
+    {
+        while (!heap.empty())
+        {
+            auto it = pending.find(heap.front().taskID);
+            if (it != pending.end() && it->second.due_ms == heap.front().due_ms)
+            {
+                return heap.front().due_ms;
+            }
+            std::pop_heap(heap.begin(), heap.end(), std::greater<Entry>());
+            heap.pop_back();
+        }
+        return std::nullopt;
+    }
+
+    static std::vector<Reminder> takeDue(long long now_ms)
+    {
+        std::vector<Reminder> due;
+        while (std::optional<long long> next = nextDue())
+        {
+            if (*next > now_ms)
+            {
+                break;
+            }
+            int taskID = heap.front().taskID;
+            std::pop_heap(heap.begin(), heap.end(), std::greater<Entry>());
+            heap.pop_back();
+            due.push_back(Reminder{taskID, pending[taskID].userID, *next});
+            pending.erase(taskID);
+        }
+        return due;
+    }
+
+    static std::mutex subscribers_mutex;
+    static std::unordered_multimap<int, crow::websocket::connection*> subscribers;
+    static std::unordered_map<crow::websocket::connection*, int> subscriber_users;
+
+    void subscribe(int userID, crow::websocket::connection* conn)
+    {
+        std::lock_guard<std::mutex> lock(subscribers_mutex);
+        subscribers.emplace(userID, conn);
+        subscriber_users[conn] = userID;
+    }
+
+    void unsubscribe(crow::websocket::connection* conn)
+    {
+        std::lock_guard<std::mutex> lock(subscribers_mutex);
+        auto user = subscriber_users.find(conn);
+        if (user == subscriber_users.end())
+        {
+            return;
+        }
+        auto [first, last] = subscribers.equal_range(user->second);
+        for (auto it = first; it != last; ++it)
+        {
+            if (it->second == conn)
+            {
+                subscribers.erase(it);
+                break;
+            }
+        }
+        subscriber_users.erase(user);
+    }
+
+    static void deliver(const std::vector<Reminder>& due)
+    {
+        static auto& fired = metrics::counter("todo_reminders_fired_total");
+        static auto& delivered = metrics::counter("todo_reminders_delivered_total");
+        fired.fetch_add(due.size(), std::memory_order_relaxed);
+
+        //every worker fires every reminder, only the ones holding a websocket of the user look the task up
+        std::vector<int> wanted;
+        {
+            std::lock_guard<std::mutex> lock(subscribers_mutex);
+            for (const Reminder& reminder : due)
+            {
+                if (subscribers.count(reminder.userID) > 0)
+                {
+                    wanted.push_back(reminder.taskID);
+                }
+            }
+        }
+        if (wanted.empty())
+        {
+            return;
+        }
+
+        std::vector<DueTask> tasks;
+        try
+        {
+            tasks = database::getDueTasks(wanted);
+        }
+        catch (const std::exception& e)
+        {
+            logging::error(logging::Subsystem::Database, "Could not look up due tasks, their reminders are dropped", {{"count", static_cast<long long>(wanted.size())}, {"error", e.what()}});
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(subscribers_mutex); // keeps the connections from closing under us
+        for (const DueTask& due_task : tasks)
+        {
+            crow::json::wvalue message;
+            message["type"] = "reminder";
+            message["task"]["id"] = due_task.task.id;
+            message["task"]["description"] = due_task.task.description;
+            message["task"]["status"] = due_task.task.Tstatus;
+            message["task"]["due_at"] = due_task.task.due_at.value_or("");
+            std::string text = message.dump();
+
+            auto [first, last] = subscribers.equal_range(due_task.userID);
+            for (auto it = first; it != last; ++it)
+            {
+                it->second->send_text(text);
+                delivered.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    //payloads come from the notify_due statement: "<task id> <user id> <due ms>" or "<task id> <user id> -"
+    struct DueListener : pqxx::notification_receiver
+    {
+        explicit DueListener(pqxx::connection& C) : pqxx::notification_receiver(C, "task_due") {}
+
+        void operator()(const std::string& payload, int) override
+        {
+            long long fields[3] = {0, 0, 0};
+            bool cancelled = false;
+            const char* at = payload.data();
+            const char* end = payload.data() + payload.size();
+            for (int i = 0; i < 3; i++)
+            {
+                if (i == 2 && at < end && *at == '-')
+                {
+                    cancelled = true;
+                    break;
+                }
+                auto [next, ec] = std::from_chars(at, end, fields[i]);
+                if (ec != std::errc())
+                {
+                    CROW_LOG_WARNING << "Ignoring malformed task_due notification: " << payload;
+                    return;
+                }
+                at = next < end ? next + 1 : next; // past the space
+            }
+            set(static_cast<int>(fields[0]), static_cast<int>(fields[1]), cancelled ? std::nullopt : std::optional<long long>(fields[2]));
+        }
+    };
+
+    //payload is the id of a user that was deleted or renamed, from the users_changed trigger. It rides on the
+    //scheduler's connection because that is the one LISTEN connection each process already has.
+    struct UserListener : pqxx::notification_receiver
+    {
+        explicit UserListener(pqxx::connection& C) : pqxx::notification_receiver(C, "user_changed") {}
+
+        void operator()(const std::string& payload, int) override
+        {
+            int userID = 0;
+            auto [end, ec] = std::from_chars(payload.data(), payload.data() + payload.size(), userID);
+            if (ec != std::errc() || end != payload.data() + payload.size())
+            {
+                CROW_LOG_WARNING << "Ignoring malformed user_changed notification: " << payload;
+                return;
+            }
+            profileCache::invalidate(userID);
+        }
+    };
+
+    static void run()
+    {
+        int failures = 0;
+        while (true)
+        {
+            try
+            {
+                pqxx::connection listener(database::getConnection());
+                //listening before loading, so a change committed in between is applied after the load instead of lost
+                DueListener receiver(listener);
+                UserListener user_receiver(listener);
+                //whatever changed while we weren't listening is unknown, so the cached profiles go
+                profileCache::clear();
+                pending.clear();
+                heap.clear();
+                //a fresh process doesn't know what the one before it fired, so it looks back reminder_catchup_seconds
+                //for reminders that fell due while nothing was running (those may reach a client twice, the
+                //message carries the task id and due_at to spot them). A reconnect picks up exactly where it left off.
+                long long from_ms = fired_through ? *fired_through + 1 : nowMs() - config::get()->reminder_catchup_seconds * 1000LL;
+                load(Cursor{from_ms, 0});
+                failures = 0;
+                CROW_LOG_INFO << "Reminder scheduler started with " << pending.size() << " reminders" << (horizon ? " (more wait in the table)" : "");
+
+                while (true)
+                {
+                    long long now = nowMs();
+                    std::vector<Reminder> due = takeDue(now);
+                    if (!due.empty())
+                    {
+                        deliver(due);
+                    }
+                    //what is past the horizon hasn't been looked at yet, even if it was due already
+                    fired_through = horizon ? std::min(now, horizon->first - 1) : now;
+                    if (pending.empty() && horizon)
+                    {
+                        load(*horizon); // the ones in memory are done, bring in the next lot
+                    }
+
+                    std::optional<long long> next = nextDue();
+                    long long wait = next ? std::clamp(*next - nowMs(), 0LL, max_wait_ms) : max_wait_ms;
+                    if (wait > 0)
+                    {
+                        listener.await_notification(wait / 1000, (wait % 1000) * 1000);
+                    }
+                }
+            }
+            catch (const std::exception& e)
+            {
+                //everything from fired_through on is loaded again after reconnecting, so changes made in the meantime
+                //and reminders that fell due while the database was gone aren't missed.
+                failures++;
+                int backoff = std::min(1 << std::min(failures, 5), 30);
+                logging::error(logging::Subsystem::Database, "Reminder scheduler lost the database", {{"retry_in_s", backoff}, {"error", e.what()}});
+                std::this_thread::sleep_for(std::chrono::seconds(backoff));
+            }
+        }
+    }
+
+    void start(size_t limit)
+    {
+        max_pending = limit;
+        std::thread(run).detach();
+    }
+}
@@ -0,0 +1,20 @@
+#pragma once
+#include "crow.h"
+#include <cstddef>
+
+
+//fires a reminder when a task's due time comes. Every process keeps the upcoming due times in a min-heap and
+//follows changes through postgres NOTIFY (see notifyDue in db_functions.cpp), so the table is never polled.
+//Reminders go out over the /ws/reminders websocket to whichever worker the user is connected to.
+//The same connection listens for users deleted or renamed in the database and drops them from profileCache.
+namespace reminders
+{
+    //loads the upcoming due times and starts the scheduler thread. Once per process, after the pool is up.
+    //At most max_pending reminders are held in memory, the rest wait in the table until they are next.
+    void start(size_t max_pending);
+
+    //a websocket client of userID. It gets {"type": "reminder", "task": {...}} for each of the user's tasks
+    //that falls due, until it is unsubscribed.
+    void subscribe(int userID, crow::websocket::connection* conn);
+    void unsubscribe(crow::websocket::connection* conn);
+}
@@ -0,0 +1,567 @@
+#include "request_body.h"
+#include <cstdint>
+#include <charconv>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace requestBody
+{
+    //bodies are a few hundred bytes. Anything far bigger is not one of ours and isn't worth scanning.
+    static constexpr size_t max_body = 64 * 1024;
+    //nesting allowed inside members we skip
+    static constexpr int max_depth = 32;
+    static constexpr size_t max_username = 50;   // VARCHAR(50)
+    static constexpr size_t max_password = 1024; // hashing cost grows with it, nobody needs more
+
+    enum class Kind
+    {
+        String,
+        Null,
+        Number,
+        Other // a bool, array or object we stepped over
+    };
+
+    struct Value
+    {
+        Kind kind;
+        std::string_view text; // for strings, without the quotes and with escapes decoded. Numbers as written.
+    };
+
+    class Scanner
+    {
+    public:
+        Scanner(std::string_view body, std::list<std::string>& decoded) : body(body), decoded(decoded) {}
+
+        //calls visit(key, value) for each member of the top level object. visit returns false to stop
+        //(after setting error). False if the body isn't one well formed json object.
+        template <typename Visit>
+        bool members(Visit visit, std::string_view& error)
+        {
+            error = "Invalid json in request body";
+            if (body.size() > max_body)
+            {
+                error = "Request body is too large";
+                return false;
+            }
+            skipSpace();
+            if (!take('{'))
+            {
+                error = "Request body must be a json object";
+                return false;
+            }
+            skipSpace();
+            if (take('}'))
+            {
+                return atEnd();
+            }
+            while (true)
+            {
+                std::string_view key;
+                skipSpace();
+                if (!take('"') || !string(key))
+                {
+                    return false;
+                }
+                skipSpace();
+                if (!take(':'))
+                {
+                    return false;
+                }
+                skipSpace();
+                Value value{Kind::Other, {}};
+                if (!this->value(value, 0))
+                {
+                    return false;
+                }
+                if (!visit(key, value))
+                {
+                    return false;
+                }
+                skipSpace();
+                if (take('}'))
+                {
+                    return atEnd();
+                }
+                if (!take(','))
+                {
+                    return false;
+                }
+            }
+        }
+
+    private:
+        std::string_view body;
+        size_t pos = 0;
+        std::list<std::string>& decoded;
+
+        bool take(char c)
+        {
+            if (pos < body.size() && body[pos] == c)
+            {
+                pos++;
+                return true;
+            }
+            return false;
+        }
+
+        void skipSpace()
+        {
+            while (pos < body.size() && (body[pos] == ' ' || body[pos] == '\n' || body[pos] == '\r' || body[pos] == '\t'))
+            {
+                pos++;
+            }
+        }
+
+        bool atEnd()
+        {
+            skipSpace();
+            return pos == body.size();
+        }
+
+        //where the string starting at from ends or needs a closer look: the next quote, backslash or control
+        //character. With SSE2 that is checked 16 bytes at a time.
+        size_t findSpecial(size_t from) const
+        {
+            const char* data = body.data();
+            size_t i = from;
+#if defined(__SSE2__)
+            const __m128i quote = _mm_set1_epi8('"');
+            const __m128i backslash = _mm_set1_epi8('\\');
+            const __m128i control = _mm_set1_epi8(0x1F);
+            for (; i + 16 <= body.size(); i += 16)
+            {
+                __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+                //c <= 0x1F exactly when max(c, 0x1F) == 0x1F, compared unsigned
+                __m128i hits = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash)),
+                                            _mm_cmpeq_epi8(_mm_max_epu8(chunk, control), control));
+                int mask = _mm_movemask_epi8(hits);
+                if (mask != 0)
+                {
+                    return i + static_cast<size_t>(__builtin_ctz(static_cast<unsigned>(mask)));
+                }
+            }
+#endif
+            for (; i < body.size(); i++)
+            {
+                unsigned char c = static_cast<unsigned char>(data[i]);
+                if (c == '"' || c == '\\' || c < 0x20)
+                {
+                    return i;
+                }
+            }
+            return body.size();
+        }
+
+        static int hexDigit(char c)
+        {
+            if (c >= '0' && c <= '9') return c - '0';
+            if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+            if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+            return -1;
+        }
+
+        bool hex4(uint32_t& out)
+        {
+            if (pos + 4 > body.size())
+            {
+                return false;
+            }
+            out = 0;
+            for (int i = 0; i < 4; i++)
+            {
+                int digit = hexDigit(body[pos + i]);
+                if (digit < 0)
+                {
+                    return false;
+                }
+                out = out * 16 + static_cast<uint32_t>(digit);
+            }
+            pos += 4;
+            return true;
+        }
+
+        static void appendUtf8(std::string& out, uint32_t cp)
+        {
+            if (cp < 0x80)
+            {
+                out += static_cast<char>(cp);
+            }
+            else if (cp < 0x800)
+            {
+                out += static_cast<char>(0xC0 | (cp >> 6));
+                out += static_cast<char>(0x80 | (cp & 0x3F));
+            }
+            else if (cp < 0x10000)
+            {
+                out += static_cast<char>(0xE0 | (cp >> 12));
+                out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+                out += static_cast<char>(0x80 | (cp & 0x3F));
+            }
+            else
+            {
+                out += static_cast<char>(0xF0 | (cp >> 18));
+                out += static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+                out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+                out += static_cast<char>(0x80 | (cp & 0x3F));
+            }
+        }
+
+        //the opening quote is already taken. Without escapes out is a view into the body.
+        bool string(std::string_view& out)
+        {
+            size_t start = pos;
+            size_t stop = findSpecial(pos);
+            if (stop < body.size() && body[stop] == '"')
+            {
+                out = body.substr(start, stop - start);
+                pos = stop + 1;
+                return true;
+            }
+
+            //escapes (or garbage): decode into a string of our own
+            std::string& text = decoded.emplace_back(body.substr(start, stop - start));
+            pos = stop;
+            while (pos < body.size())
+            {
+                char c = body[pos++];
+                if (c == '"')
+                {
+                    out = text;
+                    return true;
+                }
+                if (static_cast<unsigned char>(c) < 0x20)
+                {
+                    return false; // control characters have to be escaped
+                }
+                if (c != '\\')
+                {
+                    size_t next = findSpecial(pos);
+                    text += c;
+                    text.append(body.substr(pos, next - pos));
+                    pos = next;
+                    continue;
+                }
+                if (pos >= body.size())
+                {
+                    return false;
+                }
+                switch (body[pos++])
+                {
+                    case '"': text += '"'; break;
+                    case '\\': text += '\\'; break;
+                    case '/': text += '/'; break;
+                    case 'b': text += '\b'; break;
+                    case 'f': text += '\f'; break;
+                    case 'n': text += '\n'; break;
+                    case 'r': text += '\r'; break;
+                    case 't': text += '\t'; break;
+                    case 'u':
+                    {
+                        uint32_t cp;
+                        if (!hex4(cp))
+                        {
+                            return false;
+                        }
+                        if (cp >= 0xD800 && cp <= 0xDBFF)
+                        {
+                            //a surrogate pair, the second half has to follow right away
+                            uint32_t low;
+                            if (!take('\\') || !take('u') || !hex4(low) || low < 0xDC00 || low > 0xDFFF)
+                            {
+                                return false;
+                            }
+                            cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                        }
+                        else if (cp >= 0xDC00 && cp <= 0xDFFF)
+                        {
+                            return false;
+                        }
+                        appendUtf8(text, cp);
+                        break;
+                    }
+                    default:
+                        return false;
+                }
+            }
+            return false; // never closed
+        }
+
+        bool literal(std::string_view word)
+        {
+            if (body.substr(pos, word.size()) != word)
+            {
+                return false;
+            }
+            pos += word.size();
+            return true;
+        }
+
+        bool number()
+        {
+            size_t start = pos;
+            take('-');
+            if (take('0'))
+            {
+                // no leading zeros
+            }
+            else if (!digits())
+            {
+                return false;
+            }
+            if (take('.') && !digits())
+            {
+                return false;
+            }
+            if (take('e') || take('E'))
+            {
+                if (!take('+'))
+                {
+                    take('-');
+                }
+                if (!digits())
+                {
+                    return false;
+                }
+            }
+            return pos > start;
+        }
+
+        bool digits()
+        {
+            size_t start = pos;
+            while (pos < body.size() && body[pos] >= '0' && body[pos] <= '9')
+            {
+                pos++;
+            }
+            return pos > start;
+        }
+
+        bool value(Value& out, int depth)
+        {
+            if (pos >= body.size() || depth > max_depth)
+            {
+                return false;
+            }
+            char c = body[pos];
+            if (c == '"')
+            {
+                pos++;
+                out.kind = Kind::String;
+                return string(out.text);
+            }
+            out.kind = Kind::Other;
+            if (c == 'n')
+            {
+                out.kind = Kind::Null;
+                return literal("null");
+            }
+            if (c == 't')
+            {
+                return literal("true");
+            }
+            if (c == 'f')
+            {
+                return literal("false");
+            }
+            if (c == '{' || c == '[')
+            {
+                //a container nobody asked for, stepped over member by member
+                char close = c == '{' ? '}' : ']';
+                pos++;
+                skipSpace();
+                if (take(close))
+                {
+                    return true;
+                }
+                while (true)
+                {
+                    skipSpace();
+                    if (c == '{')
+                    {
+                        std::string_view key;
+                        if (!take('"') || !string(key))
+                        {
+                            return false;
+                        }
+                        skipSpace();
+                        if (!take(':'))
+                        {
+                            return false;
+                        }
+                        skipSpace();
+                    }
+                    Value inner{Kind::Other, {}};
+                    if (!value(inner, depth + 1))
+                    {
+                        return false;
+                    }
+                    skipSpace();
+                    if (take(close))
+                    {
+                        return true;
+                    }
+                    if (!take(','))
+                    {
+                        return false;
+                    }
+                }
+            }
+            size_t start = pos;
+            if (!number())
+            {
+                return false;
+            }
+            out.kind = Kind::Number;
+            out.text = body.substr(start, pos - start);
+            return true;
+        }
+    };
+
+    std::optional<TaskFields> parseTask(std::string_view body, std::string_view& error)
+    {
+        TaskFields fields;
+        Scanner scanner(body, fields.decoded);
+        bool ok = scanner.members([&](std::string_view key, const Value& value)
+        {
+            if (key == "description")
+            {
+                if (value.kind != Kind::String || !validDescription(value.text))
+                {
+                    error = "'description' must be a string of 1 to 256 characters";
+                    return false;
+                }
+                fields.description = value.text;
+            }
+            else if (key == "status")
+            {
+                if (value.kind != Kind::String)
+                {
+                    error = "'status' must be todo, inprogress or completed";
+                    return false;
+                }
+                fields.Estatus = parseStatus(value.text);
+                if (!fields.Estatus)
+                {
+                    error = "'status' must be todo, inprogress or completed";
+                    return false;
+                }
+            }
+            else if (key == "due_at")
+            {
+                std::optional<long long> due;
+                if (value.kind == Kind::String)
+                {
+                    due = parseDueTime(value.text);
+                }
+                if ((value.kind != Kind::String && value.kind != Kind::Null) || (value.kind == Kind::String && !due))
+                {
+                    error = "'due_at' must be a time with a zone, like 2025-03-01T09:00:00Z, or null";
+                    return false;
+                }
+                fields.due_ms = due;
+            }
+            return true;
+        }, error);
+
+        if (!ok)
+        {
+            return std::nullopt;
+        }
+        return fields;
+    }
+
+    std::optional<Move> parseMove(std::string_view body, std::string_view& error)
+    {
+        Move move{false, std::nullopt};
+        bool has_after = false;
+        bool has_before = false;
+        std::list<std::string> decoded; // only keys with escapes end up here, nothing we keep
+        Scanner scanner(body, decoded);
+        bool ok = scanner.members([&](std::string_view key, const Value& value)
+        {
+            if (key != "after" && key != "before")
+            {
+                return true;
+            }
+            move.after = key == "after";
+            if (move.after)
+            {
+                has_after = true;
+            }
+            else
+            {
+                has_before = true;
+            }
+            move.anchorID.reset();
+            if (value.kind == Kind::Null)
+            {
+                return true;
+            }
+            //from_chars stops at a fraction or exponent and fails past int, neither can be one of our ids
+            int id = 0;
+            auto [end, ec] = std::from_chars(value.text.data(), value.text.data() + value.text.size(), id);
+            if (value.kind != Kind::Number || ec != std::errc() || end != value.text.data() + value.text.size())
+            {
+                error = "'after' and 'before' take a task id or null";
+                return false;
+            }
+            move.anchorID = id;
+            return true;
+        }, error);
+
+        if (!ok)
+        {
+            return std::nullopt;
+        }
+        if (has_after == has_before)
+        {
+            error = "Expected exactly one of 'after' or 'before' (a task id, or null)";
+            return std::nullopt;
+        }
+        return move;
+    }
+
+    std::optional<Credentials> parseCredentials(std::string_view body, std::string_view& error)
+    {
+        Credentials credentials;
+        bool has_username = false;
+        bool has_password = false;
+        Scanner scanner(body, credentials.decoded);
+        bool ok = scanner.members([&](std::string_view key, const Value& value)
+        {
+            if (key == "username")
+            {
+                if (value.kind != Kind::String || value.text.empty() || utf8Length(value.text) > max_username)
+                {
+                    error = "'username' must be a string of 1 to 50 characters";
+                    return false;
+                }
+                credentials.username = value.text;
+                has_username = true;
+            }
+            else if (key == "password")
+            {
+                if (value.kind != Kind::String || value.text.empty() || value.text.size() > max_password)
+                {
+                    error = "'password' must be a string of 1 to 1024 characters";
+                    return false;
+                }
+                credentials.password = value.text;
+                has_password = true;
+            }
+            return true;
+        }, error);
+
+        if (!ok)
+        {
+            return std::nullopt;
+        }
+        if (!has_username || !has_password)
+        {
+            error = "Missing username or password";
+            return std::nullopt;
+        }
+        return credentials;
+    }
+}
@@ -0,0 +1,43 @@
+#pragma once
+#include "task.hpp"
+#include <string>
+#include <string_view>
+#include <optional>
+#include <list>
+
+
+//parsing and validation for the small json bodies of the write and auth routes. One pass over the body, no
+//tree is built and strings come back as views into the request buffer (only strings with escapes in them are
+//decoded into a copy). A bad body is turned away before anything else runs, with error saying why.
+namespace requestBody
+{
+    //POST /tasks and PUT /tasks/<id>. Every member is optional here, the route decides which it needs.
+    struct TaskFields
+    {
+        std::optional<std::string_view> description; // already checked against the column's 256 characters
+        std::optional<status> Estatus;
+        //outer empty: not in the body. Inner empty: "due_at": null.
+        std::optional<std::optional<long long>> due_ms;
+        std::list<std::string> decoded; // owns the strings that had escapes, a list so the views survive a move
+    };
+
+    //PATCH /tasks/<id>/move: exactly one of "after" or "before", a task id or null
+    struct Move
+    {
+        bool after;
+        std::optional<int> anchorID; // empty for null: the top with after, the bottom with before
+    };
+
+    struct Credentials
+    {
+        std::string_view username;
+        std::string_view password;
+        std::list<std::string> decoded;
+    };
+
+    //nullopt means the body was rejected and error (a static string) says why.
+    //members nobody asked for are skipped, duplicates take the last value.
+    std::optional<TaskFields> parseTask(std::string_view body, std::string_view& error);
+    std::optional<Move> parseMove(std::string_view body, std::string_view& error);
+    std::optional<Credentials> parseCredentials(std::string_view body, std::string_view& error);
+}
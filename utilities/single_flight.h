@@ -0,0 +1,121 @@
+#pragma once
+#include "metrics.h"
+#include "deadline.h"
+#include "circuit_breaker.h"
+#include <algorithm>
+#include <chrono>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <string>
+
+
+//single-flight: concurrent calls for the same key share one load. The first caller runs it and the others
+//wait for its result (or get its exception). Nothing is kept once the load is done, this is not a cache.
+//A caller never waits past its own request deadline, and one whose load was cut short by someone else's
+//deadline gets another go.
+template <typename Key, typename Value>
+class SingleFlight
+{
+public:
+    //every call that joins someone else's load is counted in the counter with this name
+    explicit SingleFlight(const std::string& counter_name)
+        : coalesced(metrics::counter(counter_name))
+    {
+    }
+
+    template <typename Load>
+    Value run(const Key& key, Load load)
+    {
+        for (int attempt = 1; ; ++attempt)
+        {
+            std::shared_future<Value> joined;
+            std::shared_ptr<Flight> own;
+            {
+                std::lock_guard<std::mutex> lock(flights_mutex);
+                auto it = flights.find(key);
+                if (it != flights.end())
+                {
+                    joined = it->second->result;
+                }
+                else
+                {
+                    own = std::make_shared<Flight>();
+                    own->result = own->promise.get_future().share();
+                    flights.emplace(key, own);
+                }
+            }
+
+            if (!own)
+            {
+                coalesced.fetch_add(1, std::memory_order_relaxed);
+                //the load runs on the leader's budget, which may be longer than ours
+                std::optional<long long> remaining = deadline::remainingMs();
+                if (remaining && joined.wait_for(std::chrono::milliseconds(std::max(*remaining, 0LL))) != std::future_status::ready)
+                {
+                    throw database::unavailable("Request deadline passed while waiting for a shared read");
+                }
+                try
+                {
+                    return joined.get();
+                }
+                catch (const database::unavailable&)
+                {
+                    //the leader may just have run out of its own deadline. With time left we try once more,
+                    //leading a new load or joining one that started after it.
+                    remaining = deadline::remainingMs();
+                    if (attempt > 1 || (remaining && *remaining <= 0))
+                    {
+                        throw;
+                    }
+                    continue;
+                }
+            }
+
+            try
+            {
+                Value value = load();
+                land(key, own);
+                own->promise.set_value(value);
+                return value;
+            }
+            catch (...)
+            {
+                land(key, own);
+                own->promise.set_exception(std::current_exception());
+                throw;
+            }
+        }
+    }
+
+    //call after a write: whoever asks for key from now on starts a new load instead of joining one that
+    //may have read the data before the write. Those already waiting still get the old load's result.
+    void forget(const Key& key)
+    {
+        std::lock_guard<std::mutex> lock(flights_mutex);
+        flights.erase(key);
+    }
+
+private:
+    struct Flight
+    {
+        std::promise<Value> promise;
+        std::shared_future<Value> result;
+    };
+
+    //taken out before the result is handed over, so nobody joins a load that has already finished
+    void land(const Key& key, const std::shared_ptr<Flight>& flight)
+    {
+        std::lock_guard<std::mutex> lock(flights_mutex);
+        auto it = flights.find(key);
+        if (it != flights.end() && it->second == flight) // forget() may have let a newer one in
+        {
+            flights.erase(it);
+        }
+    }
+
+    std::mutex flights_mutex;
+    std::unordered_map<Key, std::shared_ptr<Flight>> flights;
+    std::atomic<uint64_t>& coalesced;
+};
@@ -0,0 +1,333 @@
+#include "task_io.h"
+#include "background.h"
+#include "crow.h"
+#include <vector>
+#include <stdexcept>
+#include <random>
+#include <chrono>
+#include <mutex>
+#ifndef _WIN32
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace taskIO
+{
+    std::optional<Format> toFormat(const std::string& name)
+    {
+        if (name == "ndjson" || name.empty()) // ndjson is the default
+        {
+            return Format::Ndjson;
+        }
+        if (name == "csv")
+        {
+            return Format::Csv;
+        }
+        return std::nullopt;
+    }
+
+    std::string contentType(Format format)
+    {
+        return format == Format::Csv ? "text/csv; charset=utf-8" : "application/x-ndjson";
+    }
+
+    std::string extension(Format format)
+    {
+        return format == Format::Csv ? ".csv" : ".ndjson";
+    }
+
+    std::filesystem::path newExportFile(int userID, Format format)
+    {
+        namespace fs = std::filesystem;
+        fs::path dir = fs::temp_directory_path() / "todo-exports";
+        fs::create_directories(dir);
+        //also fixes a directory made by an older version with the umask's permissions
+        fs::permissions(dir, fs::perms::owner_all, fs::perm_options::replace);
+
+        std::error_code ec; // cleanup is best effort, a file we can't remove now goes on the next export
+        auto cutoff = fs::file_time_type::clock::now() - std::chrono::minutes(10);
+        for (const auto& entry : fs::directory_iterator(dir, ec))
+        {
+            if (entry.is_regular_file(ec) && entry.last_write_time(ec) < cutoff)
+            {
+                fs::remove(entry.path(), ec);
+            }
+        }
+
+        std::random_device rd;
+        std::string name = "tasks-" + std::to_string(userID) + "-" + std::to_string(rd()) + std::to_string(rd()) + extension(format);
+        fs::path path = dir / name;
+#ifndef _WIN32
+        //created here with 0600 so the ofstream that writes it opens an existing file and never applies the umask
+        int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0600);
+        if (fd < 0)
+        {
+            throw std::runtime_error("could not create export file " + path.string() + ": " + std::strerror(errno));
+        }
+        ::close(fd);
+#endif
+        return path;
+    }
+
+#ifdef __linux__
+    //descriptors of released export files and when they were released. Crow opens the file itself as soon as the
+    //handler returns, after that our descriptor only keeps the inode alive, so it is closed a minute later.
+    struct Released
+    {
+        int fd;
+        std::chrono::steady_clock::time_point at;
+    };
+    static std::vector<Released> released;
+    static std::mutex released_mutex;
+    static constexpr auto release_hold = std::chrono::seconds(60);
+
+    static void closeReleased()
+    {
+        auto cutoff = std::chrono::steady_clock::now() - release_hold;
+        std::lock_guard<std::mutex> lock(released_mutex);
+        std::erase_if(released, [cutoff](const Released& file)
+        {
+            if (file.at >= cutoff)
+            {
+                return false;
+            }
+            ::close(file.fd);
+            return true;
+        });
+    }
+
+    std::string releaseExportFile(const std::filesystem::path& path)
+    {
+        static std::once_flag sweeper;
+        std::call_once(sweeper, []()
+        {
+            background::every("export-files", release_hold, closeReleased);
+        });
+
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            throw std::runtime_error("could not reopen export file " + path.string() + ": " + std::strerror(errno));
+        }
+        ::unlink(path.c_str());
+        {
+            std::lock_guard<std::mutex> lock(released_mutex);
+            released.push_back(Released{fd, std::chrono::steady_clock::now()});
+        }
+        return "/proc/self/fd/" + std::to_string(fd);
+    }
+#else
+    std::string releaseExportFile(const std::filesystem::path& path)
+    {
+        return path.string(); // removed by newExportFile once it's old
+    }
+#endif
+
+    void discardExportFile(const std::filesystem::path& path)
+    {
+        std::error_code ec;
+        std::filesystem::remove(path, ec);
+    }
+
+    //a csv field only needs quotes if it has a comma, a quote or a line break in it. Quotes inside are doubled.
+    static void writeCsvField(std::ostream& out, std::string_view field)
+    {
+        if (field.find_first_of(",\"\r\n") == std::string_view::npos)
+        {
+            out << field;
+            return;
+        }
+        out << '"';
+        for (char c : field)
+        {
+            if (c == '"')
+            {
+                out << '"';
+            }
+            out << c;
+        }
+        out << '"';
+    }
+
+    void writeHeader(std::ostream& out, Format format)
+    {
+        if (format == Format::Csv)
+        {
+            out << "id,description,status\n";
+        }
+    }
+
+    void writeRow(std::ostream& out, Format format, int id, std::string_view description, std::string_view Tstatus)
+    {
+        if (format == Format::Csv)
+        {
+            out << id << ',';
+            writeCsvField(out, description);
+            out << ',';
+            writeCsvField(out, Tstatus);
+            out << '\n';
+            return;
+        }
+
+        crow::json::wvalue task_json;
+        task_json["id"] = id;
+        task_json["description"] = std::string(description);
+        task_json["status"] = std::string(Tstatus);
+        out << task_json.dump() << '\n';
+    }
+
+    Reader::Reader(std::string_view body, Format format) : rest(body), format(format)
+    {
+    }
+
+    std::optional<std::string_view> Reader::nextLine()
+    {
+        if (rest.empty())
+        {
+            return std::nullopt;
+        }
+        size_t end = rest.find('\n');
+        std::string_view line = rest.substr(0, end);
+        rest = end == std::string_view::npos ? std::string_view() : rest.substr(end + 1);
+        line_number++;
+        if (!line.empty() && line.back() == '\r')
+        {
+            line.remove_suffix(1);
+        }
+        return line;
+    }
+
+    //a csv record can span lines when a quoted field has a line break in it, so this walks characters, not lines
+    std::optional<std::vector<std::string>> Reader::nextCsvRecord()
+    {
+        if (rest.empty())
+        {
+            return std::nullopt;
+        }
+        line_number++;
+        int start_line = line_number;
+
+        std::vector<std::string> fields(1);
+        bool quoted = false;
+        size_t i = 0;
+        for (; i < rest.size(); ++i)
+        {
+            char c = rest[i];
+            if (quoted)
+            {
+                if (c == '"' && i + 1 < rest.size() && rest[i + 1] == '"')
+                {
+                    fields.back() += '"';
+                    ++i;
+                }
+                else if (c == '"')
+                {
+                    quoted = false;
+                }
+                else
+                {
+                    if (c == '\n')
+                    {
+                        line_number++;
+                    }
+                    fields.back() += c;
+                }
+            }
+            else if (c == '"' && fields.back().empty())
+            {
+                quoted = true;
+            }
+            else if (c == ',')
+            {
+                fields.emplace_back();
+            }
+            else if (c == '\n')
+            {
+                break;
+            }
+            else if (c != '\r')
+            {
+                fields.back() += c;
+            }
+        }
+        if (quoted)
+        {
+            throw std::invalid_argument("line " + std::to_string(start_line) + ": unterminated quoted field");
+        }
+        rest = i < rest.size() ? rest.substr(i + 1) : std::string_view();
+        return fields;
+    }
+
+    std::optional<ImportRow> Reader::next()
+    {
+        if (format == Format::Ndjson)
+        {
+            while (std::optional<std::string_view> line = nextLine())
+            {
+                if (line->find_first_not_of(" \t") == std::string_view::npos)
+                {
+                    continue; // blank lines are allowed
+                }
+                auto json = crow::json::load(line->data(), line->size());
+                if (!json || json.t() != crow::json::type::Object || !json.count("description") ||
+                    json["description"].t() != crow::json::type::String)
+                {
+                    throw std::invalid_argument("line " + std::to_string(line_number) + ": expected an object with a string 'description'");
+                }
+                ImportRow row{json["description"].s(), "todo"};
+                if (json.count("status"))
+                {
+                    //s() throws a plain runtime_error for anything but a string, which would come out as a 500
+                    if (json["status"].t() != crow::json::type::String)
+                    {
+                        throw std::invalid_argument("line " + std::to_string(line_number) + ": 'status' must be a string");
+                    }
+                    row.Tstatus = json["status"].s();
+                }
+                return row;
+            }
+            return std::nullopt;
+        }
+
+        //csv: the first record is the header and tells us which columns hold what
+        if (description_column < 0)
+        {
+            std::optional<std::vector<std::string>> header = nextCsvRecord();
+            if (!header)
+            {
+                return std::nullopt;
+            }
+            for (size_t i = 0; i < header->size(); ++i)
+            {
+                if ((*header)[i] == "description") description_column = static_cast<int>(i);
+                if ((*header)[i] == "status") status_column = static_cast<int>(i);
+            }
+            if (description_column < 0)
+            {
+                throw std::invalid_argument("line 1: csv header needs a 'description' column");
+            }
+        }
+
+        while (std::optional<std::vector<std::string>> record = nextCsvRecord())
+        {
+            if (record->size() == 1 && (*record)[0].empty())
+            {
+                continue; // blank line
+            }
+            if (static_cast<int>(record->size()) <= description_column ||
+                (status_column >= 0 && static_cast<int>(record->size()) <= status_column))
+            {
+                throw std::invalid_argument("line " + std::to_string(line_number) + ": missing columns");
+            }
+            ImportRow row{std::move((*record)[description_column]), "todo"};
+            if (status_column >= 0 && !(*record)[status_column].empty())
+            {
+                row.Tstatus = std::move((*record)[status_column]);
+            }
+            return row;
+        }
+        return std::nullopt;
+    }
+}
@@ -0,0 +1,65 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <optional>
+#include <vector>
+#include <ostream>
+#include <filesystem>
+
+
+//row formats for bulk export and import of tasks. Everything here works one row at a time,
+//so nothing ever needs the whole data set in memory.
+namespace taskIO
+{
+    enum class Format
+    {
+        Ndjson, // one json object per line
+        Csv
+    };
+
+    //"ndjson" or "csv", nullopt for anything else
+    std::optional<Format> toFormat(const std::string& name);
+    std::string contentType(Format format);
+    std::string extension(Format format);
+
+    //a fresh file to write an export into. Crow sends files from disk in small chunks, so an export never sits in memory.
+    //The directory is only accessible to us (0700) and the file is created 0600, it holds the user's whole task list.
+    std::filesystem::path newExportFile(int userID, Format format);
+
+    //once the export is written: takes the file out of the directory and returns the path to hand to
+    //set_static_file_info. On linux that is /proc/self/fd/N of the already unlinked file, so nothing is left on
+    //disk once crow has sent it. Elsewhere it's the file itself, removed by a later export after 10 minutes.
+    std::string releaseExportFile(const std::filesystem::path& path);
+    //a half written export after an error, just deleted
+    void discardExportFile(const std::filesystem::path& path);
+
+    void writeHeader(std::ostream& out, Format format);
+    void writeRow(std::ostream& out, Format format, int id, std::string_view description, std::string_view Tstatus);
+
+    struct ImportRow
+    {
+        std::string description;
+        std::string Tstatus;
+    };
+
+    //reads rows one by one out of an import body
+    class Reader
+    {
+    public:
+        Reader(std::string_view body, Format format);
+
+        //the next row, or nullopt at the end. Throws std::invalid_argument (with the line number) on a malformed row.
+        std::optional<ImportRow> next();
+        int line() const { return line_number; }
+
+    private:
+        std::optional<std::string_view> nextLine();
+        std::optional<std::vector<std::string>> nextCsvRecord();
+
+        std::string_view rest;
+        Format format;
+        int line_number = 0;
+        int description_column = -1; // csv only, found from the header
+        int status_column = -1;
+    };
+}